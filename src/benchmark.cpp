@@ -0,0 +1,572 @@
+// Copyright 2015 Markus Dittrich
+// Licensed under BSD license, see LICENSE file for details
+
+// mcell_bench times the performance critical parts of the simulator on a
+// generated cube mesh of configurable size and molecule density and writes
+// the results as JSON. Each benchmark reports the best of several repeats
+// in terms of items per second, e.g. molecule-steps per second for diffusion.
+// With --check it instead runs the consistency checks of checks.hpp on the
+// same mesh and exits with a non-zero status if any of them fails.
+// To show the effect of memory locality the time step benchmark is also run
+// on a copy of the mesh with randomly shuffled tets, once as is and once
+// reordered by add_geometry. Where perf counters are available each result
+// includes the hardware cache misses of its best repeat.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <type_traits>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "checks.hpp"
+#include "dataflow.hpp"
+#include "diffuse.hpp"
+#include "geometry.hpp"
+#include "io.hpp"
+#include "mesh_gen.hpp"
+#include "placement.hpp"
+#include "rng.hpp"
+#include "state.hpp"
+#include "step.hpp"
+#include "thread_pool.hpp"
+
+
+using std::cerr;
+using std::endl;
+
+// number of random rays used by the intersection benchmarks
+const size_t numRays = 1 << 20;
+
+// diffusion coefficient of the benchmark species
+const double benchD = 600;
+
+// time step used by all benchmarks
+const double benchDt = 1e-6;
+
+// seed of the random tet order used by --shuffle and the shuffled step
+// benchmarks
+const uint64_t shuffleSeed = 1;
+
+
+// CacheMissCounter counts the hardware cache misses of the process and of all
+// threads it starts after the counter was created. It is not available on
+// systems other than Linux or if perf_event_paranoid doesn't allow it.
+class CacheMissCounter {
+
+public:
+  CacheMissCounter();
+  ~CacheMissCounter();
+
+  CacheMissCounter(const CacheMissCounter& c) = delete;
+  CacheMissCounter& operator=(const CacheMissCounter& c) = delete;
+
+  bool available() const noexcept {
+    return fd_ >= 0;
+  }
+
+  // start resets and enables the counter, stop disables it and returns the
+  // number of misses since start or -1 if the counter isn't available
+  void start();
+  int64_t stop();
+
+private:
+  int fd_ = -1;
+};
+
+
+#ifdef __linux__
+CacheMissCounter::CacheMissCounter() {
+  perf_event_attr attr{};
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.config = PERF_COUNT_HW_CACHE_MISSES;
+  attr.disabled = 1;
+  attr.inherit = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  fd_ = int(syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0));
+}
+
+CacheMissCounter::~CacheMissCounter() {
+  if (fd_ >= 0) {
+    close(fd_);
+  }
+}
+
+void CacheMissCounter::start() {
+  if (fd_ >= 0) {
+    ioctl(fd_, PERF_EVENT_IOC_RESET, 0);
+    ioctl(fd_, PERF_EVENT_IOC_ENABLE, 0);
+  }
+}
+
+int64_t CacheMissCounter::stop() {
+  if (fd_ < 0) {
+    return -1;
+  }
+  ioctl(fd_, PERF_EVENT_IOC_DISABLE, 0);
+  uint64_t count = 0;
+  if (read(fd_, &count, sizeof(count)) != sizeof(count)) {
+    return -1;
+  }
+  return int64_t(count);
+}
+#else
+CacheMissCounter::CacheMissCounter() {}
+CacheMissCounter::~CacheMissCounter() {}
+void CacheMissCounter::start() {}
+int64_t CacheMissCounter::stop() {
+  return -1;
+}
+#endif
+
+
+// BenchResult holds the outcome of a single benchmark
+struct BenchResult {
+  std::string name;
+  std::string unit;   // what is counted by items
+  size_t items;       // items processed per repeat
+  double seconds;     // best time across repeats
+  int64_t cacheMisses; // cache misses of the best repeat, -1 if unavailable
+};
+
+
+// run_bench calls setup and then times work, which returns the number of
+// items it processed, repeats times. setup is not timed.
+static BenchResult run_bench(CacheMissCounter& misses, const std::string& name,
+  const std::string& unit, size_t repeats, const std::function<void()>& setup,
+  const std::function<size_t()>& work) {
+  BenchResult r{name, unit, 0, 0.0, -1};
+  for (size_t i = 0; i < repeats; ++i) {
+    setup();
+    misses.start();
+    auto start = std::chrono::steady_clock::now();
+    r.items = work();
+    double t = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start).count();
+    int64_t m = misses.stop();
+    if (i == 0 || t < r.seconds) {
+      r.seconds = t;
+      r.cacheMisses = m;
+    }
+  }
+  cerr << name << ": " << r.items / r.seconds << " " << unit << "/s" << endl;
+  return r;
+}
+
+
+// clear_mols removes all molecules from state, including any left in the
+// incoming and outgoing queues by process_tet
+static void clear_mols(State& state) {
+  for (size_t i = 0; i < state.tets().size(); ++i) {
+    state.tetMols(i).activeMols.clear();
+    state.tetMols(i).inMols.clear();
+    clear_outgoing_mols(state, i);
+  }
+  state.set_active_tets(SizeTVec());
+}
+
+
+// bench_state creates a state on mesh and tets holding the single benchmark
+// species. If reorder is set the tets are renumbered for spatial locality.
+static std::unique_ptr<State> bench_state(const geom::Mesh& mesh,
+  const geom::Tets& tets, bool reorder, CollisionMode collisionMode) {
+  std::unique_ptr<State> state(new State(benchDt));
+  state->add_geometry(mesh, tets, reorder);
+  state->set_collision_mode(collisionMode);
+  state->create_species(MolSpecies("A", benchD));
+  return state;
+}
+
+
+// shuffle_tets randomly permutes the tets of cm, which destroys the spatial
+// locality of the generated mesh. The order only depends on seed.
+static void shuffle_tets(CubeMesh& cm, uint64_t seed) {
+  RngUniform rng(seed, 0, 2);
+  auto& tv = cm.tetVerts;
+  for (size_t i = tv.size(); i > 1; --i) {
+    size_t j = std::min(size_t(rng.gen() * i), i - 1);
+    std::swap(tv[i - 1], tv[j]);
+  }
+}
+
+
+// step_bench times steps iterations of the time step loop on state starting
+// from numMols molecules of species 0
+static BenchResult step_bench(CacheMissCounter& misses,
+  const std::string& name, State& state, ThreadPool& pool, size_t numMols,
+  size_t steps, size_t repeats) {
+  auto r = run_bench(misses, name, "molecule-steps", repeats,
+    [&]{
+      clear_mols(state);
+      release_mols(state, pool, 0, numMols, 0.0, 0);
+    },
+    [&]{
+      for (size_t i = 1; i <= steps; ++i) {
+        step(state, pool, i);
+      }
+      return steps * numMols;
+    });
+  clear_mols(state);
+  return r;
+}
+
+
+// Ray is a random segment starting within the mesh
+struct Ray {
+  geom::Vec3 p0;
+  geom::Vec3 disp;
+  size_t tetID;
+};
+
+
+// random_rays creates numRays rays starting at uniformly distributed points
+// within random tets of state with displacements of typical diffusion length
+static Rvector<Ray> random_rays(State& state, ThreadPool& pool) {
+  clear_mols(state);
+  release_mols(state, pool, 0, numRays, 0.0, 0);
+  double scale = sqrt(4 * benchD * benchDt);
+  RngNorm rng(state.seed(), 0, 0);
+  Rvector<Ray> rays;
+  rays.reserve(numRays);
+  for (auto tetID : state.active_tets()) {
+    const auto& mols = state.tetMols(tetID).activeMols[0];
+    for (size_t i = 0; i < mols.size(); ++i) {
+      geom::Vec3 disp{scale * rng.gen(), scale * rng.gen(), scale * rng.gen()};
+      rays.push_back(Ray{geom::Vec3(mols.pos[i]), disp, tetID});
+    }
+  }
+  clear_mols(state);
+  return rays;
+}
+
+
+// gather_volumes sums the volumes of the four neighbors nbs[4 * i + k] of
+// all tets i in tetIDs, which mimics the indirect accesses of the diffusion
+// kernels
+template <typename IndexPolicy>
+static double gather_volumes(const Rvector<double, IndexPolicy>& volumes,
+  const Rvector<size_t, IndexPolicy>& nbs, const SizeTVec& tetIDs) {
+  double sum = 0.0;
+  for (auto tetID : tetIDs) {
+    for (size_t k = 0; k < 4; ++k) {
+      sum += volumes[nbs[4 * tetID + k]];
+    }
+  }
+  return sum;
+}
+
+
+// write_json writes the configuration and the benchmark results to out
+static void write_json(std::ostream& out, size_t size, size_t numTets,
+  double density, size_t steps, size_t threads, size_t repeats,
+  const std::string& collision, bool reorder, bool shuffle,
+  bool cacheMisses, const Rvector<BenchResult>& results) {
+  bool boundsCheck = std::is_same<DefaultIndexPolicy, CheckedIndex>::value;
+  out << "{\n"
+      << "  \"config\": {\n"
+      << "    \"bounds_check\": " << (boundsCheck ? "true" : "false") << ",\n"
+      << "    \"mol_vec3_size\": " << sizeof(MolVec3) << ",\n"
+      << "    \"size\": " << size << ",\n"
+      << "    \"tets\": " << numTets << ",\n"
+      << "    \"density\": " << density << ",\n"
+      << "    \"steps\": " << steps << ",\n"
+      << "    \"threads\": " << threads << ",\n"
+      << "    \"repeats\": " << repeats << ",\n"
+      << "    \"collision\": \"" << collision << "\",\n"
+      << "    \"reorder\": " << (reorder ? "true" : "false") << ",\n"
+      << "    \"shuffle\": " << (shuffle ? "true" : "false") << ",\n"
+      << "    \"cache_misses\": " << (cacheMisses ? "true" : "false") << "\n"
+      << "  },\n"
+      << "  \"benchmarks\": [\n";
+  for (size_t i = 0; i < results.size(); ++i) {
+    const auto& r = results[i];
+    out << "    {\"name\": \"" << r.name << "\", \"unit\": \"" << r.unit
+        << "\", \"items\": " << r.items << ", \"seconds\": " << r.seconds
+        << ", \"items_per_second\": " << r.items / r.seconds;
+    if (r.cacheMisses >= 0) {
+      out << ", \"cache_misses\": " << r.cacheMisses;
+    }
+    out << "}" << (i + 1 < results.size() ? ",\n" : "\n");
+  }
+  out << "  ]\n"
+      << "}" << endl;
+}
+
+
+// usage prints a short description of the command line options
+static void usage(const char* prog) {
+  cerr << "usage: " << prog << " [--size <n>] [--edge <length>]"
+       << " [--density <n>] [--steps <n>] [--threads <n>] [--repeats <n>]"
+       << " [--out <file>] [--collision <mode>] [--reorder] [--shuffle]"
+       << " [--check] [--check-ref <file>]\n"
+       << "  --size <n>         cube mesh of 6 * n^3 tets (default 32)\n"
+       << "  --edge <length>    edge length of the cube mesh (default 1)\n"
+       << "  --density <n>      molecules per tet (default 10)\n"
+       << "  --steps <n>        iterations of the time step benchmark (default 10)\n"
+       << "  --threads <n>      threads used by the pool (default all cores)\n"
+       << "  --repeats <n>      repeats per benchmark (default 3)\n"
+       << "  --out <file>       JSON result file (default benchmark.json)\n"
+       << "  --collision <mode> collision mode of the diffusion benchmarks:\n"
+       << "                     barycentric (default), intersect, or exhaustive\n"
+       << "  --reorder          renumber the tets for spatial locality\n"
+       << "  --shuffle          randomly shuffle the tets of the cube mesh\n"
+       << "  --check            run the consistency checks instead of the\n"
+       << "                     benchmarks (density * 6 * n^3 molecules)\n"
+       << "  --check-ref <file> with --check, compare the molecule distribution\n"
+       << "                     to the one stored in file, or store it there\n"
+       << "                     if file doesn't exist, e.g. to compare single\n"
+       << "                     and double precision builds"
+       << endl;
+}
+
+
+int main(int argc, char** argv) {
+  size_t size = 32;
+  double edge = 1.0;
+  double density = 10;
+  size_t steps = 10;
+  size_t threads = std::max(1u, std::thread::hardware_concurrency());
+  size_t repeats = 3;
+  std::string outFile = "benchmark.json";
+  bool check = false;
+  bool reorder = false;
+  bool shuffle = false;
+  std::string refFile;
+  std::string collisionName = "barycentric";
+  CollisionMode collisionMode = CollisionMode::barycentric;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--size" && i + 1 < argc) {
+      size = std::stoull(argv[++i]);
+    } else if (arg == "--edge" && i + 1 < argc) {
+      edge = std::stod(argv[++i]);
+    } else if (arg == "--density" && i + 1 < argc) {
+      density = std::stod(argv[++i]);
+    } else if (arg == "--steps" && i + 1 < argc) {
+      steps = std::stoull(argv[++i]);
+    } else if (arg == "--threads" && i + 1 < argc) {
+      threads = std::stoull(argv[++i]);
+    } else if (arg == "--repeats" && i + 1 < argc) {
+      repeats = std::stoull(argv[++i]);
+    } else if (arg == "--out" && i + 1 < argc) {
+      outFile = argv[++i];
+    } else if (arg == "--collision" && i + 1 < argc) {
+      Error e;
+      collisionName = argv[++i];
+      std::tie(collisionMode, e) = parse_collision_mode(collisionName);
+      if (e.err) {
+        cerr << e.desc << endl;
+        exit(1);
+      }
+    } else if (arg == "--reorder") {
+      reorder = true;
+    } else if (arg == "--shuffle") {
+      shuffle = true;
+    } else if (arg == "--check") {
+      check = true;
+    } else if (arg == "--check-ref" && i + 1 < argc) {
+      refFile = argv[++i];
+    } else {
+      usage(argv[0]);
+      exit(1);
+    }
+  }
+  if (size == 0 || threads == 0 || repeats == 0) {
+    usage(argv[0]);
+    exit(1);
+  }
+
+  // has to exist before the pool to count the misses of its threads
+  CacheMissCounter misses;
+  ThreadPool pool(threads);
+  CubeMesh cm = generate_cube_mesh(size, edge);
+  if (shuffle) {
+    shuffle_tets(cm, shuffleSeed);
+  }
+  if (check) {
+    geom::Mesh mesh;
+    geom::Tets tets;
+    Error e;
+    std::tie(mesh, tets, e) = create_tets(cm.verts, cm.tetVerts, pool);
+    if (e.err) {
+      cerr << e.desc << endl;
+      exit(1);
+    }
+    CheckConfig config{benchDt, benchD, size_t(density * tets.size()), steps,
+      refFile};
+    exit(run_checks(mesh, tets, pool, config) ? 0 : 1);
+  }
+  Rvector<BenchResult> results;
+
+  // mesh construction
+  geom::Mesh mesh;
+  geom::Tets tets;
+  Error e;
+  results.push_back(run_bench(misses, "create_tets", "tets", repeats, []{}, [&]{
+    std::tie(mesh, tets, e) = create_tets(cm.verts, cm.tetVerts, pool);
+    return tets.size();
+  }));
+  if (e.err) {
+    cerr << e.desc << endl;
+    exit(1);
+  }
+
+  std::string mcsfFile = outFile + ".mcsf";
+  e = write_mcsf_tet_mesh(mcsfFile, cm.verts, cm.tetVerts);
+  if (e.err) {
+    cerr << e.desc << endl;
+    exit(1);
+  }
+  results.push_back(run_bench(misses, "parse_mcsf_tet_mesh", "tets", repeats, []{}, [&]{
+    geom::Mesh m;
+    geom::Tets t;
+    std::tie(m, t, e) = parse_mcsf_tet_mesh(mcsfFile, pool);
+    return t.size();
+  }));
+  std::remove(mcsfFile.c_str());
+  if (e.err) {
+    cerr << e.desc << endl;
+    exit(1);
+  }
+
+  auto statePtr = bench_state(mesh, tets, reorder, collisionMode);
+  State& state = *statePtr;
+  const size_t specID = 0;  // the species created by bench_state
+  size_t numMols = size_t(density * tets.size());
+
+  // ray intersection kernels
+  Rvector<Ray> rays = random_rays(state, pool);
+  size_t numHits = 0;
+  results.push_back(run_bench(misses, "intersect", "intersections", repeats, []{}, [&]{
+    geom::Vec3 hitPoint;
+    for (const auto& r : rays) {
+      const auto& tet = state.tets()[r.tetID];
+      for (auto m : tet.m) {
+        numHits += geom::intersect(r.p0, r.disp, &state.mesh()[m], &hitPoint) == 0;
+      }
+    }
+    return 4 * rays.size();
+  }));
+  results.push_back(run_bench(misses, "intersect_tet", "rays", repeats, []{}, [&]{
+    geom::Vec3 hitPoint;
+    for (const auto& r : rays) {
+      numHits += geom::intersect_tet(state.hitTable()[r.tetID], r.p0, r.disp,
+        &hitPoint) >= 0;
+    }
+    return rays.size();
+  }));
+
+  // checked versus unchecked Rvector indexing; which of the two the rest of
+  // the code uses is recorded as bounds_check in the config
+  SizeTVec randomTets(numRays);
+  RngUniform tetRng(state.seed(), 0, 1);
+  for (auto& t : randomTets) {
+    t = std::min(size_t(tetRng.gen() * tets.size()), tets.size() - 1);
+  }
+  Rvector<double, CheckedIndex> checkedVolumes(state.tet_volumes().begin(),
+    state.tet_volumes().end());
+  Rvector<size_t, CheckedIndex> checkedNbs;
+  for (const auto& tet : state.tets()) {
+    for (auto t : tet.t) {
+      checkedNbs.push_back(t == geom::Tet::unset ? tet.ID : t);
+    }
+  }
+  Rvector<double, UncheckedIndex> volumes(checkedVolumes.begin(),
+    checkedVolumes.end());
+  Rvector<size_t, UncheckedIndex> nbs(checkedNbs.begin(), checkedNbs.end());
+  double volSum = 0.0;
+  results.push_back(run_bench(misses, "rvector_checked", "lookups", repeats, []{}, [&]{
+    volSum += gather_volumes(checkedVolumes, checkedNbs, randomTets);
+    return 8 * randomTets.size();
+  }));
+  results.push_back(run_bench(misses, "rvector_unchecked", "lookups", repeats, []{}, [&]{
+    volSum += gather_volumes(volumes, nbs, randomTets);
+    return 8 * randomTets.size();
+  }));
+
+  // molecule release
+  results.push_back(run_bench(misses, "release_mols", "molecules", repeats,
+    [&]{ clear_mols(state); },
+    [&]{ return release_mols(state, pool, specID, numMols, 0.0, 0); }));
+
+  // process_tet on empty and occupied tets, including collision detection
+  // and handing molecules to neighbors (collide/diffuse_new)
+  results.push_back(run_bench(misses, "process_tet_empty", "tets", repeats,
+    [&]{ clear_mols(state); },
+    [&]{
+      for (size_t i = 0; i < state.tets().size(); ++i) {
+        process_tet(state, i, 1);
+      }
+      return state.tets().size();
+    }));
+  results.push_back(run_bench(misses, "process_tet_full", "molecule-steps", repeats,
+    [&]{
+      clear_mols(state);
+      release_mols(state, pool, specID, numMols, 0.0, 0);
+    },
+    [&]{
+      for (size_t i = 0; i < state.tets().size(); ++i) {
+        process_tet(state, i, 1);
+      }
+      return numMols;
+    }));
+
+  // complete time step loop
+  results.push_back(step_bench(misses, "step", state, pool, numMols, steps,
+    repeats));
+  Dataflow flow(state.tets(), 16 * threads);
+  results.push_back(run_bench(misses, "step_dataflow", "molecule-steps", repeats,
+    [&]{
+      clear_mols(state);
+      release_mols(state, pool, specID, numMols, 0.0, 0);
+    },
+    [&]{
+      for (size_t i = 1; i <= steps; ++i) {
+        flow.step(state, pool, i);
+      }
+      return steps * numMols;
+    }));
+  clear_mols(state);
+
+  // time step loop on randomly ordered tets, as is and reordered
+  CubeMesh shuffled = generate_cube_mesh(size, edge);
+  shuffle_tets(shuffled, shuffleSeed);
+  geom::Mesh shuffledMesh;
+  geom::Tets shuffledTets;
+  std::tie(shuffledMesh, shuffledTets, e) = create_tets(shuffled.verts,
+    shuffled.tetVerts, pool);
+  if (e.err) {
+    cerr << e.desc << endl;
+    exit(1);
+  }
+  for (bool r : {false, true}) {
+    auto s = bench_state(shuffledMesh, shuffledTets, r, collisionMode);
+    results.push_back(step_bench(misses,
+      r ? "step_shuffled_reordered" : "step_shuffled", *s, pool, numMols,
+      steps, repeats));
+  }
+
+  std::ofstream out(outFile);
+  write_json(out, size, tets.size(), density, steps, threads, repeats,
+    collisionName, reorder, shuffle, misses.available(), results);
+  if (out.fail()) {
+    cerr << "failed to write " << outFile << endl;
+    exit(1);
+  }
+  cerr << "wrote " << outFile << " (" << numHits << " hits, volume " << volSum
+       << ")" << endl;
+}
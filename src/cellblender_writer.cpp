@@ -0,0 +1,112 @@
+// Copyright 2015 Markus Dittrich
+// Licensed under BSD license, see LICENSE file for details
+
+#include <fstream>
+
+#include "cellblender_writer.hpp"
+#include "io.hpp"
+
+
+// constructor starting the writer thread
+CellBlenderWriter::CellBlenderWriter(std::string path, std::string name)
+  : path_{path}, name_{name},
+    writer_{&CellBlenderWriter::writer_loop, this} {}
+
+
+// destructor writing all queued files before shutting down
+CellBlenderWriter::~CellBlenderWriter() {
+  finish();
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    quit_ = true;
+  }
+  changed_.notify_all();
+  writer_.join();
+}
+
+
+// write queues the molecule info of state at iter for writing
+Error CellBlenderWriter::write(const State& state, int iter) {
+  size_t b = 0;
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    changed_.wait(lock, [this]() { return bufStates_[next_] == BufState::free; });
+    b = next_;
+    next_ = 1 - next_;
+  }
+
+  // the buffer is ours until it is queued
+  snapshot_cellblender(state, bufs_[b]);
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    bufStates_[b] = BufState::queued;
+    bufIters_[b] = iter;
+  }
+  changed_.notify_all();
+  return take_error();
+}
+
+
+// finish waits until all queued files have been written
+Error CellBlenderWriter::finish() {
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    changed_.wait(lock, [this]() {
+      return bufStates_[0] == BufState::free && bufStates_[1] == BufState::free;
+    });
+  }
+  return take_error();
+}
+
+
+// take_error returns and resets the first error encountered by the writer
+Error CellBlenderWriter::take_error() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  Error e = err_;
+  err_ = noErr;
+  return e;
+}
+
+
+// writer_loop writes queued buffers in the order they were queued
+void CellBlenderWriter::writer_loop() {
+  size_t b = 0;
+  while (true) {
+    int iter = 0;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      changed_.wait(lock, [this, b]() {
+        return quit_ || bufStates_[b] == BufState::queued;
+      });
+      if (bufStates_[b] != BufState::queued) {
+        return;
+      }
+      bufStates_[b] = BufState::writing;
+      iter = bufIters_[b];
+    }
+
+    Error e = noErr;
+    std::string fileName = cellblender_file_name(path_, name_, iter);
+    std::ofstream out(fileName, std::ios::binary);
+    if (out.fail()) {
+      e = Error{"Failed to open file " + fileName};
+    } else {
+      out.write(bufs_[b].data(), bufs_[b].size());
+      out.close();
+      if (out.fail()) {
+        e = Error{"Failed to write file " + fileName};
+      }
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      bufStates_[b] = BufState::free;
+      if (e.err && !err_.err) {
+        err_ = e;
+      }
+    }
+    changed_.notify_all();
+    b = 1 - b;
+  }
+}
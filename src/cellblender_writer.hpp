@@ -0,0 +1,67 @@
+// Copyright 2015 Markus Dittrich
+// Licensed under BSD license, see LICENSE file for details
+
+#ifndef CELLBLENDER_WRITER_HPP
+#define CELLBLENDER_WRITER_HPP
+
+#include <array>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "error.hpp"
+#include "state.hpp"
+#include "util.hpp"
+
+
+// CellBlenderWriter writes cellblender output files in the background. Each
+// call to write() snapshots the molecule positions into one of two reusable
+// buffers on the calling thread and hands the buffer to a writer thread,
+// which writes it to disk with a single large write while the simulation
+// continues. write() only blocks if both buffers are still in flight.
+class CellBlenderWriter {
+
+public:
+
+  CellBlenderWriter(std::string path, std::string name);
+  ~CellBlenderWriter();
+
+  // don't allow copy & move operations
+  CellBlenderWriter(const CellBlenderWriter& w) = delete;
+  CellBlenderWriter& operator=(const CellBlenderWriter& w) = delete;
+  CellBlenderWriter(CellBlenderWriter&& w) = delete;
+  CellBlenderWriter& operator=(CellBlenderWriter&& w) = delete;
+
+  // write queues the molecule info of state at iter for writing. Errors
+  // of previously queued writes are reported here or by finish().
+  Error write(const State& state, int iter);
+
+  // finish waits until all queued files have been written
+  Error finish();
+
+private:
+
+  void writer_loop();
+  Error take_error();
+
+  std::string path_;
+  std::string name_;
+
+  // a buffer is either free, filled and waiting to be written, or being
+  // written by the writer thread
+  enum class BufState { free, queued, writing };
+  std::array<Rvector<char>, 2> bufs_;
+  std::array<BufState, 2> bufStates_{{BufState::free, BufState::free}};
+  std::array<int, 2> bufIters_{{0, 0}};
+  size_t next_ = 0;   // buffer to queue next, written in queueing order
+
+  std::mutex mutex_;
+  std::condition_variable changed_;
+  bool quit_ = false;
+  Error err_ = noErr;
+
+  std::thread writer_;
+};
+
+#endif
@@ -0,0 +1,411 @@
+// Copyright 2015 Markus Dittrich
+// Licensed under BSD license, see LICENSE file for details
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <fstream>
+
+#include "checkpoint.hpp"
+#include "mapped_file.hpp"
+
+
+// CheckpointHeader is located at the beginning of each checkpoint file. It
+// is followed by these sections, each starting at a multiple of
+// checkpointAlign:
+//
+//   - the MeshElements and Tets in their in memory layout
+//   - the mapping to the original tet IDs (empty unless tets were reordered)
+//   - the diffusion coefficients, name lengths, and names of all species
+//   - the reactions followed by the species IDs of all their products
+//   - for each species the number of molecules in each tet followed by the
+//     positions, remaining displacements, birthdays, and flags of all its
+//     molecules, ordered by tet
+//
+// Molecule data is thus stored in the same structure of arrays layout as in
+// VolMols and can be copied in bulk when restoring.
+struct CheckpointHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t byteOrder;
+  uint32_t meshElementSize;
+  uint32_t tetSize;
+  uint32_t vec3Size;
+  uint32_t collisionMode;
+  uint64_t iter;
+  double dt;
+  uint64_t seed;
+  RngNorm::Snapshot rng;
+  uint64_t numMeshElements;
+  uint64_t numTets;
+  uint64_t numOrigTetIDs;
+  uint64_t numSpecies;
+  uint64_t numReactions;
+  uint64_t numMols;
+};
+
+
+// CheckpointReaction is the on disk representation of a BimolReaction
+struct CheckpointReaction {
+  uint64_t reactant1;
+  uint64_t reactant2;
+  uint64_t numProducts;
+  double rate;
+  double radius;
+};
+
+const char checkpointMagic[8] = {'M', 'C', 'N', 'G', 'C', 'H', 'K', '\0'};
+const uint32_t checkpointVersion = 2;
+const uint32_t checkpointByteOrder = 0x01020304;
+const uint64_t checkpointAlign = 64;
+
+
+// CheckpointWriter writes aligned sections to a checkpoint file
+class CheckpointWriter {
+
+public:
+
+  CheckpointWriter(const std::string& fileName)
+    : out_(fileName, std::ios::binary) {}
+
+  bool fail() const {
+    return out_.fail();
+  }
+
+  // section pads the file to the start of the next section
+  void section() {
+    const char pad[checkpointAlign] = {};
+    uint64_t next = (offset_ + checkpointAlign - 1) / checkpointAlign * checkpointAlign;
+    out_.write(pad, next - offset_);
+    offset_ = next;
+  }
+
+  // write appends n elements starting at data to the current section
+  template <typename T>
+  void write(const T* data, size_t n) {
+    out_.write(reinterpret_cast<const char*>(data), n * sizeof(T));
+    offset_ += n * sizeof(T);
+  }
+
+  void close() {
+    out_.close();
+  }
+
+private:
+  std::ofstream out_;
+  uint64_t offset_ = 0;
+};
+
+
+// CheckpointReader hands out aligned sections of a mapped checkpoint file
+class CheckpointReader {
+
+public:
+
+  CheckpointReader(const MappedFile& file) : file_(file) {}
+
+  // section skips to the start of the next section
+  void section() {
+    offset_ = (offset_ + checkpointAlign - 1) / checkpointAlign * checkpointAlign;
+  }
+
+  // read returns a pointer to the next n elements of the current section or
+  // nullptr if the file is too short
+  template <typename T>
+  const T* read(size_t n) {
+    if (offset_ > file_.size() || n > (file_.size() - offset_) / sizeof(T)) {
+      return nullptr;
+    }
+    auto p = reinterpret_cast<const T*>(file_.data() + offset_);
+    offset_ += n * sizeof(T);
+    return p;
+  }
+
+private:
+  const MappedFile& file_;
+  uint64_t offset_ = 0;
+};
+
+
+// mesh_bytes returns the in memory representation of mesh with all padding
+// bytes between the members of its MeshElements zeroed. Writing the elements
+// directly would store whatever the padding happens to contain so that equal
+// states could result in different checkpoint files.
+static Rvector<char> mesh_bytes(const geom::Mesh& mesh) {
+  using geom::MeshElement;
+  Rvector<char> bytes(mesh.size() * sizeof(MeshElement), 0);
+  for (size_t i = 0; i < mesh.size(); ++i) {
+    const MeshElement& me = mesh[i];
+    char* p = bytes.data() + i * sizeof(MeshElement);
+    auto put = [p](size_t offset, const void* field, size_t size) {
+      std::memcpy(p + offset, field, size);
+    };
+    put(offsetof(MeshElement, a), &me.a, sizeof(me.a));
+    put(offsetof(MeshElement, b), &me.b, sizeof(me.b));
+    put(offsetof(MeshElement, c), &me.c, sizeof(me.c));
+    put(offsetof(MeshElement, u), &me.u, sizeof(me.u));
+    put(offsetof(MeshElement, v), &me.v, sizeof(me.v));
+    put(offsetof(MeshElement, n), &me.n, sizeof(me.n));
+    put(offsetof(MeshElement, n_norm), &me.n_norm, sizeof(me.n_norm));
+    put(offsetof(MeshElement, prop), &me.prop, sizeof(me.prop));
+    put(offsetof(MeshElement, passProb), &me.passProb, sizeof(me.passProb));
+  }
+  return bytes;
+}
+
+
+// write_checkpoint writes the complete simulation state at the end of
+// iteration iter to the binary checkpoint file fileName
+Error write_checkpoint(const std::string& fileName, const State& state,
+  uint64_t iter) {
+
+  size_t numTets = state.tets_.size();
+  size_t numSpecies = state.species_.size();
+
+  CheckpointHeader h{};
+  std::copy(std::begin(checkpointMagic), std::end(checkpointMagic), h.magic);
+  h.version = checkpointVersion;
+  h.byteOrder = checkpointByteOrder;
+  h.meshElementSize = sizeof(geom::MeshElement);
+  h.tetSize = sizeof(geom::Tet);
+  h.vec3Size = sizeof(MolVec3);
+  h.collisionMode = static_cast<uint32_t>(state.collisionMode_);
+  h.iter = iter;
+  h.dt = state.dt_;
+  h.seed = state.seed_;
+  h.rng = state.rng_.snapshot();
+  h.numMeshElements = state.mesh_.size();
+  h.numTets = numTets;
+  h.numOrigTetIDs = state.origTetIDs_.size();
+  h.numSpecies = numSpecies;
+  h.numReactions = state.reactions_.size();
+  for (const auto& tm : state.tetMolStates_) {
+    h.numMols += tm.activeMols.num_mols();
+  }
+
+  CheckpointWriter out(fileName);
+  if (out.fail()) {
+    return Error{"failed to open file " + fileName};
+  }
+  out.write(&h, 1);
+  out.section();
+  Rvector<char> meshData = mesh_bytes(state.mesh_);
+  out.write(meshData.data(), meshData.size());
+  out.section();
+  out.write(state.tets_.data(), numTets);
+  out.section();
+  out.write(state.origTetIDs_.data(), state.origTetIDs_.size());
+
+  Rvector<double> d;
+  Rvector<uint64_t> nameLengths;
+  std::string names;
+  for (const auto& spec : state.species_) {
+    d.push_back(spec.D());
+    nameLengths.push_back(spec.name().size());
+    names += spec.name();
+  }
+  out.section();
+  out.write(d.data(), numSpecies);
+  out.section();
+  out.write(nameLengths.data(), numSpecies);
+  out.section();
+  out.write(names.data(), names.size());
+
+  Rvector<CheckpointReaction> rxs;
+  SizeTVec products;
+  for (const auto& rx : state.reactions_) {
+    rxs.push_back(CheckpointReaction{rx.reactant1(), rx.reactant2(),
+      rx.products().size(), rx.rate(), rx.radius()});
+    products.insert(products.end(), rx.products().begin(), rx.products().end());
+  }
+  out.section();
+  out.write(rxs.data(), rxs.size());
+  out.section();
+  out.write(products.data(), products.size());
+
+  // a tet without a slot for a species holds no molecules of it
+  const VolMols noMols;
+  auto mols = [&](size_t tetID, size_t specID) -> const VolMols& {
+    const auto& active = state.tetMolStates_[tetID].activeMols;
+    return specID < active.size() ? active[specID] : noMols;
+  };
+
+  Rvector<uint64_t> counts(numTets);
+  for (size_t s = 0; s < numSpecies; ++s) {
+    for (size_t i = 0; i < numTets; ++i) {
+      counts[i] = mols(i, s).size();
+    }
+    out.section();
+    out.write(counts.data(), numTets);
+    out.section();
+    for (size_t i = 0; i < numTets; ++i) {
+      out.write(mols(i, s).pos.data(), counts[i]);
+    }
+    out.section();
+    for (size_t i = 0; i < numTets; ++i) {
+      out.write(mols(i, s).dispRem.data(), counts[i]);
+    }
+    out.section();
+    for (size_t i = 0; i < numTets; ++i) {
+      out.write(mols(i, s).t.data(), counts[i]);
+    }
+    out.section();
+    for (size_t i = 0; i < numTets; ++i) {
+      out.write(mols(i, s).flags.data(), counts[i]);
+    }
+  }
+
+  out.close();
+  if (out.fail()) {
+    return Error{"failed to write file " + fileName};
+  }
+  return noErr;
+}
+
+
+// read_checkpoint replaces the content of state with the simulation state
+// stored in the checkpoint file fileName and returns the iteration at which
+// the checkpoint was taken. The checkpoint is restored into a separate state
+// which only replaces state once it was read completely.
+std::tuple<uint64_t, Error> read_checkpoint(const std::string& fileName,
+  State& state) {
+
+  auto fail = [](const std::string& msg) {
+    return std::make_tuple(uint64_t(0), Error{msg});
+  };
+
+  MappedFile file;
+  Error e = file.open(fileName);
+  if (e.err) {
+    return fail(e.desc);
+  }
+  CheckpointReader in(file);
+  auto hp = in.read<CheckpointHeader>(1);
+  if (hp == nullptr ||
+      !std::equal(std::begin(checkpointMagic), std::end(checkpointMagic), hp->magic)) {
+    return fail(fileName + " is not a checkpoint file");
+  }
+  CheckpointHeader h = *hp;
+  if (h.version != checkpointVersion || h.byteOrder != checkpointByteOrder ||
+      h.meshElementSize != sizeof(geom::MeshElement) ||
+      h.tetSize != sizeof(geom::Tet) || h.vec3Size != sizeof(MolVec3)) {
+    return fail(fileName + " was written by an incompatible version");
+  }
+  if ((h.numOrigTetIDs != 0 && h.numOrigTetIDs != h.numTets) ||
+      h.collisionMode > static_cast<uint32_t>(CollisionMode::exhaustive)) {
+    return fail(fileName + " is corrupt");
+  }
+
+  const std::string truncated = fileName + " is truncated";
+  in.section();
+  auto meshBegin = in.read<geom::MeshElement>(h.numMeshElements);
+  in.section();
+  auto tetBegin = in.read<geom::Tet>(h.numTets);
+  in.section();
+  auto origBegin = in.read<size_t>(h.numOrigTetIDs);
+  in.section();
+  auto d = in.read<double>(h.numSpecies);
+  in.section();
+  auto nameLengths = in.read<uint64_t>(h.numSpecies);
+  if (!meshBegin || !tetBegin || !origBegin || !d || !nameLengths) {
+    return fail(truncated);
+  }
+  uint64_t namesSize = 0;
+  for (size_t s = 0; s < h.numSpecies; ++s) {
+    namesSize += nameLengths[s];
+  }
+  in.section();
+  auto names = in.read<char>(namesSize);
+  in.section();
+  auto rxs = in.read<CheckpointReaction>(h.numReactions);
+  if (!names || !rxs) {
+    return fail(truncated);
+  }
+  uint64_t numProducts = 0;
+  for (size_t r = 0; r < h.numReactions; ++r) {
+    if (rxs[r].reactant1 >= h.numSpecies || rxs[r].reactant2 >= h.numSpecies) {
+      return fail(fileName + " is corrupt");
+    }
+    numProducts += rxs[r].numProducts;
+  }
+  in.section();
+  auto products = in.read<size_t>(numProducts);
+  if (!products) {
+    return fail(truncated);
+  }
+  if (std::any_of(products, products + numProducts,
+      [&](size_t specID) { return specID >= h.numSpecies; })) {
+    return fail(fileName + " is corrupt");
+  }
+
+  State tmp(h.dt, h.seed);
+  tmp.add_geometry(geom::Mesh(meshBegin, meshBegin + h.numMeshElements),
+    geom::Tets(tetBegin, tetBegin + h.numTets));
+  if (tmp.set_orig_tet_ids(SizeTVec(origBegin, origBegin + h.numOrigTetIDs)).err) {
+    return fail(fileName + " is corrupt");
+  }
+  tmp.collisionMode_ = static_cast<CollisionMode>(h.collisionMode);
+  tmp.rng_.restore(h.rng);
+
+  for (size_t s = 0; s < h.numSpecies; ++s) {
+    tmp.species_.emplace_back(std::string(names, nameLengths[s]), d[s]);
+    names += nameLengths[s];
+  }
+  for (size_t r = 0; r < h.numReactions; ++r) {
+    const auto& rx = rxs[r];
+    tmp.reactions_.emplace_back(rx.reactant1, rx.reactant2,
+      SizeTVec(products, products + rx.numProducts), rx.rate, rx.radius);
+    products += rx.numProducts;
+  }
+
+  // restore molecules by bulk copying the per tet ranges of each array
+  uint64_t numMols = 0;
+  for (size_t s = 0; s < h.numSpecies; ++s) {
+    in.section();
+    auto counts = in.read<uint64_t>(h.numTets);
+    if (!counts) {
+      return fail(truncated);
+    }
+    uint64_t n = 0;
+    for (size_t i = 0; i < h.numTets; ++i) {
+      n += counts[i];
+    }
+    numMols += n;
+    if (numMols > h.numMols) {
+      return fail(fileName + " is corrupt");
+    }
+    in.section();
+    auto pos = in.read<MolVec3>(n);
+    in.section();
+    auto dispRem = in.read<MolVec3>(n);
+    in.section();
+    auto t = in.read<double>(n);
+    in.section();
+    auto flags = in.read<uint8_t>(n);
+    if (!pos || !dispRem || !t || !flags) {
+      return fail(truncated);
+    }
+    for (size_t i = 0; i < h.numTets; ++i) {
+      uint64_t c = counts[i];
+      if (c == 0) {
+        continue;
+      }
+      auto& mols = tmp.tetMolStates_[i].activeMols[s];
+      mols.pos.assign(pos, pos + c);
+      mols.dispRem.assign(dispRem, dispRem + c);
+      mols.t.assign(t, t + c);
+      mols.flags.assign(flags, flags + c);
+      mols.faceDist.assign(c, 0.0f);
+      pos += c;
+      dispRem += c;
+      t += c;
+      flags += c;
+    }
+  }
+  if (numMols != h.numMols) {
+    return fail(fileName + " is corrupt");
+  }
+  tmp.rebuild_active_tets();
+  state.swap(tmp);
+  return std::make_tuple(h.iter, noErr);
+}
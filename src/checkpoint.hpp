@@ -0,0 +1,28 @@
+// Copyright 2015 Markus Dittrich
+// Licensed under BSD license, see LICENSE file for details
+
+#ifndef CHECKPOINT_HPP
+#define CHECKPOINT_HPP
+
+#include <string>
+#include <tuple>
+
+#include "error.hpp"
+#include "state.hpp"
+
+// write_checkpoint writes the complete simulation state at the end of
+// iteration iter to the binary checkpoint file fileName. The checkpoint has
+// to be taken between two calls to step, i.e. while no molecules are in
+// flight between tets.
+Error write_checkpoint(const std::string& fileName, const State& state,
+  uint64_t iter);
+
+// read_checkpoint replaces the content of state with the simulation state
+// stored in the checkpoint file fileName and returns the iteration at which
+// the checkpoint was taken. Continuing with step(state, pool, iter + 1)
+// reproduces the original run bit for bit. state is left unchanged if the
+// checkpoint can't be read.
+std::tuple<uint64_t, Error> read_checkpoint(const std::string& fileName,
+  State& state);
+
+#endif
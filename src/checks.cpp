@@ -0,0 +1,580 @@
+// Copyright 2015 Markus Dittrich
+// Licensed under BSD license, see LICENSE file for details
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <numeric>
+#include <sstream>
+#include <string>
+
+#include "checks.hpp"
+#include "counters.hpp"
+#include "dataflow.hpp"
+#include "placement.hpp"
+#include "reaction.hpp"
+#include "rng.hpp"
+#include "state.hpp"
+#include "step.hpp"
+
+
+using std::cerr;
+using std::endl;
+
+
+// report prints the outcome of check name and returns ok
+static bool report(const std::string& name, bool ok, const std::string& detail) {
+  cerr << (ok ? "pass " : "FAIL ") << name << ": " << detail << endl;
+  return ok;
+}
+
+
+// new_state creates a state on mesh and tets holding a single species of
+// diffusion coefficient config.D
+static std::unique_ptr<State> new_state(const geom::Mesh& mesh,
+  const geom::Tets& tets, const CheckConfig& config) {
+  std::unique_ptr<State> state(new State(config.dt));
+  state->add_geometry(mesh, tets);
+  state->create_species(MolSpecies("A", config.D));
+  return state;
+}
+
+
+// count_mols returns the number of active molecules in state
+static uint64_t count_mols(const State& state) {
+  uint64_t n = 0;
+  for (auto tetID : state.active_tets()) {
+    n += state.tetMols(tetID).activeMols.num_mols();
+  }
+  return n;
+}
+
+
+// same_mols returns true if a and b hold the same molecules in the same tets
+// and order, with bit identical positions, birthdays, and flags
+static bool same_mols(const State& a, const State& b) {
+  if (a.active_tets() != b.active_tets()) {
+    return false;
+  }
+  for (auto tetID : a.active_tets()) {
+    const auto& sa = a.tetMols(tetID).activeMols;
+    const auto& sb = b.tetMols(tetID).activeMols;
+    if (sa.size() != sb.size()) {
+      return false;
+    }
+    for (size_t s = 0; s < sa.size(); ++s) {
+      const auto& ma = sa[s];
+      const auto& mb = sb[s];
+      if (ma.size() != mb.size()) {
+        return false;
+      }
+      for (size_t i = 0; i < ma.size(); ++i) {
+        if (!(ma.pos[i] == mb.pos[i]) || ma.t[i] != mb.t[i] ||
+            ma.flags[i] != mb.flags[i]) {
+          return false;
+        }
+      }
+    }
+  }
+  return true;
+}
+
+
+// add_membrane makes the faces separating the lower and upper half of the
+// mesh of state in x translucent with pass probability passProb
+static Error add_membrane(State& state, double passProb) {
+  double xMin = std::numeric_limits<double>::max();
+  double xMax = std::numeric_limits<double>::lowest();
+  for (const auto& me : state.mesh()) {
+    xMin = std::min({xMin, me.a.x, me.b.x, me.c.x});
+    xMax = std::max({xMax, me.a.x, me.b.x, me.c.x});
+  }
+  return state.set_mesh_props(geom::split_faces(state.mesh(), state.tets(),
+    0.5 * (xMin + xMax)), geom::MeshProp::translucent, passProb);
+}
+
+
+// check_mesh_props makes the boundary of the mesh absorptive and the faces
+// separating its lower and upper half in x translucent. Every molecule lost
+// has to be counted as absorbed, and the fraction of hits on the translucent
+// faces letting molecules pass has to be within 4 standard deviations of the
+// pass probability.
+static bool check_mesh_props(const geom::Mesh& mesh, const geom::Tets& tets,
+  ThreadPool& pool, const CheckConfig& config) {
+  const double passProb = 0.3;
+  auto state = new_state(mesh, tets, config);
+
+  bool ok = report("set_mesh_props_range",
+    state->set_mesh_props(SizeTVec{mesh.size()}, geom::MeshProp::absorptive).err,
+    "nonexistent MeshElement is rejected");
+
+  Error e = state->set_mesh_props(geom::boundary_faces(tets),
+    geom::MeshProp::absorptive);
+  if (!e.err) {
+    e = add_membrane(*state, passProb);
+  }
+  if (e.err) {
+    return report("mesh_props", false, e.desc);
+  }
+
+  release_mols(*state, pool, 0, config.numMols, 0.0, 0);
+  uint64_t numStart = count_mols(*state);
+  StepCounters c;
+  for (size_t i = 1; i <= config.steps; ++i) {
+    step(*state, pool, i, &c);
+  }
+  uint64_t numLost = numStart - count_mols(*state);
+
+  std::ostringstream absorbed;
+  absorbed << c.absorptions << " absorbed, " << numLost << " lost";
+  ok &= report("absorptions", c.absorptions == numLost && numLost > 0,
+    absorbed.str());
+
+  double frac = c.translucentHits > 0
+    ? double(c.translucentPasses) / c.translucentHits : 0.0;
+  double sigma = std::sqrt(passProb * (1 - passProb) /
+    std::max<uint64_t>(1, c.translucentHits));
+  std::ostringstream passed;
+  passed << c.translucentPasses << " of " << c.translucentHits
+         << " hits passed (" << frac << ", expected " << passProb << " +/- "
+         << sigma << ")";
+  ok &= report("translucent_passes",
+    c.translucentHits > 0 && std::abs(frac - passProb) <= 4 * sigma,
+    passed.str());
+  return ok;
+}
+
+
+// check_collision_modes steps the same molecules in all collision modes,
+// once with the configured diffusion coefficient and once with a hundredth of
+// it, where most moves stay clear of all faces. The trajectories of the modes
+// taking shortcuts have to be identical to those of exhaustive mode.
+static bool check_collision_modes(const geom::Mesh& mesh,
+  const geom::Tets& tets, ThreadPool& pool, const CheckConfig& config) {
+  const CollisionMode modes[] = {CollisionMode::exhaustive,
+    CollisionMode::intersect, CollisionMode::barycentric};
+  const char* names[] = {"exhaustive", "intersect", "barycentric"};
+
+  bool ok = true;
+  for (double D : {config.D, 0.01 * config.D}) {
+    CheckConfig c = config;
+    c.D = D;
+    std::unique_ptr<State> states[3];
+    StepCounters counters[3];
+    for (size_t m = 0; m < 3; ++m) {
+      states[m] = new_state(mesh, tets, c);
+      states[m]->set_collision_mode(modes[m]);
+      Error e = add_membrane(*states[m], 0.5);
+      if (e.err) {
+        return report("collision_modes", false, e.desc);
+      }
+      release_mols(*states[m], pool, 0, c.numMols, 0.0, 0);
+      for (size_t i = 1; i <= c.steps; ++i) {
+        step(*states[m], pool, i, &counters[m]);
+      }
+    }
+    for (size_t m = 1; m < 3; ++m) {
+      std::ostringstream detail;
+      detail << "D = " << D << ", " << counters[m].intersectTests
+             << " intersect tests and " << counters[m].clearMoves
+             << " clear moves vs " << counters[0].intersectTests
+             << " intersect tests in exhaustive mode";
+      ok &= report(std::string("collision_") + names[m],
+        same_mols(*states[m], *states[0]), detail.str());
+    }
+  }
+  return ok;
+}
+
+
+// run_reactions releases config.numMols molecules split into two species
+// reacting with each other into state and steps it with pool. Returns the
+// number of reactions.
+static size_t run_reactions(State& state, ThreadPool& pool,
+  const CheckConfig& config) {
+  size_t bSpecID = state.create_species(MolSpecies("B", config.D));
+  size_t cSpecID = state.create_species(MolSpecies("C", config.D));
+  state.create_reaction(BimolReaction(0, bSpecID, SizeTVec{cSpecID}, 1e5,
+    0.5 * state.min_inradius()));
+  release_mols(state, pool, 0, config.numMols / 2, 0.0, 0);
+  release_mols(state, pool, bSpecID, config.numMols / 2, 0.0, 0);
+  size_t numReactions = 0;
+  for (size_t i = 1; i <= config.steps; ++i) {
+    numReactions += step(state, pool, i);
+  }
+  return numReactions;
+}
+
+
+// check_thread_counts releases, steps and reacts the same molecules with the
+// threads of pool and with a different number of threads. The trajectories
+// have to be identical.
+static bool check_thread_counts(const geom::Mesh& mesh, const geom::Tets& tets,
+  ThreadPool& pool, const CheckConfig& config) {
+  ThreadPool other(pool.size() == 1 ? 3 : 1);
+  auto a = new_state(mesh, tets, config);
+  auto b = new_state(mesh, tets, config);
+  size_t numA = run_reactions(*a, pool, config);
+  size_t numB = run_reactions(*b, other, config);
+
+  std::ostringstream detail;
+  detail << pool.size() << " vs " << other.size() << " threads, "
+         << count_mols(*a) << " molecules, " << numA << " reactions";
+  return report("thread_counts", numA == numB && numA > 0 && same_mols(*a, *b),
+    detail.str());
+}
+
+
+// check_rng_streams draws from a number of RngNorm streams one after the
+// other and one at a time, and again with the streams created in reverse
+// order, interleaved, and drawn from in batches of an odd size which also
+// covers the vectorized kernel. Both have to yield the same numbers.
+static bool check_rng_streams(const CheckConfig& config) {
+  const size_t numStreams = 64;
+  const size_t numDraws = 1000;
+  const size_t batch = 61;
+  const uint64_t seed = 12345;
+  Rvector<double> single(numStreams * numDraws);
+  for (size_t s = 0; s < numStreams; ++s) {
+    RngNorm rng(seed, config.steps, s);
+    for (size_t k = 0; k < numDraws; ++k) {
+      single[s * numDraws + k] = rng.gen();
+    }
+  }
+
+  Rvector<RngNorm> rngs;
+  for (size_t s = numStreams; s-- > 0;) {
+    rngs.emplace_back(seed, config.steps, s);
+  }
+  Rvector<double> batched(numStreams * numDraws);
+  for (size_t k = 0; k < numDraws; k += batch) {
+    for (size_t s = 0; s < numStreams; ++s) {
+      rngs[numStreams - 1 - s].gen(&batched[s * numDraws + k],
+        std::min(batch, numDraws - k));
+    }
+  }
+
+  std::ostringstream detail;
+  detail << numStreams << " streams of " << numDraws
+         << " normal deviates, single vs batches of " << batch;
+  return report("rng_streams", single == batched, detail.str());
+}
+
+
+// check_processing_order steps the same molecules with step and with
+// Dataflow, which processes tets in a different and, with several threads,
+// varying order. The trajectories have to be identical.
+static bool check_processing_order(const geom::Mesh& mesh,
+  const geom::Tets& tets, ThreadPool& pool, const CheckConfig& config) {
+  auto a = new_state(mesh, tets, config);
+  auto b = new_state(mesh, tets, config);
+  Dataflow flow(b->tets(), 16 * pool.size());
+  release_mols(*a, pool, 0, config.numMols, 0.0, 0);
+  release_mols(*b, pool, 0, config.numMols, 0.0, 0);
+  for (size_t i = 1; i <= config.steps; ++i) {
+    step(*a, pool, i);
+    flow.step(*b, pool, i);
+  }
+
+  std::ostringstream detail;
+  detail << "step vs " << flow.num_blocks() << " dataflow blocks on "
+         << pool.size() << " threads";
+  return report("processing_order", same_mols(*a, *b), detail.str());
+}
+
+
+// scan_active_tets returns all tets of state holding active molecules
+static SizeTVec scan_active_tets(const State& state) {
+  SizeTVec tetIDs;
+  for (size_t tetID = 0; tetID < state.tets().size(); ++tetID) {
+    if (state.tetMols(tetID).activeMols.num_mols() > 0) {
+      tetIDs.push_back(tetID);
+    }
+  }
+  return tetIDs;
+}
+
+
+// check_active_tets releases molecules into a single tet and steps them once
+// visiting only the active tets and once visiting all tets. After each step
+// the active tets have to be exactly the tets holding molecules, and the
+// trajectories have to be identical.
+static bool check_active_tets(const geom::Mesh& mesh, const geom::Tets& tets,
+  ThreadPool& pool, const CheckConfig& config) {
+  auto a = new_state(mesh, tets, config);
+  auto b = new_state(mesh, tets, config);
+  release_mols(*a, pool, 0, config.numMols, 0.0, 0, SizeTVec{0});
+  release_mols(*b, pool, 0, config.numMols, 0.0, 0, SizeTVec{0});
+  SizeTVec allTets(tets.size());
+  std::iota(allTets.begin(), allTets.end(), 0);
+
+  bool ok = true;
+  for (size_t i = 1; i <= config.steps; ++i) {
+    step(*a, pool, i);
+    b->set_active_tets(allTets);
+    step(*b, pool, i);
+    ok &= a->active_tets() == scan_active_tets(*a);
+  }
+
+  std::ostringstream detail;
+  detail << a->active_tets().size() << " of " << tets.size()
+         << " tets active after " << config.steps << " steps";
+  return report("active_tets", ok && same_mols(*a, *b), detail.str());
+}
+
+
+// check_locator locates random points within the bounding box of the mesh,
+// enlarged so some of them lie outside of it, plus all vertices of the first
+// tets, which lie on several tets at once. The locator is queried for single
+// points and in batches; each answer has to contain the point, and points no
+// tet contains have to be reported as outside. The latter is determined by
+// testing every point against every tet.
+static bool check_locator(const geom::Mesh& mesh, const geom::Tets& tets,
+  ThreadPool& pool, const CheckConfig& config) {
+  const size_t numPoints = 20000;
+  const size_t numVertexTets = 100;
+  const double eps = 1e-12;
+  auto state = new_state(mesh, tets, config);
+  const auto& bary = state->baryTable();
+
+  geom::Vec3 lo{std::numeric_limits<double>::max(),
+    std::numeric_limits<double>::max(), std::numeric_limits<double>::max()};
+  geom::Vec3 hi = -1.0 * lo;
+  for (const auto& me : mesh) {
+    for (const auto& v : {me.a, me.b, me.c}) {
+      lo = geom::Vec3{std::min(lo.x, v.x), std::min(lo.y, v.y), std::min(lo.z, v.z)};
+      hi = geom::Vec3{std::max(hi.x, v.x), std::max(hi.y, v.y), std::max(hi.z, v.z)};
+    }
+  }
+  geom::Vec3 margin = 0.1 * (hi - lo);
+  lo = lo - margin;
+  hi = hi + margin;
+
+  Rvector<geom::Vec3> points;
+  RngUniform rng(state->seed(), 0, 0);
+  for (size_t i = 0; i < numPoints; ++i) {
+    double x = rng.gen(), y = rng.gen(), z = rng.gen();
+    points.push_back(geom::Vec3{lo.x + x * (hi.x - lo.x),
+      lo.y + y * (hi.y - lo.y), lo.z + z * (hi.z - lo.z)});
+  }
+  for (size_t i = 0; i < std::min(numVertexTets, tets.size()); ++i) {
+    geom::TetMeshes meshes;
+    for (size_t k = 0; k < meshes.size(); ++k) {
+      meshes[k] = &mesh[tets[i].m[k]];
+    }
+    for (const auto& v : geom::tet_vertices(meshes)) {
+      points.push_back(v);
+    }
+  }
+
+  Rvector<uint8_t> outside(points.size());
+  pool.parallel_for(points.size(), 256, [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i) {
+      outside[i] = std::none_of(bary.begin(), bary.end(),
+        [&](const geom::TetBary& tb) { return geom::inside_tet(tb, points[i], -eps); });
+    }
+  });
+
+  SizeTVec batched = state->locator().locate(points, pool);
+  size_t numOutside = 0;
+  size_t numWrong = 0;
+  for (size_t i = 0; i < points.size(); ++i) {
+    numOutside += outside[i];
+    for (auto tetID : {state->locator().locate(points[i]), batched[i]}) {
+      bool ok = tetID == geom::Tet::unset
+        ? outside[i] != 0
+        : geom::inside_tet(bary[tetID], points[i], -eps);
+      numWrong += !ok;
+    }
+  }
+
+  std::ostringstream detail;
+  detail << numWrong << " of " << points.size() << " points located wrongly ("
+         << numOutside << " outside of the mesh)";
+  return report("locator", numWrong == 0 && numOutside > 0, detail.str());
+}
+
+
+// Moments holds the first two moments of the molecule positions along each
+// axis and their standard errors
+struct Moments {
+  uint64_t numMols = 0;
+  double m[6] = {};    // mean of x, y, z, x^2, y^2, z^2
+  double se[6] = {};   // standard error of each mean
+};
+
+
+// compute_moments computes the Moments of all molecules of state
+static Moments compute_moments(const State& state) {
+  Moments mo;
+  double sum[6] = {}, sum2[6] = {};
+  for (auto tetID : state.active_tets()) {
+    for (const auto& mols : state.tetMols(tetID).activeMols) {
+      for (const auto& p : mols.pos) {
+        double v[6] = {p.x, p.y, p.z, double(p.x) * p.x, double(p.y) * p.y,
+          double(p.z) * p.z};
+        for (size_t k = 0; k < 6; ++k) {
+          sum[k] += v[k];
+          sum2[k] += v[k] * v[k];
+        }
+        ++mo.numMols;
+      }
+    }
+  }
+  for (size_t k = 0; k < 6 && mo.numMols > 0; ++k) {
+    mo.m[k] = sum[k] / mo.numMols;
+    double var = std::max(0.0, sum2[k] / mo.numMols - mo.m[k] * mo.m[k]);
+    mo.se[k] = std::sqrt(var / mo.numMols);
+  }
+  return mo;
+}
+
+
+// check_precision diffuses molecules through the mesh. Every molecule has to
+// lie inside its tet afterwards, which rounding positions in single precision
+// must not break. If config.refFile exists, the moments of the final
+// molecule distribution have to be within 4 standard errors of those stored
+// in it; otherwise they are stored in it. Since both builds draw the same
+// random numbers, a reference written by a double precision build bounds the
+// drift of a single precision one and vice versa.
+static bool check_precision(const geom::Mesh& mesh, const geom::Tets& tets,
+  ThreadPool& pool, const CheckConfig& config) {
+  auto state = new_state(mesh, tets, config);
+  release_mols(*state, pool, 0, config.numMols, 0.0, 0);
+  for (size_t i = 1; i <= config.steps; ++i) {
+    step(*state, pool, i);
+  }
+
+  size_t numOutside = 0;
+  for (auto tetID : state->active_tets()) {
+    const auto& tb = state->baryTable()[tetID];
+    for (const auto& mols : state->tetMols(tetID).activeMols) {
+      for (const auto& p : mols.pos) {
+        numOutside += !geom::inside_tet(tb, geom::Vec3(p), 0.0);
+      }
+    }
+  }
+  std::ostringstream inside;
+  inside << numOutside << " molecules outside of their tet";
+  bool ok = report("positions_inside", numOutside == 0, inside.str());
+  if (config.refFile.empty()) {
+    return ok;
+  }
+
+  Moments mo = compute_moments(*state);
+  std::ifstream in(config.refFile);
+  if (!in) {
+    std::ofstream out(config.refFile);
+    out.precision(17);
+    out << sizeof(MolVec3) << " " << mo.numMols;
+    for (auto m : mo.m) {
+      out << " " << m;
+    }
+    out << "\n";
+    return ok & report("precision", bool(out),
+      "wrote reference " + config.refFile);
+  }
+
+  size_t refVec3Size = 0;
+  Moments ref;
+  in >> refVec3Size >> ref.numMols;
+  for (auto& m : ref.m) {
+    in >> m;
+  }
+  if (!in) {
+    return report("precision", false, config.refFile + " is corrupt");
+  }
+  double maxDev = 0.0;
+  for (size_t k = 0; k < 6; ++k) {
+    maxDev = std::max(maxDev, std::abs(mo.m[k] - ref.m[k]) / mo.se[k]);
+  }
+  std::ostringstream detail;
+  detail << "moments of " << mo.numMols << " molecules (" << sizeof(MolVec3)
+         << " byte positions) within " << maxDev
+         << " standard errors of the reference (" << refVec3Size
+         << " byte positions)";
+  return ok & report("precision",
+    mo.numMols == ref.numMols && maxDev <= 4.0, detail.str());
+}
+
+
+// check_reaction_partners releases a few molecules of two species reacting
+// with certainty within the largest radius the mesh allows and runs a single
+// reaction pass. Pairs within that radius whose molecules have no other
+// partner in range, found by testing all pairs, have to react even if their
+// tets only share an edge or a vertex.
+static bool check_reaction_partners(const geom::Mesh& mesh,
+  const geom::Tets& tets, ThreadPool& pool, const CheckConfig& config) {
+  const size_t numMols = 600;
+  auto state = new_state(mesh, tets, config);
+  size_t bSpecID = state->create_species(MolSpecies("B", config.D));
+  size_t cSpecID = state->create_species(MolSpecies("C", config.D));
+  double r = state->min_inradius();
+  state->create_reaction(BimolReaction(0, bSpecID, SizeTVec{cSpecID}, 1e300, r));
+  release_mols(*state, pool, 0, numMols, 0.0, 0);
+  release_mols(*state, pool, bSpecID, numMols, 0.0, 0);
+
+  auto positions = [&](size_t specID) {
+    Rvector<geom::Vec3> pos;
+    for (auto tetID : state->active_tets()) {
+      for (const auto& p : state->tetMols(tetID).activeMols[specID].pos) {
+        pos.push_back(geom::Vec3(p));
+      }
+    }
+    return pos;
+  };
+  auto as = positions(0);
+  auto bs = positions(bSpecID);
+  SizeTVec numA(as.size()), numB(bs.size());
+  for (size_t i = 0; i < as.size(); ++i) {
+    for (size_t j = 0; j < bs.size(); ++j) {
+      if (geom::norm2(as[i] - bs[j]) < r * r) {
+        ++numA[i];
+        ++numB[j];
+      }
+    }
+  }
+  Rvector<geom::Vec3> isolated;
+  for (size_t i = 0; i < as.size(); ++i) {
+    for (size_t j = 0; j < bs.size(); ++j) {
+      if (numA[i] == 1 && numB[j] == 1 && geom::norm2(as[i] - bs[j]) < r * r) {
+        isolated.push_back(as[i]);
+      }
+    }
+  }
+
+  size_t numReactions = react(*state, pool, state->active_tets(), 1);
+  auto left = positions(0);
+  size_t numMissed = 0;
+  for (const auto& p : isolated) {
+    numMissed += std::any_of(left.begin(), left.end(),
+      [&](const geom::Vec3& q) { return q == p; });
+  }
+
+  std::ostringstream detail;
+  detail << numMissed << " of " << isolated.size()
+         << " isolated pairs within " << r << " missed, " << numReactions
+         << " reactions";
+  return report("reaction_partners", numMissed == 0 && !isolated.empty(),
+    detail.str());
+}
+
+
+// run_checks runs all checks, even if some of them fail
+bool run_checks(const geom::Mesh& mesh, const geom::Tets& tets,
+  ThreadPool& pool, const CheckConfig& config) {
+  bool ok = true;
+  ok &= check_mesh_props(mesh, tets, pool, config);
+  ok &= check_collision_modes(mesh, tets, pool, config);
+  ok &= check_thread_counts(mesh, tets, pool, config);
+  ok &= check_reaction_partners(mesh, tets, pool, config);
+  ok &= check_rng_streams(config);
+  ok &= check_processing_order(mesh, tets, pool, config);
+  ok &= check_active_tets(mesh, tets, pool, config);
+  ok &= check_locator(mesh, tets, pool, config);
+  ok &= check_precision(mesh, tets, pool, config);
+  return ok;
+}
@@ -0,0 +1,34 @@
+// Copyright 2015 Markus Dittrich
+// Licensed under BSD license, see LICENSE file for details
+
+#ifndef CHECKS_HPP
+#define CHECKS_HPP
+
+#include <string>
+
+#include "geometry.hpp"
+#include "thread_pool.hpp"
+
+
+// CheckConfig describes the simulations run by the checks
+struct CheckConfig {
+  double dt;            // time step
+  double D;             // diffusion coefficient of the released species
+  size_t numMols;       // number of molecules released
+  size_t steps;         // number of iterations simulated
+  std::string refFile;  // reference of the precision check (optional)
+};
+
+
+// run_checks runs a number of short simulations of numMols molecules on the
+// given mesh and compares properties of their outcome which are guaranteed by
+// the simulator, e.g. that the number of absorbed molecules equals the number
+// of molecules lost. Each check reports its outcome on stderr. Returns false
+// if any of them failed.
+// If config.refFile is set the moments of the final molecule distribution of
+// a plain diffusion run are compared to those stored in it, e.g. by a build
+// of the other precision, or stored in it if it doesn't exist yet.
+bool run_checks(const geom::Mesh& mesh, const geom::Tets& tets,
+  ThreadPool& pool, const CheckConfig& config);
+
+#endif
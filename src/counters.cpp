@@ -0,0 +1,76 @@
+// Copyright 2015 Markus Dittrich
+// Licensed under BSD license, see LICENSE file for details
+
+#include "counters.hpp"
+
+
+// operator+= adds the counts and times of c
+StepCounters& StepCounters::operator+=(const StepCounters& c) noexcept {
+  molsMoved += c.molsMoved;
+  intersectTests += c.intersectTests;
+  clearMoves += c.clearMoves;
+  reflections += c.reflections;
+  faceCrossings += c.faceCrossings;
+  absorptions += c.absorptions;
+  translucentHits += c.translucentHits;
+  translucentPasses += c.translucentPasses;
+  handoffs += c.handoffs;
+  handoffRounds += c.handoffRounds;
+  diffuseTime += c.diffuseTime;
+  replayTime += c.replayTime;
+  gcTime += c.gcTime;
+  reactTime += c.reactTime;
+  stepTime += c.stepTime;
+  return *this;
+}
+
+
+// constructor opening fileName and, for CSV output, writing the header
+StatsWriter::StatsWriter(const std::string& fileName)
+  : fileName_{fileName}, out_{fileName} {
+  const std::string ext = ".json";
+  json_ = fileName.size() >= ext.size() &&
+    fileName.compare(fileName.size() - ext.size(), ext.size(), ext) == 0;
+  if (!json_) {
+    out_ << "iter,mols_moved,intersect_tests,clear_moves,reflections,"
+         << "face_crossings,absorptions,translucent_hits,translucent_passes,"
+         << "handoffs,handoff_rounds,diffuse_time,replay_time,gc_time,"
+         << "react_time,step_time\n";
+  }
+}
+
+
+// write appends the counters c collected during the iterations up to and
+// including iter
+Error StatsWriter::write(uint64_t iter, const StepCounters& c) {
+  if (json_) {
+    out_ << "{\"iter\": " << iter
+         << ", \"mols_moved\": " << c.molsMoved
+         << ", \"intersect_tests\": " << c.intersectTests
+         << ", \"clear_moves\": " << c.clearMoves
+         << ", \"reflections\": " << c.reflections
+         << ", \"face_crossings\": " << c.faceCrossings
+         << ", \"absorptions\": " << c.absorptions
+         << ", \"translucent_hits\": " << c.translucentHits
+         << ", \"translucent_passes\": " << c.translucentPasses
+         << ", \"handoffs\": " << c.handoffs
+         << ", \"handoff_rounds\": " << c.handoffRounds
+         << ", \"diffuse_time\": " << c.diffuseTime
+         << ", \"replay_time\": " << c.replayTime
+         << ", \"gc_time\": " << c.gcTime
+         << ", \"react_time\": " << c.reactTime
+         << ", \"step_time\": " << c.stepTime << "}\n";
+  } else {
+    out_ << iter << "," << c.molsMoved << "," << c.intersectTests << ","
+         << c.clearMoves << "," << c.reflections << "," << c.faceCrossings
+         << "," << c.absorptions << "," << c.translucentHits << ","
+         << c.translucentPasses << "," << c.handoffs << "," << c.handoffRounds
+         << "," << c.diffuseTime << "," << c.replayTime << "," << c.gcTime
+         << "," << c.reactTime << "," << c.stepTime << "\n";
+  }
+  out_.flush();
+  if (out_.fail()) {
+    return Error{"Failed to write file " + fileName_};
+  }
+  return noErr;
+}
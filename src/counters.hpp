@@ -0,0 +1,104 @@
+// Copyright 2015 Markus Dittrich
+// Licensed under BSD license, see LICENSE file for details
+
+#ifndef COUNTERS_HPP
+#define COUNTERS_HPP
+
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <string>
+
+#include "error.hpp"
+
+
+// StepCounters collects event counts and phase timings of the diffusion
+// passes of step. Each thread updates its own instance in a vector, and step
+// sums them up once at the end. To avoid false sharing the counters are
+// framed by a cache line of padding on either side, which unlike alignas
+// also holds for heap storage under C++14. Phase times are thread times,
+// i.e. summed over all threads, except for the wall times of step and its
+// reaction pass.
+struct StepCounters {
+
+  StepCounters& operator+=(const StepCounters& c) noexcept;
+
+private:
+  char frontPad_[64] = {};
+
+public:
+
+  uint64_t molsMoved = 0;       // molecule displacements processed
+  uint64_t intersectTests = 0;  // four face intersection tests
+  uint64_t clearMoves = 0;      // moves too short to reach any face
+  uint64_t reflections = 0;     // reflections off reflective faces
+  uint64_t faceCrossings = 0;   // molecules leaving their tet through a face
+  uint64_t absorptions = 0;     // molecules absorbed by absorptive faces
+  uint64_t translucentHits = 0; // hits of translucent faces
+  uint64_t translucentPasses = 0;  // translucent hits letting molecules pass
+  uint64_t handoffs = 0;        // non-empty outgoing queues collected
+  uint64_t handoffRounds = 0;   // hand-off rounds until all molecules settled
+
+  double diffuseTime = 0.0;     // first pass diffusion in process_tet
+  double replayTime = 0.0;      // continued diffusion in process_incoming_mols
+  double gcTime = 0.0;          // removal of departed molecules
+  double reactTime = 0.0;       // wall time of the reaction pass of step
+  double stepTime = 0.0;        // wall time of step
+
+private:
+  char backPad_[64] = {};
+};
+
+
+// PhaseTimer adds the time between its construction and destruction to
+// the given phase time. If no phase time is given it does nothing, so timing
+// disabled counters doesn't query the clock.
+class PhaseTimer {
+
+public:
+
+  explicit PhaseTimer(double* phaseTime) : phaseTime_{phaseTime} {
+    if (phaseTime_ != nullptr) {
+      start_ = std::chrono::steady_clock::now();
+    }
+  }
+
+  ~PhaseTimer() {
+    if (phaseTime_ != nullptr) {
+      *phaseTime_ += std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start_).count();
+    }
+  }
+
+  // don't allow copy & move operations
+  PhaseTimer(const PhaseTimer& t) = delete;
+  PhaseTimer& operator=(const PhaseTimer& t) = delete;
+
+private:
+
+  double* phaseTime_;
+  std::chrono::steady_clock::time_point start_;
+};
+
+
+// StatsWriter writes StepCounters to a file, one record per call to write.
+// Files ending in .json are written as JSON lines, i.e. one JSON object per
+// record and line; all others as CSV with a header line.
+class StatsWriter {
+
+public:
+
+  explicit StatsWriter(const std::string& fileName);
+
+  // write appends the counters c collected during the iterations up to and
+  // including iter
+  Error write(uint64_t iter, const StepCounters& c);
+
+private:
+
+  std::string fileName_;
+  std::ofstream out_;
+  bool json_;
+};
+
+#endif
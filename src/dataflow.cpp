@@ -0,0 +1,358 @@
+// Copyright 2015 Markus Dittrich
+// Licensed under BSD license, see LICENSE file for details
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+#include "dataflow.hpp"
+#include "diffuse.hpp"
+#include "partition.hpp"
+#include "reaction.hpp"
+
+
+// number of times an idle thread looks for a ready block before it sleeps
+// until the next one is scheduled
+const size_t maxIdleSpins = 64;
+
+
+// Block is the state of a block of tets during a step. Phase 2r + 1
+// processes the molecules of hand-off round r (the first pass for r = 0) and
+// phase 2r > 0 collects those handed over during round r - 1.
+// links lists the block itself followed by its neighboring blocks and back
+// the index of the block within the links of each of them. handoffs[k]
+// lists the tets of block links[k] molecules were queued for during the last
+// processing phase.
+struct Dataflow::Block {
+  SizeTVec links;
+  SizeTVec back;
+
+  std::atomic<int64_t> done{0};     // last completed phase
+  std::atomic<int64_t> queued{0};   // last phase handed to the scheduler
+
+  SizeTVec active;                  // active tets at the start of the step
+  SizeTVec receivers;               // tets collected in the last phase
+  SizeTVec senders;                 // tets which queued molecules
+  Rvector<SizeTVec> handoffs;
+  SizeTVec visited;                 // tets which held molecules this step
+  uint64_t collected = 0;           // molecules collected in the last phase
+  size_t rounds = 0;                // last round with incoming molecules
+};
+
+
+// TaskQueues holds a double ended queue of ready blocks per thread. Threads
+// push and pop blocks at the back of their own queue and steal from the front
+// of the others' once it runs empty. Threads finding no block at all spin
+// for a while and then sleep until a block is pushed or the queues are
+// closed.
+class Dataflow::TaskQueues {
+
+public:
+
+  explicit TaskQueues(size_t numThreads)
+    : queues_{new Queue[numThreads]}, numThreads_{numThreads} {}
+
+  void push(size_t thread, size_t blockID) {
+    {
+      std::lock_guard<std::mutex> lock(queues_[thread].mutex);
+      queues_[thread].blocks.push_back(blockID);
+    }
+    pushes_.fetch_add(1);
+    if (numWaiting_.load() > 0) {
+      std::lock_guard<std::mutex> lock(waitMutex_);
+      wake_.notify_one();
+    }
+  }
+
+  bool pop(size_t thread, size_t& blockID) {
+    for (size_t i = 0; i < numThreads_; ++i) {
+      Queue& q = queues_[(thread + i) % numThreads_];
+      std::lock_guard<std::mutex> lock(q.mutex);
+      if (q.blocks.empty()) {
+        continue;
+      }
+      if (i == 0) {
+        blockID = q.blocks.back();
+        q.blocks.pop_back();
+      } else {
+        blockID = q.blocks.front();
+        q.blocks.pop_front();
+      }
+      return true;
+    }
+    return false;
+  }
+
+  // next pops the next ready block for thread, waiting for one if there is
+  // none. Returns false once the queues are closed.
+  bool next(size_t thread, size_t& blockID) {
+    for (size_t spin = 0; ; ++spin) {
+      // a block pushed after this point wakes the thread up again
+      uint64_t seen = pushes_.load();
+      if (pop(thread, blockID)) {
+        return true;
+      }
+      if (closed_.load()) {
+        return false;
+      }
+      if (spin < maxIdleSpins) {
+        std::this_thread::yield();
+        continue;
+      }
+      std::unique_lock<std::mutex> lock(waitMutex_);
+      numWaiting_.fetch_add(1);
+      wake_.wait(lock, [&]() {
+        return pushes_.load() != seen || closed_.load();
+      });
+      numWaiting_.fetch_sub(1);
+      spin = 0;
+    }
+  }
+
+  // close wakes up all waiting threads and makes next return false
+  void close() {
+    closed_ = true;
+    std::lock_guard<std::mutex> lock(waitMutex_);
+    wake_.notify_all();
+  }
+
+private:
+
+  struct Queue {
+    std::mutex mutex;
+    std::deque<size_t> blocks;
+  };
+
+  std::unique_ptr<Queue[]> queues_;
+  size_t numThreads_;
+
+  std::atomic<uint64_t> pushes_{0};
+  std::atomic<size_t> numWaiting_{0};
+  std::atomic<bool> closed_{false};
+  std::mutex waitMutex_;
+  std::condition_variable wake_;
+};
+
+
+// constructor partitioning tets into blocks and setting up their links
+Dataflow::Dataflow(const geom::Tets& tets, size_t numBlocks)
+  : tets_{tets},
+    numBlocks_{std::max<size_t>(1, std::min(numBlocks, tets.size()))} {
+  blockOf_ = partition_tets(tets, numBlocks_).part;
+  blocks_.reset(new Block[numBlocks_]);
+  for (size_t b = 0; b < numBlocks_; ++b) {
+    blocks_[b].links.push_back(b);
+  }
+  for (size_t tetID = 0; tetID < tets.size(); ++tetID) {
+    for (auto nbID : tets[tetID].t) {
+      if (nbID == geom::Tet::unset) {
+        continue;
+      }
+      auto& links = blocks_[blockOf_[tetID]].links;
+      if (std::find(links.begin(), links.end(), blockOf_[nbID]) == links.end()) {
+        links.push_back(blockOf_[nbID]);
+      }
+    }
+  }
+  for (size_t b = 0; b < numBlocks_; ++b) {
+    Block& blk = blocks_[b];
+    for (auto nb : blk.links) {
+      const auto& nbLinks = blocks_[nb].links;
+      blk.back.push_back(std::find(nbLinks.begin(), nbLinks.end(), b) -
+                         nbLinks.begin());
+    }
+    blk.handoffs.resize(blk.links.size());
+  }
+}
+
+
+Dataflow::~Dataflow() = default;
+
+
+// run_phase runs the next phase of block blk
+void Dataflow::run_phase(State& state, Block& blk, uint64_t iter,
+  StepCounters* c) {
+  int64_t phase = blk.done.load(std::memory_order_relaxed) + 1;
+  size_t round = phase / 2;
+
+  if (phase % 2 == 0) {
+    blk.receivers.clear();
+    for (size_t k = 0; k < blk.links.size(); ++k) {
+      const auto& h = blocks_[blk.links[k]].handoffs[blk.back[k]];
+      blk.receivers.insert(blk.receivers.end(), h.begin(), h.end());
+    }
+    std::sort(blk.receivers.begin(), blk.receivers.end());
+    blk.receivers.erase(std::unique(blk.receivers.begin(), blk.receivers.end()),
+      blk.receivers.end());
+
+    blk.collected = 0;
+    for (auto tetID : blk.receivers) {
+      blk.collected += collect_incoming_mols(state, tetID, c);
+    }
+    if (!blk.receivers.empty()) {
+      blk.rounds = round;
+      blk.visited.insert(blk.visited.end(), blk.receivers.begin(),
+        blk.receivers.end());
+    }
+    return;
+  }
+
+  // all neighbors collected the molecules queued during the last round once
+  // they completed the previous phase
+  for (auto tetID : blk.senders) {
+    clear_outgoing_mols(state, tetID);
+  }
+  blk.senders.clear();
+  for (auto& h : blk.handoffs) {
+    h.clear();
+  }
+
+  int64_t queued = 0;
+  const SizeTVec& tetIDs = round == 0 ? blk.active : blk.receivers;
+  for (auto tetID : tetIDs) {
+    size_t numOut = round == 0
+      ? process_tet(state, tetID, iter, c)
+      : process_incoming_mols(state, tetID, iter, round, c);
+    if (numOut == 0) {
+      continue;
+    }
+    blk.senders.push_back(tetID);
+    const auto& tet = tets_[tetID];
+    const auto& out = state.tetMols(tetID).outMols;
+    for (size_t j = 0; j < tet.t.size(); ++j) {
+      size_t numMols = out[j].num_mols();
+      if (numMols == 0 || tet.t[j] == geom::Tet::unset) {
+        continue;
+      }
+      queued += numMols;
+      size_t k = std::find(blk.links.begin(), blk.links.end(),
+        blockOf_[tet.t[j]]) - blk.links.begin();
+      blk.handoffs[k].push_back(tet.t[j]);
+    }
+  }
+
+  int64_t delta = queued - int64_t(blk.collected) - (round == 0 ? 1 : 0);
+  blk.collected = 0;
+  if (delta != 0 && pending_.fetch_add(delta) + delta == 0) {
+    finished_ = true;
+  }
+}
+
+
+// try_schedule hands the next phase of block blockID to the scheduler if the
+// block and all its neighbors completed the previous one. The compare and
+// exchange makes sure only one of the neighbors completing concurrently
+// schedules it.
+void Dataflow::try_schedule(size_t blockID, TaskQueues& queues) {
+  Block& blk = blocks_[blockID];
+  int64_t next = blk.done.load() + 1;
+  for (auto nb : blk.links) {
+    if (blocks_[nb].done.load() < next - 1) {
+      return;
+    }
+  }
+  int64_t expected = next - 1;
+  if (blk.queued.compare_exchange_strong(expected, next)) {
+    queues.push(ThreadPool::thread_id(), blockID);
+  }
+}
+
+
+// step runs the phases of all blocks on one scheduler loop per thread until
+// no molecules are left in flight, and then finishes the iteration like step
+size_t Dataflow::step(State& state, ThreadPool& pool, uint64_t iter,
+  StepCounters* counters) {
+  PhaseTimer stepTimer(counters != nullptr ? &counters->stepTime : nullptr);
+
+  // each thread counts into its own slot, or nowhere if counting is disabled
+  Rvector<StepCounters> threadCounters(counters != nullptr ? pool.size() : 0);
+  auto thread_counters = [&threadCounters]() -> StepCounters* {
+    return threadCounters.empty() ? nullptr
+                                  : &threadCounters[ThreadPool::thread_id()];
+  };
+
+  TaskQueues queues(pool.size());
+  for (size_t b = 0; b < numBlocks_; ++b) {
+    Block& blk = blocks_[b];
+    blk.done = 0;
+    blk.queued = 1;
+    blk.active.clear();
+    blk.visited.clear();
+    blk.collected = 0;
+    blk.rounds = 0;
+    queues.push(b % pool.size(), b);
+  }
+  for (auto tetID : state.active_tets()) {
+    blocks_[blockOf_[tetID]].active.push_back(tetID);
+  }
+  pending_ = numBlocks_;
+  finished_ = false;
+
+  pool.parallel_for(pool.size(), 1, [&](size_t, size_t) {
+    StepCounters* c = thread_counters();
+    size_t blockID;
+    while (!finished_) {
+      if (!queues.next(ThreadPool::thread_id(), blockID)) {
+        break;
+      }
+      Block& blk = blocks_[blockID];
+      run_phase(state, blk, iter, c);
+      blk.done.fetch_add(1);
+      if (finished_) {
+        queues.close();
+        break;
+      }
+      for (auto nb : blk.links) {
+        try_schedule(nb, queues);
+      }
+    }
+  });
+
+  // the queues of the last senders of each block may not have been cleared
+  // yet, and the active tets are those of its visited tets that hold
+  // molecules
+  Rvector<SizeTVec> active(numBlocks_);
+  pool.parallel_for(numBlocks_, 1, [&](size_t begin, size_t end) {
+    for (size_t b = begin; b < end; ++b) {
+      Block& blk = blocks_[b];
+      for (auto tetID : blk.senders) {
+        clear_outgoing_mols(state, tetID);
+      }
+      blk.senders.clear();
+      blk.receivers.clear();
+      for (auto& h : blk.handoffs) {
+        h.clear();
+      }
+
+      auto& visited = blk.visited;
+      visited.insert(visited.end(), blk.active.begin(), blk.active.end());
+      std::sort(visited.begin(), visited.end());
+      visited.erase(std::unique(visited.begin(), visited.end()), visited.end());
+      for (auto tetID : visited) {
+        if (state.tetMols(tetID).activeMols.num_mols() > 0) {
+          active[b].push_back(tetID);
+        }
+      }
+    }
+  });
+
+  SizeTVec activeTets;
+  size_t rounds = 0;
+  for (size_t b = 0; b < numBlocks_; ++b) {
+    activeTets.insert(activeTets.end(), active[b].begin(), active[b].end());
+    rounds = std::max(rounds, blocks_[b].rounds);
+  }
+  parallel_sort(activeTets, pool);
+  state.set_active_tets(std::move(activeTets));
+
+  if (counters != nullptr) {
+    counters->handoffRounds += rounds;
+  }
+  for (const auto& c : threadCounters) {
+    *counters += c;
+  }
+  PhaseTimer reactTimer(counters != nullptr ? &counters->reactTime : nullptr);
+  return react(state, pool, state.active_tets(), iter);
+}
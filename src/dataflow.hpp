@@ -0,0 +1,76 @@
+// Copyright 2015 Markus Dittrich
+// Licensed under BSD license, see LICENSE file for details
+
+#ifndef DATAFLOW_HPP
+#define DATAFLOW_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+#include "counters.hpp"
+#include "geometry.hpp"
+#include "state.hpp"
+#include "thread_pool.hpp"
+#include "util.hpp"
+
+
+// Dataflow steps the simulation like step but without the global barriers
+// between hand-off rounds. The tets are split into compact blocks (see
+// partition_tets), each of which goes through two phases per round:
+// collecting the molecules its neighbors handed to its tets and processing
+// them, which in turn queues molecules for the next round. Every block counts
+// the phases it completed and is advanced by a work stealing scheduler as
+// soon as it and all neighboring blocks are done with the previous phase.
+// This way the outgoing queues a block collects from are complete and no
+// neighbor still reads the queues it is about to refill, so the queues need
+// no locks. Busy regions of the mesh run ahead of quiet ones, by at most one
+// phase per block in between. Since every tet still sees the same molecules
+// in the same order and draws from the same random streams, results are
+// identical to those of step.
+class Dataflow {
+
+public:
+
+  // Dataflow splits tets into numBlocks blocks; as a rule of thumb there
+  // should be several blocks per thread
+  Dataflow(const geom::Tets& tets, size_t numBlocks);
+  ~Dataflow();
+
+  // don't allow copy & move operations
+  Dataflow(const Dataflow& d) = delete;
+  Dataflow& operator=(const Dataflow& d) = delete;
+
+  size_t num_blocks() const noexcept {
+    return numBlocks_;
+  }
+
+  // step advances state by iteration iter using all threads of pool. The
+  // iteration ends once no molecules are in flight anywhere and is completed
+  // by the reaction pass, which pairs molecules of neighboring tets and thus
+  // still runs over all active tets at once. Returns the number of
+  // reactions; events and phase times are added to counters unless it is
+  // null.
+  size_t step(State& state, ThreadPool& pool, uint64_t iter,
+    StepCounters* counters = nullptr);
+
+private:
+
+  struct Block;
+  class TaskQueues;
+
+  void run_phase(State& state, Block& blk, uint64_t iter, StepCounters* c);
+  void try_schedule(size_t blockID, TaskQueues& queues);
+
+  const geom::Tets& tets_;
+  size_t numBlocks_;
+  SizeTVec blockOf_;
+  std::unique_ptr<Block[]> blocks_;
+
+  // molecules queued but not yet processed by their new tet plus blocks which
+  // haven't completed their first pass; the iteration ends when it drops to 0
+  std::atomic<int64_t> pending_{0};
+  std::atomic<bool> finished_{false};
+};
+
+#endif
@@ -3,7 +3,7 @@
 
 #include <cassert>
 #include <cmath>
-#include <iostream>
+#include <type_traits>
 
 #include "GSL/array_view.h"
 
@@ -64,7 +64,9 @@ static std::tuple<int, geom::Vec3> collide(const State& state, VolMol& mol,
 }
 #endif
 
-bool diffuse(State& state, const MolSpecies& spec, VolMol& mol, double dt) {
+
+bool diffuse(State& state, const MolSpecies& spec, VolMols& mols, size_t i,
+  double dt) {
   // compute displacement
   double scale = sqrt(4*spec.D()*dt);
   geom::Vec3 disp{scale * state.rng_norm(), scale * state.rng_norm(),
@@ -73,143 +75,400 @@ bool diffuse(State& state, const MolSpecies& spec, VolMol& mol, double dt) {
   // diffuse and collide until we're at the end of our diffusion step
   //while (collide(state, mol, disp)) {}
   if (norm2(disp) > 0) {
-    mol.moveTo(mol.pos() + disp);
+    mols.pos[i] = MolVec3(geom::Vec3(mols.pos[i]) + disp);
   }
   return true;
 }
 
 
-// replay_incoming_mols adds all molecules from the incoming queue to the
-// active one.
-static void replay_incoming_mols(TetMolState& molState) {
-  auto& active = molState.activeMols;
-  for (auto&& m: molState.inMols) {
-    active.add(std::move(m));
+// collect_incoming_mols gathers all molecules that the neighboring tets
+// queued for tetID during their last pass into the tet's incoming queue. Each
+// tet only writes its own incoming queue and neighbors only read from their
+// own outgoing queues, so all tets can be collected concurrently. Neighbors
+// are visited in face order which keeps the result independent of the order
+// in which tets are processed.
+size_t collect_incoming_mols(State& state, size_t tetID, StepCounters* c) {
+  const geom::Tets& tets = state.tets();
+  const geom::Tet& tet = tets[tetID];
+  auto& incoming = state.tetMols(tetID).inMols;
+  size_t numMols = 0;
+  for (size_t i=0; i < tet.t.size(); ++i) {
+    size_t nbID = tet.t[i];
+    if (nbID == geom::Tet::unset) {
+      continue;
+    }
+    const geom::Tet& nb = tets[nbID];
+    for (size_t j=0; j < nb.t.size(); ++j) {
+      if (nb.t[j] != tetID) {
+        continue;
+      }
+      auto& out = state.tetMols(nbID).outMols[j];
+      for (size_t specID = 0; specID < out.size(); ++specID) {
+        if (out[specID].empty()) {
+          continue;
+        }
+        incoming[specID].append_all(out[specID]);
+        numMols += out[specID].size();
+        if (c != nullptr) {
+          ++c->handoffs;
+        }
+      }
+    }
   }
-  molState.inMols.clear();
+  return numMols;
 }
 
 
-// replay_outgoing_mols adds all molecules in the outgoing queue to the
-// incoming queues of the respective neighboring tets
-static void replay_outgoing_mols(const geom::Tet& tet, TetMolState& molState) {
-  auto& outgoing = molState.outMols;
-  for (size_t i=0; i < outgoing.size(); ++i) {
-    auto& out = outgoing[i];
-    if (out.size() == 0) {
-      continue;
-    }
-    size_t targetID = tet.t[i];
-    assert(targetID != geom::Tet::unset);
-    auto& target = molState.inMols;
-    target.insert(target.end(), std::make_move_iterator(out.begin()),
-      std::make_move_iterator(out.end()));
+// clear_outgoing_mols empties the outgoing queues of a tet once all neighbors
+// have collected them
+static void clear_outgoing_mols(TetMolState& molState) {
+  for (auto& out : molState.outMols) {
     out.clear();
   }
 }
 
-static std::tuple<int, size_t, geom::Vec3> collide(
-    VolMol& mol, const geom::Vec3& disp, const geom::TetMeshes& mesh) {
-  geom::Vec3 hitPoint;
-  geom::Vec3 disp_rem;
-  double disp_len2 = std::numeric_limits<float>::max();
-  const geom::MeshElement* closestMesh = nullptr;
-  size_t faceID = 0;
-  for (size_t i=0; i < mesh.size(); ++i) {
-    const auto m = mesh[i];
-    geom::Vec3 hitPoint_tmp;
-    if (intersect(mol.pos(), disp, m, &hitPoint_tmp) == 0) {
-      geom::Vec3 rem = hitPoint_tmp - mol.pos();
-      double rem_len2 = norm2(rem);
-      if (rem_len2 < disp_len2) {
-        hitPoint = hitPoint_tmp;
-        disp_rem = rem;
-        disp_len2 = rem_len2;
-        closestMesh = m;
-        faceID = i;
-      }
-    }
+
+// clear_outgoing_mols empties the outgoing queues of tet tetID
+void clear_outgoing_mols(State& state, size_t tetID) {
+  clear_outgoing_mols(state.tetMols(tetID));
+}
+
+
+// TetGeom bundles the precomputed geometry of a tet needed for diffusing
+// molecules within it. bary is only set in barycentric collision mode and
+// planes only outside of exhaustive mode, while shape is always set and used
+// for rounding positions via geom::mol_pos.
+struct TetGeom {
+  geom::TetMeshes meshes;
+  const geom::TetHitData* hitData;
+  const geom::TetBary* bary;
+  const geom::TetBary* shape;
+  const geom::TetPlanes* planes;
+};
+
+
+// tet_geom collects the geometry of tet tetID
+static TetGeom tet_geom(const State& state, size_t tetID) {
+  const geom::Mesh& mesh = state.mesh();
+  const geom::Tet& tet = state.tets()[tetID];
+  TetGeom g{geom::TetMeshes{&mesh[tet.m[0]], &mesh[tet.m[1]], &mesh[tet.m[2]],
+                            &mesh[tet.m[3]]},
+            &state.hitTable()[tetID], nullptr, &state.baryTable()[tetID],
+            nullptr};
+  if (state.collision_mode() == CollisionMode::barycentric) {
+    g.bary = &state.baryTable()[tetID];
+  }
+  if (state.collision_mode() != CollisionMode::exhaustive) {
+    g.planes = &state.planeTable()[tetID];
   }
+  return g;
+}
 
-  int status = 1;
-  if (closestMesh == nullptr) {
-    status = 0;
+
+// displacements ending at a point whose barycentric coordinates all exceed
+// baryEps are known to stay within the tet
+const double baryEps = 1e-9;
+
+
+// face_clearance returns the distance of position p from the face planes of
+// the tet described by tg less geom::EPSILON, rounded down to the precision
+// of VolMols::faceDist. Displacements shorter than it stay clear of all faces
+// with a margin that keeps the intersection tests from finding a hit, so
+// skipping them doesn't change any results. Without face planes the
+// clearance is 0, i.e. all displacements are tested.
+static float face_clearance(const TetGeom& tg, const MolVec3& p) {
+  if (tg.planes == nullptr) {
+    return 0.0f;
+  }
+  double dist = geom::face_distance(*tg.planes, geom::Vec3(p)) - geom::EPSILON;
+  if (dist <= 0.0) {
+    return 0.0f;
+  }
+  float clearance = static_cast<float>(dist);
+  return clearance > dist ? std::nextafter(clearance, 0.0f) : clearance;
+}
+
+
+// stream IDs of the per tet streams deciding whether molecules pass
+// translucent faces start here to keep them apart from the diffusion,
+// reaction, and release streams. Each hand-off round of a step uses its own
+// streams, with the round number in the bits above passRoundShift.
+const uint64_t passStreamBase = uint64_t(1) << 62;
+const uint64_t passRoundShift = 40;
+
+
+// The diffusion kernels below are specialized for the set of face properties
+// (see geom::prop_bit) of the tet they work on. Interior tets only have
+// transparent faces and skip all reflection, absorption, and translucency
+// handling; tets on the model boundary usually only add reflective faces.
+// All other tets use the generic kernel.
+const uint8_t interiorProps = geom::prop_bit(geom::MeshProp::transparent);
+const uint8_t boundaryProps = interiorProps |
+  geom::prop_bit(geom::MeshProp::reflective);
+const uint8_t allProps = boundaryProps |
+  geom::prop_bit(geom::MeshProp::absorptive) |
+  geom::prop_bit(geom::MeshProp::translucent);
+
+
+// dispatch_props calls func with the kernel face property set, wrapped in a
+// std::integral_constant, covering the face properties props of a tet
+template <typename Func>
+static auto dispatch_props(uint8_t props, Func func) {
+  if (props == interiorProps) {
+    return func(std::integral_constant<uint8_t, interiorProps>());
+  } else if ((props & ~boundaryProps) == 0) {
+    return func(std::integral_constant<uint8_t, boundaryProps>());
   }
-  return std::make_tuple(status, faceID, hitPoint);
+  return func(std::integral_constant<uint8_t, allProps>());
 }
 
-// diffuse_new
-static int diffuse_new(VolMol& mol, geom::Vec3& disp,
-                       const geom::TetMeshes& mesh) {
-  int status = 0;
-  int faceID = 0;
+
+// status returned by diffuse_new for molecules staying inside the tet and
+// for absorbed molecules
+const int stayed = -1;
+const int absorbed = -2;
+
+
+// diffuse_new moves molecule i of mols along disp within the tet described by
+// tg, whose face properties have to be in Props. It returns the index of the
+// face through which the molecule left the tet, stayed, or absorbed.
+// Molecules leaving the tet are placed just beyond the crossed face and keep
+// the part of disp they have yet to travel in dispRem. Whether a molecule
+// passes a translucent face is decided by a uniform deviate from passRng.
+// Events are counted in c unless it is null. The molecule is moved in double
+// precision and only its final state is rounded to MolVec3. Molecules coming
+// to rest get their faceDist updated for the next step.
+template <uint8_t Props>
+static int diffuse_new(VolMols& mols, size_t i, geom::Vec3& disp,
+                       const TetGeom& tg, RngUniform& passRng,
+                       StepCounters* c) {
   geom::Vec3 hitPoint;
+  geom::Vec3 pos(mols.pos[i]);
+  double clearance = mols.faceDist[i];
 
   while (true) {
-    std::tie(status, faceID, hitPoint) = collide(mol, disp, mesh);
+    // displacements shorter than the distance from all face planes can't
+    // cross any of them
+    if (norm2(disp) < clearance * clearance) {
+      if (c != nullptr) {
+        ++c->clearMoves;
+      }
+      break;
+    }
+
+    // tets are convex, hence a segment starting inside the tet and ending
+    // inside it can't cross any of its faces
+    if (tg.bary != nullptr && geom::inside_tet(*tg.bary, pos + disp, baryEps)) {
+      break;
+    }
+
+    int faceID = geom::intersect_tet(*tg.hitData, pos, disp, &hitPoint);
+    if (c != nullptr) {
+      ++c->intersectTests;
+    }
 
     // We didn't hit a mesh. Move molecule to final position and then return.
-    if (status == 0) {
+    if (faceID == -1) {
       break;
     }
 
-    geom::Vec3 disp_rem = hitPoint - mol.pos();
-    mol.inFlight = true;
-    mol.moveTo(hitPoint);
+    geom::Vec3 disp_rem = disp - (hitPoint - pos);
+    const geom::MeshElement* hitMesh = tg.meshes[faceID];
+    geom::MeshProp prop = hitMesh->prop;
+
+    // translucent faces act as transparent ones with probability passProb
+    // and as reflective ones otherwise
+    if ((Props & geom::prop_bit(geom::MeshProp::translucent)) &&
+        prop == geom::MeshProp::translucent) {
+      bool pass = passRng.gen() <= hitMesh->passProb;
+      if (c != nullptr) {
+        ++c->translucentHits;
+        c->translucentPasses += pass;
+      }
+      prop = pass ? geom::MeshProp::transparent : geom::MeshProp::reflective;
+    }
 
-    const geom::MeshElement* hitMesh = mesh[faceID];
-    if (hitMesh->prop == geom::MeshProp::reflective) {
-      disp = disp_rem - (2 * (disp_rem * hitMesh->n_norm)) * hitMesh->n_norm;
-      mol.dispRem = disp;
-    } else if (hitMesh->prop == geom::MeshProp::transparent) {
-      mol.dispRem = disp_rem;
+    if (Props == interiorProps || prop == geom::MeshProp::transparent) {
+      if (c != nullptr) {
+        ++c->faceCrossings;
+      }
+
+      // step just across the face so the neighboring tet won't see it again
+      auto disp_n = normalize(disp);
+      mols.flags[i] |= molFlags::inFlight;
+      mols.pos[i] = geom::cross_pos(*hitMesh, disp,
+        hitPoint + geom::EPSILON * disp_n);
+      mols.dispRem[i] = MolVec3(disp_rem - geom::EPSILON * disp_n);
+      mols.faceDist[i] = 0.0f;
       return faceID;
     }
+
+    if ((Props & geom::prop_bit(geom::MeshProp::absorptive)) &&
+        prop == geom::MeshProp::absorptive) {
+      if (c != nullptr) {
+        ++c->absorptions;
+      }
+      return absorbed;
+    }
+
+    // all remaining faces are reflective
+    if (c != nullptr) {
+      ++c->reflections;
+    }
+    mols.flags[i] |= molFlags::inFlight;
+
+    // reflect: Rr = Ri - 2 N (Ri * N)
+    disp = disp_rem - (2 * (disp_rem * hitMesh->n_norm)) * hitMesh->n_norm;
+
+    // move slightly away from the triangle along the reflected ray.
+    // If we happen to end our ray at hitpoint we move along the triangle
+    // normal instead.
+    if (norm2(disp) > geom::EPSILON_2) {
+      double n = norm(disp);
+      auto disp_n = (1.0 / n) * disp;
+      hitPoint += geom::EPSILON * disp_n;
+      disp = (n - geom::EPSILON) * disp_n;
+    } else {
+      double side = (disp_rem * hitMesh->n_norm) > 0 ? -1 : 1;
+      hitPoint += side * geom::EPSILON * hitMesh->n_norm;
+    }
+    pos = hitPoint;
+    mols.dispRem[i] = MolVec3(disp);
+    clearance = 0.0;
   }
 
   // done diffusing in this tet
-  mol.moveTo(mol.pos() + disp);
-  mol.inFlight = false;
-  return -1;
+  mols.pos[i] = geom::mol_pos(tg.meshes, *tg.shape, pos + disp);
+  mols.faceDist[i] = face_clearance(tg, mols.pos[i]);
+  mols.flags[i] &= ~molFlags::inFlight;
+  return stayed;
 }
 
-// process_tet propagates all events that happen within the tet (molecule
-// diffusion, reaction)
-bool process_tet(State& state, size_t tetID) {
-  const geom::Mesh& mesh = state.mesh();
-  const geom::Tet& tet = state.tets()[tetID];
-  const SpeciesContainer& specs = state.species();
-  TetMolState& molState = state.tetMols(tetID);
-  double dt = state.dt();
 
-  replay_incoming_mols(molState);
+// diffuse_tet_mols diffuses all active molecules of a tet with face
+// properties in Props during the first pass. See process_tet.
+template <uint8_t Props>
+static size_t diffuse_tet_mols(State& state, TetMolState& molState,
+  const TetGeom& tg, RngNorm& rng, RngUniform& passRng, StepCounters* c) {
+  const SpeciesContainer& specs = state.species();
 
-  geom::TetMeshes tetMeshes{&mesh[tet.m[0]], &mesh[tet.m[1]], &mesh[tet.m[2]],
-                            &mesh[tet.m[3]]};
+  // per thread buffer for normal deviates, reused across tets
+  static thread_local Rvector<double> rnd;
 
-  for (auto& s : molState.activeMols) {
-    size_t specID = s.first;
-    VolMolContainer& mols = s.second;
-    std::cout << "before " << mols.size() << "\n";
+  size_t numOut = 0;
+  for (size_t specID = 0; specID < molState.activeMols.size(); ++specID) {
+    VolMols& mols = molState.activeMols[specID];
+    if (mols.empty()) {
+      continue;
+    }
     double scale = sqrt(4 * specs[specID].D() * state.dt());
-    for (auto& mol : mols) {
-      geom::Vec3 disp{scale * state.rng_norm(), scale * state.rng_norm(),
-                      scale * state.rng_norm()};
-      int status = diffuse_new(*mol, disp, tetMeshes);
-      if (status == -1) {
-        continue;
-      } else {
-        molState.outMols[status].push_back(std::move(mol));
-        continue;
+
+    // draw the displacements of all molecules in a single batch
+    rnd.resize(3 * mols.size());
+    rng.gen(rnd.data(), rnd.size());
+
+    bool hasDead = false;
+    {
+      PhaseTimer timer(c != nullptr ? &c->diffuseTime : nullptr);
+      for (size_t i = 0; i < mols.size(); ++i) {
+        geom::Vec3 disp{scale * rnd[3*i], scale * rnd[3*i+1], scale * rnd[3*i+2]};
+        int status = diffuse_new<Props>(mols, i, disp, tg, passRng, c);
+        if (status == stayed) {
+          continue;
+        }
+        if (status != absorbed) {
+          molState.outMols[status][specID].append(mols, i);
+          ++numOut;
+        }
+        mols.flags[i] |= molFlags::dead;
+        hasDead = true;
       }
     }
+    if (c != nullptr) {
+      c->molsMoved += mols.size();
+    }
+
     // garbage collect dead mols
-    mols.erase(std::remove_if(mols.begin(), mols.end(), [](auto& p) {
-                 return p == nullptr;
-               }), mols.end());
-    std::cout << "after " << mols.size() << "\n";
+    if (hasDead) {
+      PhaseTimer timer(c != nullptr ? &c->gcTime : nullptr);
+      mols.compact();
+    }
   }
+  return numOut;
+}
 
-  replay_outgoing_mols(tet, molState);
-  return true;
+
+// process_tet propagates all events that happen within the tet (molecule
+// diffusion, reaction) during the first pass of iteration iter. All random
+// numbers are drawn from the tet's streams for iter. Molecules leaving the
+// tet are queued in the tet's outgoing queues. Returns the number of queued
+// molecules.
+size_t process_tet(State& state, size_t tetID, uint64_t iter, StepCounters* c) {
+  TetMolState& molState = state.tetMols(tetID);
+
+  clear_outgoing_mols(molState);
+  TetGeom tg = tet_geom(state, tetID);
+  RngNorm rng(state.seed(), iter, tetID);
+  RngUniform passRng(state.seed(), iter, passStreamBase + tetID);
+  return dispatch_props(state.tet_props(tetID), [&](auto props) {
+    return diffuse_tet_mols<decltype(props)::value>(state, molState, tg, rng,
+      passRng, c);
+  });
+}
+
+
+// replay_tet_mols continues the diffusion of all incoming molecules of a tet
+// with face properties in Props. See process_incoming_mols.
+template <uint8_t Props>
+static size_t replay_tet_mols(TetMolState& molState, const TetGeom& tg,
+  RngUniform& passRng, StepCounters* c) {
+  auto& incoming = molState.inMols;
+  size_t numOut = 0;
+  for (size_t specID = 0; specID < incoming.size(); ++specID) {
+    VolMols& mols = incoming[specID];
+    if (c != nullptr) {
+      c->molsMoved += mols.size();
+    }
+    for (size_t i = 0; i < mols.size(); ++i) {
+      // rounding may have put molecules right behind the face they entered
+      // through, which they would then cross again
+      mols.pos[i] = geom::mol_pos(tg.meshes, *tg.shape, geom::Vec3(mols.pos[i]));
+      geom::Vec3 disp(mols.dispRem[i]);
+      int status = diffuse_new<Props>(mols, i, disp, tg, passRng, c);
+      if (status == stayed) {
+        molState.activeMols[specID].append(mols, i);
+      } else if (status != absorbed) {
+        molState.outMols[status][specID].append(mols, i);
+        ++numOut;
+      }
+    }
+  }
+  return numOut;
+}
+
+
+// process_incoming_mols continues the diffusion of all molecules that entered
+// the tet during hand-off round round (starting at 1) of iteration iter along
+// their remaining displacement. Molecules ending up inside the tet become
+// active, all others are queued in the tet's outgoing queues. Returns the
+// number of queued molecules.
+size_t process_incoming_mols(State& state, size_t tetID, uint64_t iter,
+  size_t round, StepCounters* c) {
+  TetMolState& molState = state.tetMols(tetID);
+
+  clear_outgoing_mols(molState);
+  auto& incoming = molState.inMols;
+  if (incoming.num_mols() == 0) {
+    return 0;
+  }
+
+  PhaseTimer timer(c != nullptr ? &c->replayTime : nullptr);
+  TetGeom tg = tet_geom(state, tetID);
+  RngUniform passRng(state.seed(), iter,
+    passStreamBase + (uint64_t(round) << passRoundShift) + tetID);
+  size_t numOut = dispatch_props(state.tet_props(tetID), [&](auto props) {
+    return replay_tet_mols<decltype(props)::value>(molState, tg, passRng, c);
+  });
+  incoming.clear();
+  return numOut;
 }
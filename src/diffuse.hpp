@@ -4,11 +4,26 @@
 #ifndef DIFFUSE_HPP
 #define DIFFUSE_HPP
 
+#include "counters.hpp"
+#include "rng.hpp"
 #include "state.hpp"
 
 
-bool diffuse(State& state, const MolSpecies& spec, VolMol& mol, double dt);
+// the functions below count their events and time their phases in c unless
+// it is null
 
-bool process_tet(State& state, size_t tetID);
+bool diffuse(State& state, const MolSpecies& spec, VolMols& mols, size_t i,
+  double dt);
+
+size_t process_tet(State& state, size_t tetID, uint64_t iter,
+  StepCounters* c = nullptr);
+
+size_t process_incoming_mols(State& state, size_t tetID, uint64_t iter,
+  size_t round, StepCounters* c = nullptr);
+
+size_t collect_incoming_mols(State& state, size_t tetID,
+  StepCounters* c = nullptr);
+
+void clear_outgoing_mols(State& state, size_t tetID);
 
 #endif
@@ -0,0 +1,801 @@
+// Copyright 2015 Markus Dittrich
+// Licensed under BSD license, see LICENSE file for details
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <thread>
+
+#include <dirent.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "counters.hpp"
+#include "domain.hpp"
+#include "step.hpp"
+#include "thread_pool.hpp"
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2,
+  "shared memory synchronization requires lock free 64 bit atomics");
+
+
+// number of records moved between a ring buffer and local memory at a time
+const size_t recordChunk = 256;
+
+// number of polls of a spinning process before it starts yielding the cpu
+const size_t maxSpins = 64;
+
+// capacity of the rings between subdomains which don't share a face at the
+// start. They only carry end of batch records unless rebalancing makes the
+// subdomains neighbors, and since senders drain their incoming rings while
+// waiting for space any capacity works, just with more round trips.
+const size_t distantRingCapacity = recordChunk;
+
+
+// backoff is called by processes waiting on another one. It first just spins
+// and then starts to yield since workers may outnumber the cores.
+static void backoff(size_t& spins) {
+  if (++spins > maxSpins) {
+    std::this_thread::yield();
+  }
+}
+
+
+// HaloRing is a single producer single consumer ring buffer of HaloRecords
+// in shared memory. The producer only writes head_ and the consumer only
+// writes tail_, both of which count records ever pushed and popped, so the
+// ring needs no locks.
+class HaloRing {
+
+public:
+
+  HaloRing(HaloRecord* buf, size_t capacity) : buf_{buf}, capacity_{capacity} {}
+
+  // push appends up to n records of recs and returns the number appended
+  size_t push(const HaloRecord* recs, size_t n) {
+    uint64_t head = head_.load(std::memory_order_relaxed);
+    uint64_t tail = tail_.load(std::memory_order_acquire);
+    n = std::min<size_t>(n, capacity_ - (head - tail));
+    for (size_t i = 0; i < n; ++i) {
+      buf_[(head + i) % capacity_] = recs[i];
+    }
+    head_.store(head + n, std::memory_order_release);
+    return n;
+  }
+
+  // pop removes up to n records into recs and returns the number removed
+  size_t pop(HaloRecord* recs, size_t n) {
+    uint64_t tail = tail_.load(std::memory_order_relaxed);
+    uint64_t head = head_.load(std::memory_order_acquire);
+    n = std::min<size_t>(n, head - tail);
+    for (size_t i = 0; i < n; ++i) {
+      recs[i] = buf_[(tail + i) % capacity_];
+    }
+    tail_.store(tail + n, std::memory_order_release);
+    return n;
+  }
+
+  bool empty() const noexcept {
+    return head_.load(std::memory_order_acquire) ==
+           tail_.load(std::memory_order_acquire);
+  }
+
+private:
+
+  alignas(64) std::atomic<uint64_t> head_{0};
+  alignas(64) std::atomic<uint64_t> tail_{0};
+  HaloRecord* buf_;
+  size_t capacity_;
+};
+
+
+// DomainControl holds the state of the collective reduction of the workers.
+// The two sums alternate between consecutive reductions so the last process
+// to arrive can reset the next one while the others still read theirs.
+struct DomainControl {
+  alignas(64) std::atomic<uint64_t> arrived{0};
+  alignas(64) std::atomic<uint64_t> generation{0};
+  alignas(64) std::atomic<uint64_t> sums[2];
+};
+
+
+// DomainShared keeps the shared memory through which the processes of
+// run_domains communicate: the reduction state, the statistics and load of
+// each worker, the work per tet, one halo ring per ordered pair of
+// subdomains, and one ring per worker for collecting molecules in the parent.
+// Rings exist for all pairs since the neighbors of a subdomain change when
+// rebalancing, but only those between initially neighboring subdomains get
+// the full capacity. The memory is mapped before the workers are forked and
+// thus at the same address in all processes.
+class DomainShared {
+
+public:
+
+  DomainShared() = default;
+  ~DomainShared();
+
+  // don't allow copy & move operations
+  DomainShared(const DomainShared& d) = delete;
+  DomainShared& operator=(const DomainShared& d) = delete;
+  DomainShared(DomainShared&& d) = delete;
+  DomainShared& operator=(DomainShared&& d) = delete;
+
+  // open maps and sets up the shared memory for numProcs workers on a mesh
+  // of numTets tets. The rings from p to q with adjacent[p * numProcs + q]
+  // set and those to the parent hold capacity records each, all others
+  // distantRingCapacity.
+  Error open(size_t numProcs, size_t numTets, size_t capacity,
+    const Rvector<uint8_t>& adjacent);
+
+  size_t num_procs() const noexcept {
+    return numProcs_;
+  }
+
+  // halo_ring returns the ring from subdomain from to subdomain to
+  HaloRing& halo_ring(size_t from, size_t to) {
+    return *haloRings_[from * numProcs_ + to];
+  }
+
+  // gather_ring returns the ring from worker p to the parent
+  HaloRing& gather_ring(size_t p) {
+    return *gatherRings_[p];
+  }
+
+  DomainStats& stats(size_t p) {
+    return stats_[p];
+  }
+
+  // loads holds the work of each worker and tet_work the work of each tet
+  // when rebalancing
+  uint64_t* loads() noexcept {
+    return loads_;
+  }
+
+  uint64_t* tet_work() noexcept {
+    return tetWork_;
+  }
+
+  // allreduce returns the sum of v over all workers once all of them called
+  // it
+  uint64_t allreduce(uint64_t v);
+
+private:
+
+  void close();
+
+  void* mem_ = nullptr;
+  size_t size_ = 0;
+  size_t numProcs_ = 0;
+  Rvector<HaloRing*> haloRings_;
+  Rvector<HaloRing*> gatherRings_;
+  DomainControl* control_ = nullptr;
+  DomainStats* stats_ = nullptr;
+  uint64_t* loads_ = nullptr;
+  uint64_t* tetWork_ = nullptr;
+};
+
+
+// destructor releasing the shared memory
+DomainShared::~DomainShared() {
+  close();
+}
+
+
+// open sets up the shared memory for numProcs workers. The layout is the
+// control block, the statistics, loads, and work per tet, all ring headers,
+// and the ring buffers.
+Error DomainShared::open(size_t numProcs, size_t numTets, size_t capacity,
+  const Rvector<uint8_t>& adjacent) {
+  close();
+  numProcs_ = numProcs;
+  auto align = [](size_t n) { return (n + 63) / 64 * 64; };
+  size_t numRings = numProcs_ * numProcs_ + numProcs_;
+  SizeTVec capacities(numRings, capacity);
+  for (size_t i = 0; i < numProcs_ * numProcs_; ++i) {
+    if (!adjacent[i]) {
+      capacities[i] = std::min(capacity, distantRingCapacity);
+    }
+  }
+  size_t controlSize = align(sizeof(DomainControl));
+  size_t statsSize = align(numProcs_ * sizeof(DomainStats));
+  size_t loadsSize = align(numProcs_ * sizeof(uint64_t));
+  size_t workSize = align(numTets * sizeof(uint64_t));
+  size_t headerSize = align(sizeof(HaloRing));
+  size_t bufsSize = 0;
+  for (auto c : capacities) {
+    bufsSize += align(c * sizeof(HaloRecord));
+  }
+  size_ = controlSize + statsSize + loadsSize + workSize +
+    numRings * headerSize + bufsSize;
+  mem_ = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+    -1, 0);
+  if (mem_ == MAP_FAILED) {
+    mem_ = nullptr;
+    return Error{"Failed to map " + std::to_string(size_) +
+      " bytes of shared memory: " + strerror(errno)};
+  }
+
+  char* p = static_cast<char*>(mem_);
+  control_ = new (p) DomainControl;
+  control_->sums[0].store(0);
+  control_->sums[1].store(0);
+  p += controlSize;
+  stats_ = reinterpret_cast<DomainStats*>(p);
+  std::uninitialized_fill_n(stats_, numProcs_, DomainStats());
+  p += statsSize;
+  loads_ = reinterpret_cast<uint64_t*>(p);
+  p += loadsSize;
+  tetWork_ = reinterpret_cast<uint64_t*>(p);
+  p += workSize;
+  char* buf = p + numRings * headerSize;
+  for (size_t i = 0; i < numRings; ++i) {
+    auto ring = new (p + i * headerSize) HaloRing(
+      reinterpret_cast<HaloRecord*>(buf), capacities[i]);
+    (i < numProcs_ * numProcs_ ? haloRings_ : gatherRings_).push_back(ring);
+    buf += align(capacities[i] * sizeof(HaloRecord));
+  }
+  return noErr;
+}
+
+
+// close unmaps the shared memory. All objects in it are trivially
+// destructible.
+void DomainShared::close() {
+  if (mem_ != nullptr) {
+    munmap(mem_, size_);
+  }
+  mem_ = nullptr;
+  haloRings_.clear();
+  gatherRings_.clear();
+}
+
+
+// allreduce is a sense reversing barrier which also sums up v
+uint64_t DomainShared::allreduce(uint64_t v) {
+  uint64_t gen = control_->generation.load(std::memory_order_acquire);
+  auto& sum = control_->sums[gen % 2];
+  sum.fetch_add(v, std::memory_order_acq_rel);
+  if (control_->arrived.fetch_add(1, std::memory_order_acq_rel) + 1 ==
+      numProcs_) {
+    control_->arrived.store(0, std::memory_order_relaxed);
+    control_->sums[(gen + 1) % 2].store(0, std::memory_order_relaxed);
+    control_->generation.store(gen + 1, std::memory_order_release);
+  } else {
+    size_t spins = 0;
+    while (control_->generation.load(std::memory_order_acquire) == gen) {
+      backoff(spins);
+    }
+  }
+  return sum.load(std::memory_order_acquire);
+}
+
+
+// constructor
+Subdomain::Subdomain(const geom::Tets& tets, const Partition& part, size_t id,
+  DomainShared& shared)
+  : tets_{tets}, id_{id}, shared_{shared}, sendBufs_(shared.num_procs()),
+    batchDone_(shared.num_procs(), 0), work_(tets.size(), 0) {
+  for (size_t q = 0; q < shared.num_procs(); ++q) {
+    if (q != id_) {
+      peers_.push_back(q);
+    }
+  }
+  set_partition(part);
+}
+
+
+// set_partition switches to partition part and determines the neighboring
+// subdomains, i.e. those owning tets which share a face with ours
+void Subdomain::set_partition(Partition part) {
+  part_ = std::move(part);
+  Rvector<uint8_t> adjacent(shared_.num_procs(), 0);
+  for (size_t i = 0; i < tets_.size(); ++i) {
+    if (!owns(i)) {
+      continue;
+    }
+    for (auto nbID : tets_[i].t) {
+      if (nbID != geom::Tet::unset && !owns(nbID)) {
+        adjacent[part_.part[nbID]] = 1;
+      }
+    }
+  }
+  nbs_.clear();
+  for (auto q : peers_) {
+    if (adjacent[q]) {
+      nbs_.push_back(q);
+    }
+  }
+}
+
+
+// in_flight returns true if any subdomain has a non-zero numSenders
+bool Subdomain::in_flight(size_t numSenders) {
+  return shared_.allreduce(numSenders) > 0;
+}
+
+
+// exchange sends the molecules queued by senders across cut faces to the
+// owning processes. Records are queued in the order of senders, faces,
+// species, and molecules so the receiving queues end up in the same order as
+// in a single process.
+SizeTVec Subdomain::exchange(State& state, const SizeTVec& senders) {
+  for (auto tetID : senders) {
+    const auto& tet = state.tets()[tetID];
+    auto& out = state.tetMols(tetID).outMols;
+    for (uint32_t j = 0; j < tet.t.size(); ++j) {
+      size_t nbID = tet.t[j];
+      if (nbID == geom::Tet::unset || owns(nbID) || out[j].num_mols() == 0) {
+        continue;
+      }
+      auto& buf = sendBufs_[part_.part[nbID]];
+      for (uint32_t s = 0; s < out[j].size(); ++s) {
+        const auto& mols = out[j][s];
+        for (size_t i = 0; i < mols.size(); ++i) {
+          buf.push_back(HaloRecord{tetID, j, s, mols.pos[i], mols.dispRem[i],
+            mols.t[i], mols.flags[i]});
+        }
+      }
+      out[j].clear();
+    }
+  }
+  for (auto q : nbs_) {
+    stats_.haloMols += sendBufs_[q].size();
+    stats_.haloBytes += sendBufs_[q].size() * sizeof(HaloRecord);
+  }
+
+  SizeTVec ghosts;
+  transfer(state, nbs_, ghosts);
+  std::sort(ghosts.begin(), ghosts.end());
+  ghosts.erase(std::unique(ghosts.begin(), ghosts.end()), ghosts.end());
+  return ghosts;
+}
+
+
+// rebalance compares the work of all subdomains and switches to blocks of
+// equal work if the imbalance exceeds ratio. All workers compute the same
+// blocks from the work per tet in shared memory. The reduction orders the
+// writes to and reads from loads and tet_work; their next use follows at
+// least one step, and thus another reduction, later.
+bool Subdomain::rebalance(State& state, double ratio) {
+  uint64_t* tetWork = shared_.tet_work();
+  for (size_t i = 0; i < work_.size(); ++i) {
+    if (owns(i)) {
+      tetWork[i] = work_[i];
+    }
+  }
+  uint64_t load = collect_work();
+  uint64_t* loads = shared_.loads();
+  loads[id_] = load;
+  uint64_t total = shared_.allreduce(load);
+  uint64_t maxLoad = *std::max_element(loads, loads + shared_.num_procs());
+  if (total == 0 || maxLoad <= ratio * total / shared_.num_procs()) {
+    return false;
+  }
+
+  // every tet carries a unit weight so blocks without work stay bounded
+  Rvector<uint64_t> weights(tetWork, tetWork + work_.size());
+  for (auto& w : weights) {
+    ++w;
+  }
+  Partition part = partition_blocks(tets_, shared_.num_procs(), weights);
+
+  // the active molecules of tets changing owner are sent to the new owner in
+  // tet order and are appended to its (empty) tets in the same order
+  SizeTVec active;
+  for (auto tetID : state.active_tets()) {
+    if (part.part[tetID] == id_) {
+      active.push_back(tetID);
+      continue;
+    }
+    auto& buf = sendBufs_[part.part[tetID]];
+    auto& species = state.tetMols(tetID).activeMols;
+    for (uint32_t s = 0; s < species.size(); ++s) {
+      const auto& mols = species[s];
+      for (size_t i = 0; i < mols.size(); ++i) {
+        buf.push_back(HaloRecord{tetID, migrated, s, mols.pos[i],
+          mols.dispRem[i], mols.t[i], mols.flags[i]});
+      }
+    }
+    stats_.migratedMols += species.num_mols();
+    species.clear();
+  }
+  SizeTVec received;
+  transfer(state, peers_, received);
+  active.insert(active.end(), received.begin(), received.end());
+  std::sort(active.begin(), active.end());
+  active.erase(std::unique(active.begin(), active.end()), active.end());
+  state.set_active_tets(std::move(active));
+  set_partition(std::move(part));
+  ++stats_.rebalances;
+  return true;
+}
+
+
+// collect_work returns the work measured for the tets of this subdomain
+// since the last call
+uint64_t Subdomain::collect_work() {
+  uint64_t load = 0;
+  for (size_t i = 0; i < work_.size(); ++i) {
+    if (owns(i)) {
+      load += work_[i];
+    }
+  }
+  std::fill(work_.begin(), work_.end(), 0);
+  stats_.work += load;
+  return load;
+}
+
+
+// transfer sends the batch queued in sendBufs_ to each subdomain in peers,
+// closed by an end of batch record even if it is empty, and receives the
+// batches of all of them. Received records are stored right away and the
+// tets they were stored for are appended to tetIDs.
+void Subdomain::transfer(State& state, const SizeTVec& peers,
+  SizeTVec& tetIDs) {
+  for (auto q : peers) {
+    batchDone_[q] = 0;
+  }
+  for (auto q : peers) {
+    auto& buf = sendBufs_[q];
+    buf.push_back(HaloRecord{endOfBatch, 0, 0, MolVec3(), MolVec3(), 0.0, 0});
+    send(state, shared_.halo_ring(id_, q), buf.data(), buf.size(), peers,
+      tetIDs);
+    buf.clear();
+  }
+  size_t spins = 0;
+  while (std::any_of(peers.begin(), peers.end(),
+           [this](size_t q) { return batchDone_[q] == 0; })) {
+    drain(state, peers, tetIDs);
+    backoff(spins);
+  }
+}
+
+
+// send pushes n records to ring. While the ring is full the incoming rings
+// are drained, since their senders may in turn be waiting for us.
+void Subdomain::send(State& state, HaloRing& ring, const HaloRecord* recs,
+  size_t n, const SizeTVec& peers, SizeTVec& tetIDs) {
+  size_t spins = 0;
+  while (n > 0) {
+    size_t pushed = ring.push(recs, n);
+    recs += pushed;
+    n -= pushed;
+    if (n > 0) {
+      drain(state, peers, tetIDs);
+      backoff(spins);
+    }
+  }
+}
+
+
+// drain receives whatever is available from all peers whose batch isn't
+// complete yet
+void Subdomain::drain(State& state, const SizeTVec& peers, SizeTVec& tetIDs) {
+  for (auto q : peers) {
+    if (batchDone_[q] == 0) {
+      receive(state, shared_.halo_ring(q, id_), tetIDs, batchDone_[q]);
+    }
+  }
+}
+
+
+// receive stores the records available in ring, in the outgoing queue of
+// their sending tet or, for migrated molecules, among the active molecules of
+// their tet. It sets done once the end of the batch is reached.
+void Subdomain::receive(State& state, HaloRing& ring, SizeTVec& tetIDs,
+  uint8_t& done) {
+  HaloRecord recs[recordChunk];
+  size_t n;
+  while (done == 0 && (n = ring.pop(recs, recordChunk)) > 0) {
+    for (size_t i = 0; i < n; ++i) {
+      const auto& r = recs[i];
+      if (r.tetID == endOfBatch) {
+        done = 1;
+        break;
+      }
+      auto& molState = state.tetMols(r.tetID);
+      auto& mols = r.face == migrated ? molState.activeMols[r.specID]
+                                      : molState.outMols[r.face][r.specID];
+      mols.add(r.pos, r.t, r.dispRem, r.flags);
+      if (tetIDs.empty() || tetIDs.back() != r.tetID) {
+        tetIDs.push_back(r.tetID);
+      }
+    }
+  }
+}
+
+
+// send_mols pushes all active molecules of the subdomain's tets to ring,
+// followed by an end of batch record
+static void send_mols(const State& state, HaloRing& ring) {
+  Rvector<HaloRecord> buf;
+  buf.reserve(recordChunk);
+  size_t spins = 0;
+  auto flush = [&]() {
+    const HaloRecord* recs = buf.data();
+    size_t n = buf.size();
+    while (n > 0) {
+      size_t pushed = ring.push(recs, n);
+      recs += pushed;
+      n -= pushed;
+      if (n > 0) {
+        backoff(spins);
+      }
+    }
+    buf.clear();
+  };
+
+  for (auto tetID : state.active_tets()) {
+    const auto& active = state.tetMols(tetID).activeMols;
+    for (uint32_t s = 0; s < active.size(); ++s) {
+      const auto& mols = active[s];
+      for (size_t i = 0; i < mols.size(); ++i) {
+        buf.push_back(HaloRecord{tetID, 0, s, mols.pos[i], mols.dispRem[i],
+          mols.t[i], mols.flags[i]});
+        if (buf.size() == recordChunk) {
+          flush();
+        }
+      }
+    }
+  }
+  buf.push_back(HaloRecord{endOfBatch, 0, 0, MolVec3(), MolVec3(), 0.0, 0});
+  flush();
+}
+
+
+// run_worker steps the molecules of subdomain id for all iterations and
+// sends them to the parent whenever it wants to collect them
+static void run_worker(State& state, const Partition& part, size_t id,
+  DomainShared& shared, uint64_t firstIter, uint64_t endIter,
+  const DomainConfig& config, const GatherFunc& gather) {
+  ThreadPool pool(config.threadsPerProc);
+  Subdomain domain(state.tets(), part, id, shared);
+
+  // molecules of other subdomains are dropped since their tets may come
+  // back to us later on when rebalancing
+  SizeTVec active;
+  for (auto tetID : state.active_tets()) {
+    if (domain.owns(tetID)) {
+      active.push_back(tetID);
+    } else {
+      state.tetMols(tetID).activeMols.clear();
+    }
+  }
+  state.set_active_tets(std::move(active));
+
+  auto& stats = domain.stats();
+  StepCounters counters;
+  for (uint64_t iter = firstIter; iter < endIter; ++iter) {
+    auto start = std::chrono::steady_clock::now();
+    step(state, pool, iter, &counters, &domain);
+    if (config.rebalanceRatio > 0.0 && (iter - firstIter + 1) %
+        std::max<size_t>(1, config.rebalanceEvery) == 0) {
+      domain.rebalance(state, config.rebalanceRatio);
+    }
+    stats.stepTime += std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start).count();
+    ++stats.steps;
+    if (gather(iter) || iter + 1 == endIter) {
+      send_mols(state, shared.gather_ring(id));
+    }
+  }
+  domain.collect_work();
+  stats.numTets = 0;
+  for (size_t i = 0; i < state.tets().size(); ++i) {
+    stats.numTets += domain.owns(i);
+  }
+  stats.molsMoved = counters.molsMoved;
+  shared.stats(id) = stats;
+}
+
+
+// Workers keeps track of the forked worker processes
+struct Workers {
+
+  // kill terminates all workers which haven't exited yet
+  void kill() {
+    for (size_t p = 0; p < pids.size(); ++p) {
+      if (!exited[p]) {
+        ::kill(pids[p], SIGKILL);
+        waitpid(pids[p], nullptr, 0);
+        exited[p] = 1;
+      }
+    }
+  }
+
+  // poll checks if worker p has exited and returns an error if it failed
+  Error poll(size_t p) {
+    int status = 0;
+    if (!exited[p] && waitpid(pids[p], &status, WNOHANG) == pids[p]) {
+      exited[p] = 1;
+      if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        return Error{"worker process " + std::to_string(p) + " failed"};
+      }
+    }
+    return noErr;
+  }
+
+  Rvector<pid_t> pids;
+  Rvector<uint8_t> exited;
+};
+
+
+// collect replaces the active molecules of state by those sent by all
+// workers. The molecules of each tet arrive in order from its owner, so
+// state ends up exactly as if it had been stepped by a single process.
+static Error collect(State& state, DomainShared& shared, Workers& workers) {
+  for (auto tetID : state.active_tets()) {
+    for (auto& mols : state.tetMols(tetID).activeMols) {
+      mols.clear();
+    }
+  }
+
+  size_t numProcs = shared.num_procs();
+  Rvector<uint8_t> done(numProcs, 0);
+  size_t numDone = 0;
+  SizeTVec touched;
+  HaloRecord recs[recordChunk];
+  size_t spins = 0;
+  while (numDone < numProcs) {
+    bool progress = false;
+    for (size_t p = 0; p < numProcs; ++p) {
+      size_t n;
+      while (!done[p] && (n = shared.gather_ring(p).pop(recs, recordChunk)) > 0) {
+        progress = true;
+        for (size_t i = 0; i < n; ++i) {
+          const auto& r = recs[i];
+          if (r.tetID == endOfBatch) {
+            done[p] = 1;
+            ++numDone;
+            break;
+          }
+          state.tetMols(r.tetID).activeMols[r.specID].add(r.pos, r.t,
+            r.dispRem, r.flags);
+          if (touched.empty() || touched.back() != r.tetID) {
+            touched.push_back(r.tetID);
+          }
+        }
+      }
+    }
+    if (progress) {
+      spins = 0;
+      continue;
+    }
+    backoff(spins);
+    for (size_t p = 0; p < numProcs; ++p) {
+      if (done[p]) {
+        continue;
+      }
+      Error e = workers.poll(p);
+      if (e.err) {
+        return e;
+      }
+      if (workers.exited[p] && shared.gather_ring(p).empty()) {
+        return Error{"worker process " + std::to_string(p) + " exited early"};
+      }
+    }
+  }
+  std::sort(touched.begin(), touched.end());
+  touched.erase(std::unique(touched.begin(), touched.end()), touched.end());
+  state.set_active_tets(std::move(touched));
+  return noErr;
+}
+
+
+// num_threads returns the number of threads of the calling process or 0 if
+// it can't be determined
+static size_t num_threads() {
+  DIR* dir = opendir("/proc/self/task");
+  if (dir == nullptr) {
+    return 0;
+  }
+  size_t n = 0;
+  while (struct dirent* entry = readdir(dir)) {
+    n += entry->d_name[0] != '.';
+  }
+  closedir(dir);
+  return n;
+}
+
+
+// run_domains runs iterations [firstIter, endIter) in one worker process per
+// subdomain of part
+std::tuple<Rvector<DomainStats>, Error> run_domains(State& state,
+  const Partition& part, uint64_t firstIter, uint64_t endIter,
+  const DomainConfig& config, const GatherFunc& gather, const VisitFunc& visit) {
+  Rvector<DomainStats> stats;
+  if (!state.reactions().empty()) {
+    return std::make_tuple(stats,
+      Error{"reactions are not supported with multiple processes"});
+  }
+  if (part.part.size() != state.tets().size() || part.numParts == 0) {
+    return std::make_tuple(stats, Error{"partition does not match the mesh"});
+  }
+  if (firstIter >= endIter) {
+    return std::make_tuple(stats, noErr);
+  }
+  if (num_threads() > 1) {
+    return std::make_tuple(stats, Error{"worker processes can't be forked "
+      "while other threads are running"});
+  }
+
+  // subdomains sharing a face exchange molecules every round
+  size_t numProcs = part.numParts;
+  Rvector<uint8_t> adjacent(numProcs * numProcs, 0);
+  const auto& tets = state.tets();
+  for (size_t i = 0; i < tets.size(); ++i) {
+    for (auto nbID : tets[i].t) {
+      if (nbID != geom::Tet::unset && part.part[nbID] != part.part[i]) {
+        adjacent[part.part[i] * numProcs + part.part[nbID]] = 1;
+      }
+    }
+  }
+
+  DomainShared shared;
+  Error e = shared.open(numProcs, tets.size(),
+    std::max<size_t>(2, config.ringCapacity), adjacent);
+  if (e.err) {
+    return std::make_tuple(stats, e);
+  }
+
+  // flush buffered output which would otherwise be duplicated by the workers
+  std::cout.flush();
+  std::cerr.flush();
+  Workers workers;
+  for (size_t p = 0; p < part.numParts; ++p) {
+    pid_t pid = fork();
+    if (pid < 0) {
+      workers.kill();
+      return std::make_tuple(stats,
+        Error{std::string("Failed to fork worker process: ") + strerror(errno)});
+    }
+    if (pid == 0) {
+      int status = 0;
+      try {
+        run_worker(state, part, p, shared, firstIter, endIter, config, gather);
+      } catch (const std::exception& ex) {
+        std::cerr << "worker process " << p << ": " << ex.what() << std::endl;
+        status = 1;
+      }
+      _exit(status);
+    }
+    workers.pids.push_back(pid);
+    workers.exited.push_back(0);
+  }
+
+  for (uint64_t iter = firstIter; iter < endIter; ++iter) {
+    if (gather(iter) || iter + 1 == endIter) {
+      e = collect(state, shared, workers);
+      if (e.err) {
+        workers.kill();
+        return std::make_tuple(stats, e);
+      }
+      visit(state, iter);
+    }
+  }
+
+  for (size_t p = 0; p < workers.pids.size(); ++p) {
+    int status = 0;
+    if (!workers.exited[p]) {
+      waitpid(workers.pids[p], &status, 0);
+      workers.exited[p] = 1;
+      if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        e = Error{"worker process " + std::to_string(p) + " failed"};
+      }
+    }
+  }
+  if (e.err) {
+    return std::make_tuple(stats, e);
+  }
+  for (size_t p = 0; p < part.numParts; ++p) {
+    stats.push_back(shared.stats(p));
+  }
+  return std::make_tuple(stats, noErr);
+}
@@ -0,0 +1,162 @@
+// Copyright 2015 Markus Dittrich
+// Licensed under BSD license, see LICENSE file for details
+
+#ifndef DOMAIN_HPP
+#define DOMAIN_HPP
+
+#include <cstdint>
+#include <functional>
+#include <tuple>
+
+#include "error.hpp"
+#include "molecules.hpp"
+#include "partition.hpp"
+#include "state.hpp"
+#include "util.hpp"
+
+
+// HaloRecord is the representation of a molecule in the shared memory ring
+// buffers between processes. A molecule crossing a cut face is described by
+// the tet whose outgoing queue it was in and the face it left through, an
+// active molecule of a tet changing owner by the tet and face set to
+// migrated. Records with tetID set to endOfBatch close a batch.
+struct HaloRecord {
+  uint64_t tetID;
+  uint32_t face;
+  uint32_t specID;
+  MolVec3 pos;
+  MolVec3 dispRem;
+  double t;
+  uint8_t flags;
+};
+
+const uint64_t endOfBatch = ~uint64_t(0);
+const uint32_t migrated = 4;
+
+
+// DomainStats describes the work done by one worker process of run_domains
+struct DomainStats {
+  uint64_t numTets = 0;       // tets owned by the process in the end
+  uint64_t steps = 0;         // iterations run
+  uint64_t molsMoved = 0;     // molecule displacements processed
+  uint64_t haloMols = 0;      // molecules sent across cut faces
+  uint64_t haloBytes = 0;     // bytes sent across cut faces
+  uint64_t work = 0;          // molecules moved plus intersection tests
+  uint64_t rebalances = 0;    // rebalancing rounds taken part in
+  uint64_t migratedMols = 0;  // molecules sent to new owners of their tet
+  double stepTime = 0.0;      // wall time spent in step
+};
+
+
+// DomainConfig sets up the worker processes of run_domains. If
+// rebalanceRatio is set, the workers compare their work every rebalanceEvery
+// steps and repartition the tets into blocks of consecutive tets (see
+// partition_blocks) once the busiest one exceeds rebalanceRatio times the
+// mean.
+struct DomainConfig {
+  size_t threadsPerProc = 1;
+  size_t ringCapacity = 1 << 14;  // records per ring between neighbors
+  double rebalanceRatio = 0.0;    // 0 disables rebalancing
+  size_t rebalanceEvery = 5;
+};
+
+
+class DomainShared;
+class HaloRing;
+
+// Subdomain is the part of the mesh owned by one worker process of
+// run_domains. step uses it to hand molecules crossing cut faces to the
+// processes owning their new tets and to decide collectively whether any
+// molecules are still in flight.
+class Subdomain {
+
+public:
+
+  Subdomain(const geom::Tets& tets, const Partition& part, size_t id,
+    DomainShared& shared);
+
+  // owns returns true if tet tetID belongs to this subdomain
+  bool owns(size_t tetID) const noexcept {
+    return part_.part[tetID] == id_;
+  }
+
+  // add_work adds w to the work measured for tet tetID. Each tet may only be
+  // updated by one thread at a time.
+  void add_work(size_t tetID, uint64_t w) noexcept {
+    work_[tetID] += w;
+  }
+
+  // in_flight returns true if any subdomain has a non-zero numSenders. All
+  // processes have to call it the same number of times.
+  bool in_flight(size_t numSenders);
+
+  // exchange sends the molecules queued by senders across cut faces to the
+  // owning processes and removes them from the outgoing queues. Molecules
+  // headed for this subdomain are put into the outgoing queues of their
+  // (not owned) sending tets, so collect_incoming_mols picks them up as
+  // usual. Returns the sorted list of these sending tets.
+  SizeTVec exchange(State& state, const SizeTVec& senders);
+
+  // collect_work returns the work measured for the tets of this subdomain
+  // since the last call, adds it to the statistics, and resets it
+  uint64_t collect_work();
+
+  // rebalance compares the work measured since the last call with that of
+  // all other subdomains. If the busiest one has more than ratio times the
+  // mean, all processes switch to blocks of consecutive tets of equal work and
+  // send the active molecules of tets changing owner to the new owners.
+  // Returns true if the partition changed. All processes have to call it
+  // after the same steps.
+  bool rebalance(State& state, double ratio);
+
+  DomainStats& stats() noexcept {
+    return stats_;
+  }
+
+private:
+
+  void set_partition(Partition part);
+  void transfer(State& state, const SizeTVec& peers, SizeTVec& tetIDs);
+  void receive(State& state, HaloRing& ring, SizeTVec& tetIDs,
+    uint8_t& done);
+  void drain(State& state, const SizeTVec& peers, SizeTVec& tetIDs);
+  void send(State& state, HaloRing& ring, const HaloRecord* recs, size_t n,
+    const SizeTVec& peers, SizeTVec& tetIDs);
+
+  const geom::Tets& tets_;
+  Partition part_;
+  size_t id_;
+  DomainShared& shared_;
+  SizeTVec nbs_;                   // neighboring subdomains
+  SizeTVec peers_;                 // all other subdomains
+  Rvector<Rvector<HaloRecord>> sendBufs_;
+  Rvector<uint8_t> batchDone_;
+  Rvector<uint64_t> work_;         // work per tet since the last rebalance
+  DomainStats stats_;
+};
+
+
+// GatherFunc decides for which iterations run_domains collects the molecules
+// of all subdomains and VisitFunc gets to look at them afterwards
+using GatherFunc = std::function<bool(uint64_t iter)>;
+using VisitFunc = std::function<void(const State& state, uint64_t iter)>;
+
+// run_domains runs iterations [firstIter, endIter) in one worker process per
+// subdomain of part, forked off the calling process. Each worker steps the
+// molecules of its own tets with config.threadsPerProc threads; molecules
+// crossing cut faces are batched and exchanged through shared memory ring
+// buffers during each hand-off round. Since all random numbers are drawn per
+// tet the results are identical to those of a single process, also if tets
+// move between processes when rebalancing (see DomainConfig). After every
+// iteration for which gather returns true, and after the last one, the
+// molecules are collected into state and handed to visit. Models with
+// reactions are not supported yet since partners may live in different
+// subdomains. The workers are forked off the calling thread, so no other
+// threads (e.g. of a ThreadPool) may be running when run_domains is called;
+// visit is only called once all workers were started and may start threads
+// again. Returns the per process statistics.
+std::tuple<Rvector<DomainStats>, Error> run_domains(State& state,
+  const Partition& part, uint64_t firstIter, uint64_t endIter,
+  const DomainConfig& config, const GatherFunc& gather, const VisitFunc& visit);
+
+#endif
@@ -1,8 +1,16 @@
 // Copyright 2015 Markus Dittrich
 // Licensed under BSD license, see LICENSE file for details
 
+#include <algorithm>
 #include <cassert>
+#include <cmath>
+#include <limits>
 #include <stdexcept>
+#include <tuple>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "geometry.hpp"
 
@@ -78,3 +86,475 @@ int geom::intersect(const Vec3& p0, const Vec3& disp, const MeshElement* m,
   }
   return 0;  // hitPoint is in m
 }
+
+
+// TetHitData constructor
+geom::TetHitData::TetHitData(const TetMeshes& meshes) {
+  for (size_t i = 0; i < meshes.size(); ++i) {
+    const MeshElement* m = meshes[i];
+    double uu = m->u * m->u;
+    double uv = m->u * m->v;
+    double vv = m->v * m->v;
+    double D = uv * uv - uu * vv;
+    Vec3 s = (1.0 / D) * (uv * m->v - vv * m->u);
+    Vec3 t = (1.0 / D) * (uv * m->u - uu * m->v);
+    nx[i] = m->n.x;
+    ny[i] = m->n.y;
+    nz[i] = m->n.z;
+    d[i] = m->n * m->a;
+    ax[i] = m->a.x;
+    ay[i] = m->a.y;
+    az[i] = m->a.z;
+    sx[i] = s.x;
+    sy[i] = s.y;
+    sz[i] = s.z;
+    tx[i] = t.x;
+    ty[i] = t.y;
+    tz[i] = t.z;
+  }
+}
+
+
+// create_hit_table computes the TetHitData of all tets
+geom::TetHitTable geom::create_hit_table(const Mesh& mesh, const Tets& tets) {
+  TetHitTable table;
+  table.reserve(tets.size());
+  for (const auto& tet : tets) {
+    table.emplace_back(TetMeshes{&mesh[tet.m[0]], &mesh[tet.m[1]],
+                                 &mesh[tet.m[2]], &mesh[tet.m[3]]});
+  }
+  return table;
+}
+
+
+#ifdef __SSE2__
+
+// intersect_tet tests the ray segment from p0 along disp against all four
+// faces of the tet described by hd. This version handles faces 0, 1 and 2, 3
+// in a pair of SSE2 registers without any branches; lanes without a valid hit
+// carry an infinite ray parameter and drop out of the final minimum.
+int geom::intersect_tet(const TetHitData& hd, const Vec3& p0, const Vec3& disp,
+  Vec3* hitPoint) {
+
+  const __m128d px = _mm_set1_pd(p0.x), py = _mm_set1_pd(p0.y),
+                pz = _mm_set1_pd(p0.z);
+  const __m128d dx = _mm_set1_pd(disp.x), dy = _mm_set1_pd(disp.y),
+                dz = _mm_set1_pd(disp.z);
+  const __m128d zero = _mm_setzero_pd();
+  const __m128d one = _mm_set1_pd(1.0);
+  const __m128d inf = _mm_set1_pd(std::numeric_limits<double>::infinity());
+  const __m128d absMask = _mm_castsi128_pd(_mm_set1_epi64x(0x7fffffffffffffffll));
+
+  __m128d rr[2];
+  for (int h = 0; h < 2; ++h) {
+    const int o = 2 * h;
+    __m128d nx = _mm_loadu_pd(hd.nx + o), ny = _mm_loadu_pd(hd.ny + o),
+            nz = _mm_loadu_pd(hd.nz + o);
+
+    // ray parameter of the plane intersection
+    __m128d b = _mm_add_pd(_mm_add_pd(_mm_mul_pd(nx, dx), _mm_mul_pd(ny, dy)),
+                           _mm_mul_pd(nz, dz));
+    __m128d a = _mm_sub_pd(_mm_loadu_pd(hd.d + o),
+                           _mm_add_pd(_mm_add_pd(_mm_mul_pd(nx, px),
+                                      _mm_mul_pd(ny, py)), _mm_mul_pd(nz, pz)));
+    __m128d r = _mm_div_pd(a, b);
+    __m128d valid = _mm_and_pd(
+      _mm_cmpge_pd(_mm_and_pd(b, absMask), _mm_set1_pd(EPSILON)),
+      _mm_and_pd(_mm_cmpge_pd(r, zero), _mm_cmple_pd(r, one)));
+
+    // parametric coordinates of the plane intersection
+    __m128d wx = _mm_sub_pd(_mm_add_pd(px, _mm_mul_pd(r, dx)), _mm_loadu_pd(hd.ax + o));
+    __m128d wy = _mm_sub_pd(_mm_add_pd(py, _mm_mul_pd(r, dy)), _mm_loadu_pd(hd.ay + o));
+    __m128d wz = _mm_sub_pd(_mm_add_pd(pz, _mm_mul_pd(r, dz)), _mm_loadu_pd(hd.az + o));
+    __m128d s = _mm_add_pd(_mm_add_pd(_mm_mul_pd(wx, _mm_loadu_pd(hd.sx + o)),
+                                      _mm_mul_pd(wy, _mm_loadu_pd(hd.sy + o))),
+                           _mm_mul_pd(wz, _mm_loadu_pd(hd.sz + o)));
+    __m128d t = _mm_add_pd(_mm_add_pd(_mm_mul_pd(wx, _mm_loadu_pd(hd.tx + o)),
+                                      _mm_mul_pd(wy, _mm_loadu_pd(hd.ty + o))),
+                           _mm_mul_pd(wz, _mm_loadu_pd(hd.tz + o)));
+    valid = _mm_and_pd(valid, _mm_and_pd(_mm_cmpge_pd(s, zero), _mm_cmple_pd(s, one)));
+    valid = _mm_and_pd(valid, _mm_and_pd(_mm_cmpge_pd(t, zero),
+                                         _mm_cmple_pd(_mm_add_pd(s, t), one)));
+    rr[h] = _mm_or_pd(_mm_and_pd(valid, r), _mm_andnot_pd(valid, inf));
+  }
+
+  // closest hit; ties go to the face with the lower index
+  __m128d m = _mm_min_pd(rr[0], rr[1]);
+  m = _mm_min_sd(m, _mm_unpackhi_pd(m, m));
+  m = _mm_unpacklo_pd(m, m);
+  int lanes = _mm_movemask_pd(_mm_cmpeq_pd(rr[0], m)) |
+              (_mm_movemask_pd(_mm_cmpeq_pd(rr[1], m)) << 2);
+  double rmin = _mm_cvtsd_f64(m);
+  *hitPoint = p0 + rmin * disp;
+  return rmin < std::numeric_limits<double>::infinity() ? __builtin_ctz(lanes) : -1;
+}
+
+#else
+
+// intersect_tet tests the ray segment from p0 along disp against all four
+// faces of the tet described by hd. Portable version of the SSE2 kernel above.
+int geom::intersect_tet(const TetHitData& hd, const Vec3& p0, const Vec3& disp,
+  Vec3* hitPoint) {
+
+  const double inf = std::numeric_limits<double>::infinity();
+  double rr[4];
+  for (int i = 0; i < 4; ++i) {
+    double b = hd.nx[i] * disp.x + hd.ny[i] * disp.y + hd.nz[i] * disp.z;
+    double a = hd.d[i] - (hd.nx[i] * p0.x + hd.ny[i] * p0.y + hd.nz[i] * p0.z);
+    double r = a / b;
+    double wx = (p0.x + r * disp.x) - hd.ax[i];
+    double wy = (p0.y + r * disp.y) - hd.ay[i];
+    double wz = (p0.z + r * disp.z) - hd.az[i];
+    double s = wx * hd.sx[i] + wy * hd.sy[i] + wz * hd.sz[i];
+    double t = wx * hd.tx[i] + wy * hd.ty[i] + wz * hd.tz[i];
+    bool valid = fabs(b) >= EPSILON && r >= 0.0 && r <= 1.0 && s >= 0.0 &&
+                 s <= 1.0 && t >= 0.0 && s + t <= 1.0;
+    rr[i] = valid ? r : inf;
+  }
+
+  int face = -1;
+  double rmin = inf;
+  for (int i = 0; i < 4; ++i) {
+    bool closer = rr[i] < rmin;
+    face = closer ? i : face;
+    rmin = closer ? rr[i] : rmin;
+  }
+  *hitPoint = p0 + rmin * disp;
+  return face;
+}
+
+#endif
+
+
+// tet_vertices returns the three vertices of the first face of a tet plus the
+// one vertex of its second face not shared with the first
+std::array<geom::Vec3, 4> geom::tet_vertices(const TetMeshes& meshes) {
+  const MeshElement* f0 = meshes[0];
+  const MeshElement* f1 = meshes[1];
+  Vec3 v3 = f1->a;
+  for (const auto& v : {f1->a, f1->b, f1->c}) {
+    if (!(v == f0->a) && !(v == f0->b) && !(v == f0->c)) {
+      v3 = v;
+      break;
+    }
+  }
+  return {{f0->a, f0->b, f0->c, v3}};
+}
+
+
+// tet_volume computes the volume of the tet described by meshes
+double geom::tet_volume(const TetMeshes& meshes) {
+  auto verts = tet_vertices(meshes);
+  Vec3 e1 = verts[1] - verts[0];
+  Vec3 e2 = verts[2] - verts[0];
+  Vec3 e3 = verts[3] - verts[0];
+  return std::fabs(e1 * cross(e2, e3)) / 6.0;
+}
+
+
+// TetBary constructor. The tet's vertices are taken in the order of
+// tet_vertices.
+geom::TetBary::TetBary(const TetMeshes& meshes) : v0{meshes[0]->a} {
+  auto verts = tet_vertices(meshes);
+
+  // the rows of the inverse of the matrix with columns e1, e2, e3 are the
+  // pairwise cross products of the columns divided by the determinant
+  Vec3 e1 = verts[1] - v0;
+  Vec3 e2 = verts[2] - v0;
+  Vec3 e3 = verts[3] - v0;
+  double det = e1 * cross(e2, e3);
+  if (det == 0.0) {
+    throw std::runtime_error("encountered degenerate Tet");
+  }
+  r1 = (1.0 / det) * cross(e2, e3);
+  r2 = (1.0 / det) * cross(e3, e1);
+  r3 = (1.0 / det) * cross(e1, e2);
+}
+
+
+// constructor deriving the face planes from the gradients of the barycentric
+// coordinates, each of which is a multiple of the inward normal of the face
+// on which the coordinate vanishes
+geom::TetPlanes::TetPlanes(const TetBary& tb) {
+  std::array<Vec3, 4> grads{{-1.0 * (tb.r1 + tb.r2 + tb.r3), tb.r1, tb.r2,
+                             tb.r3}};
+  for (size_t i = 0; i < grads.size(); ++i) {
+    double len = norm(grads[i]);
+    nx[i] = grads[i].x / len;
+    ny[i] = grads[i].y / len;
+    nz[i] = grads[i].z / len;
+    d[i] = ((i == 0 ? 1.0 : 0.0) - grads[i] * tb.v0) / len;
+  }
+}
+
+
+// create_plane_table computes the TetPlanes of all tets
+geom::TetPlaneTable geom::create_plane_table(const TetBaryTable& baryTable) {
+  TetPlaneTable table;
+  table.reserve(baryTable.size());
+  for (const auto& tb : baryTable) {
+    table.emplace_back(tb);
+  }
+  return table;
+}
+
+
+// mol_pos rounds p to a molecule position inside the tet with faces meshes.
+// The pull toward the centroid starts at the relative rounding error of
+// single precision and doubles until the rounded position is inside, ending
+// at the centroid itself.
+#ifdef MCELL_SINGLE_PRECISION
+MolVec3 geom::mol_pos(const TetMeshes& meshes, const TetBary& tb,
+  const Vec3& p) {
+  MolVec3 q(p);
+  if (inside_tet(tb, Vec3(q), 0.0)) {
+    return q;
+  }
+  auto v = tet_vertices(meshes);
+  Vec3 c = 0.25 * (v[0] + v[1] + v[2] + v[3]);
+  for (double f = std::numeric_limits<float>::epsilon(); f < 1.0; f *= 2.0) {
+    q = MolVec3(p + f * (c - p));
+    if (inside_tet(tb, Vec3(q), 0.0)) {
+      return q;
+    }
+  }
+  return MolVec3(c);
+}
+#endif
+
+
+// cross_pos moves the rounded position by one ulp per coordinate toward the
+// far side of the plane of m until it is more than EPSILON beyond it
+#ifdef MCELL_SINGLE_PRECISION
+MolVec3 geom::cross_pos(const MeshElement& m, const Vec3& disp, const Vec3& p) {
+  Vec3 n = (disp * m.n_norm > 0.0 ? 1.0 : -1.0) * m.n_norm;
+  const float inf = std::numeric_limits<float>::infinity();
+  MolVec3 q(p);
+  while ((Vec3(q) - m.a) * n <= EPSILON) {
+    if (n.x != 0.0) {
+      q.x = std::nextafter(q.x, n.x > 0.0 ? inf : -inf);
+    }
+    if (n.y != 0.0) {
+      q.y = std::nextafter(q.y, n.y > 0.0 ? inf : -inf);
+    }
+    if (n.z != 0.0) {
+      q.z = std::nextafter(q.z, n.z > 0.0 ? inf : -inf);
+    }
+  }
+  return q;
+}
+#endif
+
+
+// create_bary_table computes the TetBary of all tets
+geom::TetBaryTable geom::create_bary_table(const Mesh& mesh, const Tets& tets) {
+  TetBaryTable table;
+  table.reserve(tets.size());
+  for (const auto& tet : tets) {
+    table.emplace_back(TetMeshes{&mesh[tet.m[0]], &mesh[tet.m[1]],
+                                 &mesh[tet.m[2]], &mesh[tet.m[3]]});
+  }
+  return table;
+}
+
+
+// hilbert_key computes the index of the point with integer coordinates x along
+// a 3D Hilbert curve of order bits. This uses the transpose based algorithm
+// of J. Skilling, "Programming the Hilbert curve", AIP Conf. Proc. 707 (2004).
+static uint64_t hilbert_key(std::array<uint32_t, 3> x, int bits) {
+  uint32_t m = 1u << (bits - 1);
+
+  // inverse undo excess work
+  for (uint32_t q = m; q > 1; q >>= 1) {
+    uint32_t p = q - 1;
+    for (int i = 0; i < 3; ++i) {
+      if (x[i] & q) {
+        x[0] ^= p;
+      } else {
+        uint32_t t = (x[0] ^ x[i]) & p;
+        x[0] ^= t;
+        x[i] ^= t;
+      }
+    }
+  }
+
+  // gray encode
+  for (int i = 1; i < 3; ++i) {
+    x[i] ^= x[i - 1];
+  }
+  uint32_t t = 0;
+  for (uint32_t q = m; q > 1; q >>= 1) {
+    if (x[2] & q) {
+      t ^= q - 1;
+    }
+  }
+  for (int i = 0; i < 3; ++i) {
+    x[i] ^= t;
+  }
+
+  // interleave the transposed coordinates into the key
+  uint64_t key = 0;
+  for (int b = bits - 1; b >= 0; --b) {
+    for (int i = 0; i < 3; ++i) {
+      key = (key << 1) | ((x[i] >> b) & 1);
+    }
+  }
+  return key;
+}
+
+
+// reorder_tets renumbers tets along a 3D Hilbert curve through their
+// centroids and MeshElements in the order in which the reordered tets
+// reference them.
+SizeTVec geom::reorder_tets(Mesh& mesh, Tets& tets) {
+  const int bits = 21;
+
+  // tet centroids and their bounding box. Each vertex of a tet is part of
+  // three of its faces, so the centroid is the mean of all face vertices.
+  Rvector<Vec3> centroids;
+  centroids.reserve(tets.size());
+  Vec3 lo{std::numeric_limits<double>::max(), std::numeric_limits<double>::max(),
+          std::numeric_limits<double>::max()};
+  Vec3 hi = -1.0 * lo;
+  for (const auto& tet : tets) {
+    Vec3 c;
+    for (auto m : tet.m) {
+      c += mesh[m].a + mesh[m].b + mesh[m].c;
+    }
+    c = (1.0 / 12.0) * c;
+    lo = Vec3{std::min(lo.x, c.x), std::min(lo.y, c.y), std::min(lo.z, c.z)};
+    hi = Vec3{std::max(hi.x, c.x), std::max(hi.y, c.y), std::max(hi.z, c.z)};
+    centroids.push_back(c);
+  }
+
+  // sort tets by the Hilbert key of their quantized centroid
+  Vec3 ext = hi - lo;
+  double scale = ((1u << bits) - 1) / std::max({ext.x, ext.y, ext.z, EPSILON});
+  Rvector<std::pair<uint64_t, size_t>> keys;
+  keys.reserve(tets.size());
+  for (size_t i = 0; i < tets.size(); ++i) {
+    Vec3 q = scale * (centroids[i] - lo);
+    keys.emplace_back(hilbert_key({{uint32_t(q.x), uint32_t(q.y), uint32_t(q.z)}},
+                                  bits), i);
+  }
+  std::sort(keys.begin(), keys.end());
+
+  SizeTVec newToOld(tets.size());
+  SizeTVec oldToNew(tets.size());
+  for (size_t i = 0; i < keys.size(); ++i) {
+    newToOld[i] = keys[i].second;
+    oldToNew[keys[i].second] = i;
+  }
+
+  // renumber MeshElements in order of first reference
+  SizeTVec meshOldToNew(mesh.size(), size_t(Tet::unset));
+  Mesh newMesh;
+  newMesh.reserve(mesh.size());
+  for (auto oldID : newToOld) {
+    for (auto m : tets[oldID].m) {
+      if (meshOldToNew[m] == Tet::unset) {
+        meshOldToNew[m] = newMesh.size();
+        newMesh.push_back(mesh[m]);
+      }
+    }
+  }
+
+  // rebuild the tets with updated indices
+  Tets newTets;
+  newTets.reserve(tets.size());
+  for (size_t i = 0; i < newToOld.size(); ++i) {
+    Tet tet = tets[newToOld[i]];
+    tet.ID = i;
+    for (size_t f = 0; f < tet.m.size(); ++f) {
+      tet.m[f] = meshOldToNew[tet.m[f]];
+      if (tet.t[f] != Tet::unset) {
+        tet.t[f] = oldToNew[tet.t[f]];
+      }
+    }
+    newTets.push_back(tet);
+  }
+
+  mesh.swap(newMesh);
+  tets.swap(newTets);
+  return newToOld;
+}
+
+
+// boundary_faces returns the sorted IDs of all MeshElements on the outer
+// boundary of the model
+SizeTVec geom::boundary_faces(const Tets& tets) {
+  SizeTVec faces;
+  for (const auto& tet : tets) {
+    for (size_t i = 0; i < tet.t.size(); ++i) {
+      if (tet.t[i] == Tet::unset) {
+        faces.push_back(tet.m[i]);
+      }
+    }
+  }
+  std::sort(faces.begin(), faces.end());
+  faces.erase(std::unique(faces.begin(), faces.end()), faces.end());
+  return faces;
+}
+
+
+// split_faces returns the sorted IDs of all MeshElements between tets with
+// centroids on different sides of the plane at x. Each such face is found
+// from the tet on the lower side.
+SizeTVec geom::split_faces(const Mesh& mesh, const Tets& tets, double x) {
+  auto centroid_x = [&](const Tet& tet) {
+    double cx = 0.0;
+    for (auto m : tet.m) {
+      cx += mesh[m].a.x + mesh[m].b.x + mesh[m].c.x;
+    }
+    return cx / 12.0;
+  };
+
+  SizeTVec faces;
+  for (const auto& tet : tets) {
+    if (centroid_x(tet) >= x) {
+      continue;
+    }
+    for (size_t i = 0; i < tet.t.size(); ++i) {
+      if (tet.t[i] != Tet::unset && centroid_x(tets[tet.t[i]]) >= x) {
+        faces.push_back(tet.m[i]);
+      }
+    }
+  }
+  std::sort(faces.begin(), faces.end());
+  return faces;
+}
+
+
+// create_vertex_map sorts the corners of all tets by their coordinates and
+// numbers the distinct ones
+geom::TetVertexMap geom::create_vertex_map(const Mesh& mesh, const Tets& tets) {
+  struct Corner {
+    Vec3 p;
+    size_t slot;   // 4 * tetID + index of the vertex within the tet
+  };
+  Rvector<Corner> corners;
+  corners.reserve(4 * tets.size());
+  for (size_t tetID = 0; tetID < tets.size(); ++tetID) {
+    const auto& m = tets[tetID].m;
+    auto verts = tet_vertices({{&mesh[m[0]], &mesh[m[1]], &mesh[m[2]], &mesh[m[3]]}});
+    for (size_t k = 0; k < verts.size(); ++k) {
+      corners.push_back(Corner{verts[k], 4 * tetID + k});
+    }
+  }
+  std::sort(corners.begin(), corners.end(), [](const Corner& a, const Corner& b) {
+    return std::tie(a.p.x, a.p.y, a.p.z, a.slot) < std::tie(b.p.x, b.p.y, b.p.z, b.slot);
+  });
+
+  TetVertexMap vm;
+  vm.verts.resize(tets.size());
+  vm.vertTets.reserve(corners.size());
+  for (size_t i = 0; i < corners.size(); ++i) {
+    if (i == 0 || !(corners[i].p == corners[i - 1].p)) {
+      vm.vertStart.push_back(i);
+    }
+    vm.verts[corners[i].slot / 4][corners[i].slot % 4] = vm.vertStart.size() - 1;
+    vm.vertTets.push_back(corners[i].slot / 4);
+  }
+  vm.vertStart.push_back(corners.size());
+  return vm;
+}
@@ -4,7 +4,9 @@
 #ifndef GEOMETRY_HPP
 #define GEOMETRY_HPP
 
+#include <algorithm>
 #include <array>
+#include <cstdint>
 #include <memory>
 
 #include "molecules.hpp"
@@ -34,6 +36,11 @@ enum class MeshProp {
     , translucent
 };
 
+// prop_bit maps a MeshProp to a bit for building sets of MeshProps
+constexpr uint8_t prop_bit(MeshProp prop) {
+  return uint8_t(1) << static_cast<int>(prop);
+}
+
 
 // MeshElement describes a single triangle on a mesh. It consists of the
 // triangle vertices and also the triangles uv and normal vectors.
@@ -49,6 +56,7 @@ public:
   Vec3 n;         // normal vector
   Vec3 n_norm;    // normalized normal vector - precomputed for efficiency
   MeshProp prop;  // properties of this element
+  double passProb = 0.0;  // probability of passing a translucent element
 };
 
 using Mesh = Rvector<MeshElement>;
@@ -100,6 +108,159 @@ struct Tet {
 using Tets = Rvector<Tet>;
 using TetMeshes = std::array<const MeshElement*, 4>;
 
+// tet_vertices returns the four vertices of the tet with faces meshes. The
+// first three are the vertices a, b, c of its first face.
+std::array<Vec3, 4> tet_vertices(const TetMeshes& meshes);
+
+// tet_volume computes the volume of the tet with faces meshes
+double tet_volume(const TetMeshes& meshes);
+
+
+// TetHitData holds precomputed per face quantities for intersecting rays with
+// all four faces of a tet at once. The data of face i of the tet is stored in
+// lane i of each array so the faces can be processed in SIMD lanes. For each
+// face we store the plane normal n and offset d = n * a, the triangle vertex a,
+// and the vectors s and t with w * s and w * t being the parametric
+// coordinates of a point a + w in the triangle plane.
+struct alignas(16) TetHitData {
+
+  TetHitData(const TetMeshes& meshes);
+
+  double nx[4], ny[4], nz[4];  // face normals
+  double d[4];                 // plane offsets
+  double ax[4], ay[4], az[4];  // first triangle vertex
+  double sx[4], sy[4], sz[4];  // s parametric coordinate vectors
+  double tx[4], ty[4], tz[4];  // t parametric coordinate vectors
+};
+
+using TetHitTable = Rvector<TetHitData>;
+
+// create_hit_table computes the TetHitData of all tets
+TetHitTable create_hit_table(const Mesh& mesh, const Tets& tets);
+
+// intersect_tet tests the ray segment from p0 along disp against all four
+// faces of the tet described by hd. It returns the index of the closest face
+// hit by the segment, in which case hitPoint contains the location of the
+// intersection point, or -1 if no face is hit. Faces which are parallel to
+// the ray are never hit.
+int intersect_tet(const TetHitData& hd, const Vec3& p0, const Vec3& disp,
+  Vec3* hitPoint);
+
+// TetBary holds the inverse of the affine map taking the barycentric
+// coordinates l1, l2, l3 of a point to its location v0 + l1 * (v1 - v0) +
+// l2 * (v2 - v0) + l3 * (v3 - v0) within the tet with vertices v0 .. v3. The
+// remaining coordinate is l0 = 1 - l1 - l2 - l3. A point is inside the tet if
+// all four coordinates are positive.
+struct TetBary {
+
+  TetBary(const TetMeshes& meshes);
+
+  Vec3 v0;                   // reference vertex
+  Vec3 r1, r2, r3;           // rows of the inverse map
+};
+
+using TetBaryTable = Rvector<TetBary>;
+
+// create_bary_table computes the TetBary of all tets
+TetBaryTable create_bary_table(const Mesh& mesh, const Tets& tets);
+
+// inside_tet checks if p lies inside the tet described by tb with all of its
+// barycentric coordinates exceeding eps
+inline bool inside_tet(const TetBary& tb, const Vec3& p, double eps) noexcept {
+  Vec3 w = p - tb.v0;
+  double l1 = tb.r1 * w;
+  double l2 = tb.r2 * w;
+  double l3 = tb.r3 * w;
+  return (l1 > eps) & (l2 > eps) & (l3 > eps) & (1.0 - l1 - l2 - l3 > eps);
+}
+
+// TetPlanes holds the plane equations of the four faces of a tet with unit
+// normals pointing into the tet, so n * p + d is the distance of p from the
+// plane of a face. The data of face i is stored in lane i of each array.
+struct TetPlanes {
+
+  TetPlanes(const TetBary& tb);
+
+  double nx[4], ny[4], nz[4];  // inward unit normals
+  double d[4];                 // plane offsets
+};
+
+using TetPlaneTable = Rvector<TetPlanes>;
+
+// create_plane_table computes the TetPlanes of all tets from their
+// barycentric maps
+TetPlaneTable create_plane_table(const TetBaryTable& baryTable);
+
+// face_distance returns the distance of p, which has to lie inside the tet
+// described by tp, from the closest of its face planes
+inline double face_distance(const TetPlanes& tp, const Vec3& p) noexcept {
+  double dist = tp.nx[0] * p.x + tp.ny[0] * p.y + tp.nz[0] * p.z + tp.d[0];
+  for (size_t i = 1; i < 4; ++i) {
+    dist = std::min(dist, tp.nx[i] * p.x + tp.ny[i] * p.y + tp.nz[i] * p.z +
+                          tp.d[i]);
+  }
+  return dist;
+}
+
+// mol_pos rounds p, which has to lie inside the tet with faces meshes and
+// barycentric map tb, to a molecule position. Rounded positions that end up
+// outside the tet are pulled toward its centroid until they are inside again,
+// so molecules never lie on the wrong side of the faces of their tet. Double
+// precision positions are used as is.
+#ifdef MCELL_SINGLE_PRECISION
+MolVec3 mol_pos(const TetMeshes& meshes, const TetBary& tb, const Vec3& p);
+#else
+inline MolVec3 mol_pos(const TetMeshes&, const TetBary&, const Vec3& p) {
+  return p;
+}
+#endif
+
+// cross_pos rounds p, which has to lie just beyond face m as seen by a
+// molecule crossing it along disp, to a molecule position which is still
+// more than EPSILON beyond the plane of m. Otherwise rounding could put
+// molecules back on the plane, where the intersection tests of both tets see
+// them cross m at ray parameter 0. Since their remaining displacement doesn't
+// shrink in single precision they'd go back and forth between both tets for
+// good. Double precision positions are used as is.
+#ifdef MCELL_SINGLE_PRECISION
+MolVec3 cross_pos(const MeshElement& m, const Vec3& disp, const Vec3& p);
+#else
+inline MolVec3 cross_pos(const MeshElement&, const Vec3&, const Vec3& p) {
+  return p;
+}
+#endif
+
+
+// reorder_tets renumbers tets along a 3D Hilbert curve through their
+// centroids so that tets close in space are close in memory. MeshElements
+// are renumbered in the order in which the reordered tets reference them and
+// all tet and MeshElement indices within tets are updated accordingly. The
+// returned vector maps new tet IDs to the original ones.
+SizeTVec reorder_tets(Mesh& mesh, Tets& tets);
+
+// boundary_faces returns the sorted IDs of all MeshElements on the outer
+// boundary of the model, i.e. of faces without a neighboring tet
+SizeTVec boundary_faces(const Tets& tets);
+
+// split_faces returns the sorted IDs of all MeshElements shared by a tet with
+// its centroid below x and one with its centroid at or above x. Together they
+// form a surface separating the two halves of the model.
+SizeTVec split_faces(const Mesh& mesh, const Tets& tets, double x);
+
+// TetVertexMap identifies the vertices of all tets by their coordinates.
+// verts[tetID] lists the IDs of the four vertices of a tet, and the tets
+// sharing vertex v are vertTets[vertStart[v]] up to (but not including)
+// vertTets[vertStart[v + 1]] in increasing order.
+struct TetVertexMap {
+  Rvector<std::array<size_t, 4>> verts;
+  SizeTVec vertStart;
+  SizeTVec vertTets;
+};
+
+// create_vertex_map computes the TetVertexMap of tets
+TetVertexMap create_vertex_map(const Mesh& mesh, const Tets& tets);
+
+
 // tetFaces lists the indices of all triangles that make up the four
 // faces of a tet
 const Rvector<Rvector<size_t>> tetFaces{Rvector<size_t>{0, 2, 1}
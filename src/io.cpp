@@ -2,263 +2,836 @@
 // Licensed under BSD license, see LICENSE file for details
 
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
 #include <fstream>
 #include <iostream>
-#include <sstream>
-#include <unordered_map>
+#include <stdexcept>
 #include <vector>
 
-#include <boost/algorithm/string.hpp>
 #include <boost/format.hpp>
 
+#include <sys/stat.h>
+
 #include "io.hpp"
+#include "mapped_file.hpp"
 #include "molecules.hpp"
+#include "thread_pool.hpp"
 #include "util.hpp"
 
 
-// write_cellblender writes the molecule info at iter to a file name in
-// cellblender format located at path.
-Error write_cellblender(State& state, std::string path, std::string name,
-  int iter) {
+// cellblender_file_name returns the name of the cellblender file for
+// iteration iter
+std::string cellblender_file_name(const std::string& path,
+  const std::string& name, int iter) {
+  return boost::str(boost::format("%s/%s.cellbin.%04d.dat") % path.c_str() %
+    name.c_str() % iter);
+}
 
-  std::string fileName = boost::str(boost::format("%s/%s.cellbin.%04d.dat") %
-    path.c_str() % name.c_str() % iter);
-  std::ofstream out(fileName);
-  if (out.fail()) {
-    return Error{"Failed to open file " + fileName};
+
+// append_bytes appends the object representation of val to buf at offset
+// and returns the offset past it
+template <typename T>
+static size_t append_bytes(Rvector<char>& buf, size_t offset, const T& val) {
+  memcpy(buf.data() + offset, &val, sizeof(val));
+  return offset + sizeof(val);
+}
+
+
+// snapshot_cellblender serializes the positions of all molecules in state
+// into buf in cellblender format, tet by tet in the original tet order. The
+// capacity of buf is reused so repeated snapshots of similar size don't
+// allocate.
+void snapshot_cellblender(const State& state, Rvector<char>& buf) {
+  const auto& species = state.species();
+  size_t numTets = state.tets().size();
+
+  // count molecules per species to size the buffer
+  Rvector<size_t> numMols(species.size(), 0);
+  for (size_t tetID = 0; tetID < numTets; ++tetID) {
+    const auto& active = state.tetMols(tetID).activeMols;
+    for (size_t specID = 0; specID < active.size(); ++specID) {
+      numMols[specID] += active[specID].size();
+    }
+  }
+  size_t size = sizeof(uint32_t);
+  for (size_t specID = 0; specID < species.size(); ++specID) {
+    size += 2 + std::min<size_t>(species[specID].name().length(), 255) +
+      sizeof(uint32_t) + 3 * sizeof(float) * numMols[specID];
   }
+  buf.resize(size);
 
   // write version info
-  unsigned int version = 1;
-  out.write(reinterpret_cast<char*>(&version), sizeof(uint32_t));
-#if 0
+  size_t offset = append_bytes(buf, 0, uint32_t(1));
+
   // write molecule info
-  for (auto& spec : state.species()) {
-    unsigned char length = spec.name().length();
-    out.write(reinterpret_cast<char*>(&length), sizeof(length));
-    out.write(spec.name().c_str(), length*sizeof(char));
+  for (size_t specID = 0; specID < species.size(); ++specID) {
+    std::string specName = species[specID].name();
+    unsigned char length = std::min<size_t>(specName.length(), 255);
+    offset = append_bytes(buf, offset, length);
+    memcpy(buf.data() + offset, specName.data(), length);
+    offset += length;
 
     unsigned char type = 0;   // 0 indicates volume molecules
-    out.write(reinterpret_cast<char*>(&type), sizeof(type));
-
-    auto& mols = state.volMols()[spec.name()];
-    unsigned int numMols = 3 * mols.size();
-    out.write(reinterpret_cast<char*>(&numMols), sizeof(numMols));
-    for (const auto& m : mols) {
-      float mposx = m.pos().x;
-      out.write(reinterpret_cast<char*>(&mposx), sizeof(mposx));
-      float mposy = m.pos().y;
-      out.write(reinterpret_cast<char*>(&mposy), sizeof(mposy));
-      float mposz = m.pos().z;
-      out.write(reinterpret_cast<char*>(&mposz), sizeof(mposz));
+    offset = append_bytes(buf, offset, type);
+    offset = append_bytes(buf, offset, uint32_t(3 * numMols[specID]));
+
+    for (size_t origID = 0; origID < numTets; ++origID) {
+      const auto& active = state.tetMols(state.tet_id(origID)).activeMols;
+      if (specID >= active.size()) {
+        continue;
+      }
+      for (const auto& p : active[specID].pos) {
+        float xyz[3] = {float(p.x), float(p.y), float(p.z)};
+        offset = append_bytes(buf, offset, xyz);
+      }
     }
   }
+}
+
+
+// write_cellblender writes the molecule info at iter to a file name in
+// cellblender format located at path.
+Error write_cellblender(const State& state, std::string path, std::string name,
+  int iter) {
+
+  std::string fileName = cellblender_file_name(path, name, iter);
+  std::ofstream out(fileName, std::ios::binary);
+  if (out.fail()) {
+    return Error{"Failed to open file " + fileName};
+  }
+
+  Rvector<char> buf;
+  snapshot_cellblender(state, buf);
+  out.write(buf.data(), buf.size());
   out.close();
-#endif
+  if (out.fail()) {
+    return Error{"Failed to write file " + fileName};
+  }
   return noErr;
 }
 
 
-// mcsf_is_comment checks if a line in an mcsf file is a comment, i.e. starts
-// with a %
-static bool mcsf_is_comment(const std::string& line) {
-  if (!line.empty() && line[0] == '%') {
-    return true;
+// The MCSF parser below works directly on the memory mapped file. Lines are
+// described by [begin, end) pointer pairs and fields are converted in place
+// so parsing requires no allocations besides the output arrays.
+
+// mcsf_is_space checks for whitespace within a line
+static bool mcsf_is_space(char c) {
+  return c == ' ' || c == '\t' || c == '\r';
+}
+
+
+// mcsf_trim strips leading and trailing whitespace from the line [begin, end)
+static void mcsf_trim(const char*& begin, const char*& end) {
+  while (begin < end && mcsf_is_space(*begin)) {
+    ++begin;
+  }
+  while (end > begin && mcsf_is_space(*(end - 1))) {
+    --end;
+  }
+}
+
+
+// mcsf_line_equals checks if the trimmed line [begin, end) equals s
+static bool mcsf_line_equals(const char* begin, const char* end, const char* s) {
+  mcsf_trim(begin, end);
+  size_t len = strlen(s);
+  return size_t(end - begin) == len && std::equal(begin, end, s);
+}
+
+
+// mcsf_next_line returns the end of the line starting at begin and advances
+// next to the beginning of the following line
+static const char* mcsf_next_line(const char* begin, const char* end,
+  const char*& next) {
+  const char* nl = static_cast<const char*>(memchr(begin, '\n', end - begin));
+  if (nl == nullptr) {
+    next = end;
+    return end;
   }
-  return false;
+  next = nl + 1;
+  return nl;
 }
 
 
-// mcsf_file_check tests if the first line in the parsed file contains the
-// the expected mcsf_begin=1
-static bool mcsf_file_check(const std::string& line) {
-  if (boost::trim_copy(line) != "mcsf_begin=1;") {
+// mcsf_skip_field advances p past the next whitespace delimited field
+static bool mcsf_skip_field(const char*& p, const char* end) {
+  while (p < end && mcsf_is_space(*p)) {
+    ++p;
+  }
+  if (p == end) {
     return false;
   }
+  while (p < end && !mcsf_is_space(*p)) {
+    ++p;
+  }
   return true;
 }
 
 
-// mcsf_parse_verts extracts a single mesh vertex from a tokenized line
-// of mcsf input. The line format is
+// mcsf_parse_size parses the next field at p as a non-negative integer
+static bool mcsf_parse_size(const char*& p, const char* end, size_t& val) {
+  while (p < end && mcsf_is_space(*p)) {
+    ++p;
+  }
+  const char* start = p;
+  val = 0;
+  while (p < end && *p >= '0' && *p <= '9') {
+    val = 10 * val + (*p - '0');
+    ++p;
+  }
+  return p != start && (p == end || mcsf_is_space(*p) || *p == ';');
+}
+
+
+// mcsf_parse_double parses the next field at p as a floating point number.
+// The field is copied into a small stack buffer since strtod requires null
+// termination which the mapped file doesn't provide.
+static bool mcsf_parse_double(const char*& p, const char* end, double& val) {
+  while (p < end && mcsf_is_space(*p)) {
+    ++p;
+  }
+  const char* start = p;
+  while (p < end && !mcsf_is_space(*p)) {
+    ++p;
+  }
+  char buf[64];
+  size_t len = p - start;
+  if (len == 0 || len >= sizeof(buf)) {
+    return false;
+  }
+  std::copy(start, p, buf);
+  buf[len] = '\0';
+  char* last;
+  val = strtod(buf, &last);
+  return last == buf + len;
+}
+
+
+// mcsf_parse_vert extracts a single mesh vertex from a line of mcsf input.
+// The line format is
 // Node-ID  Chrt        X-Coordinate        Y-coordinate        Z-coordinate
-static void mcsf_parse_vert(const Rvector<std::string>& items,
-  Rvector<geom::Vec3>& verts) {
-  assert(items.size() == 5);
-  verts.emplace_back(geom::Vec3{std::stod(items[2])
-                               ,std::stod(items[3])
-                               ,std::stod(items[4])});
+static bool mcsf_parse_vert(const char* p, const char* end, geom::Vec3& vert) {
+  return mcsf_skip_field(p, end) && mcsf_skip_field(p, end) &&
+         mcsf_parse_double(p, end, vert.x) &&
+         mcsf_parse_double(p, end, vert.y) &&
+         mcsf_parse_double(p, end, vert.z) && !mcsf_skip_field(p, end);
 }
 
 
-// mcsf_parse_smplx extracts a single tetrahedron from a tokenized line
-// of mcsf input. The line format is
+// mcsf_parse_smplx extracts a single tetrahedron from a line of mcsf input.
+// The line format is
 // Simp-ID Grp    Mat          Face-Types                      Vertex-Numbers
-static void mcsf_parse_smplx(const Rvector<std::string>& items,
-  Rvector<Rvector<size_t>>& tetVerts) {
-  assert(items.size() == 11);
-  tetVerts.emplace_back(Rvector<size_t>{std::stoul(items[7])
-                                       ,std::stoul(items[8])
-                                       ,std::stoul(items[9])
-                                       ,std::stoul(items[10])});
+static bool mcsf_parse_smplx(const char* p, const char* end, TetVerts& tet) {
+  for (int i = 0; i < 7; ++i) {
+    if (!mcsf_skip_field(p, end)) {
+      return false;
+    }
+  }
+  return mcsf_parse_size(p, end, tet[0]) && mcsf_parse_size(p, end, tet[1]) &&
+         mcsf_parse_size(p, end, tet[2]) && mcsf_parse_size(p, end, tet[3]) &&
+         !mcsf_skip_field(p, end);
 }
 
 
-// mcsf_compute_mesh_key computes the unique key for a set of vertex indices
-// by sorting them.
-// NOTE: Since we sort the vector we take a copy instead of a ref
-static std::string compute_mesh_key(Rvector<size_t> verts) {
-  std::sort(verts.begin(), verts.end());
-  std::ostringstream sid;
-  for (const auto v : verts) {
-    sid << v << ":";
+// mcsf_parse_block parses the data lines in [begin, end) of a vert=[ or
+// simp=[ block via parseRow and appends the results to rows. The block is
+// split into chunks at line boundaries which are parsed in parallel and then
+// concatenated in order.
+template <typename Row, typename ParseRow>
+static bool mcsf_parse_block(const char* begin, const char* end,
+  ThreadPool& pool, Rvector<Row>& rows, ParseRow parseRow) {
+
+  const size_t minChunkSize = 1 << 20;
+  size_t numChunks = std::max<size_t>(1, std::min<size_t>(4 * pool.size(),
+    (end - begin) / minChunkSize));
+  Rvector<const char*> bounds{begin};
+  for (size_t c = 1; c < numChunks; ++c) {
+    const char* b = std::max(bounds.back(), begin + c * (end - begin) / numChunks);
+    const char* next;
+    mcsf_next_line(b, end, next);
+    bounds.push_back(next);
   }
-  return sid.str();
-}
+  bounds.push_back(end);
+
+  Rvector<Rvector<Row>> chunkRows(numChunks);
+  std::atomic<bool> ok{true};
+  pool.parallel_for(numChunks, 1, [&](size_t cb, size_t ce) {
+    for (size_t c = cb; c < ce; ++c) {
+      const char* line = bounds[c];
+      while (line < bounds[c + 1]) {
+        const char* next;
+        const char* lineEnd = mcsf_next_line(line, bounds[c + 1], next);
+        const char* lineBegin = line;
+        line = next;
+        mcsf_trim(lineBegin, lineEnd);
+        if (lineBegin == lineEnd || *lineBegin == '%') {
+          continue;
+        }
+        Row r;
+        if (!parseRow(lineBegin, lineEnd, r)) {
+          ok = false;
+          return;
+        }
+        chunkRows[c].push_back(r);
+      }
+    }
+  });
 
+  size_t n = rows.size();
+  for (const auto& cr : chunkRows) {
+    n += cr.size();
+  }
+  rows.reserve(n);
+  for (const auto& cr : chunkRows) {
+    rows.insert(rows.end(), cr.begin(), cr.end());
+  }
+  return ok;
+}
 
-// mark_tet_neighbors marks the two tetrahdra with ID tet1 and tet2 as being
-// neighbors across the triangle with meshID
-void mark_tet_neighbors(geom::Tets& tets, size_t tet1ID, size_t tet2ID, size_t meshID) {
-  assert(tet1ID < tets.size());
-  assert(tet2ID < tets.size());
 
-  geom::Tet& tet1 = tets[tet1ID];
-  for (size_t i=0; i < tet1.m.size(); ++i) {
-    if (tet1.m[i] == meshID) {
-      tet1.t[i] = tet2ID;
-      break;
-    }
-    assert(true);  // should never get here
+// mcsf_parse_count parses the count in header lines like "vertices = 8;"
+static bool mcsf_parse_count(const char* begin, const char* end, size_t& count) {
+  const char* eq = std::find(begin, end, '=');
+  if (eq == end) {
+    return false;
   }
+  ++eq;
+  return mcsf_parse_size(eq, end, count);
+}
+
+
+// mcsf_starts_with checks if the trimmed line [begin, end) starts with s
+static bool mcsf_starts_with(const char* begin, const char* end, const char* s) {
+  size_t len = strlen(s);
+  return size_t(end - begin) >= len && std::equal(s, s + len, begin);
+}
+
+
+// Faces are identified by slots, with slot 4 * tetID + faceID denoting face
+// faceID (as listed in geom::tetFaces) of tet tetID. Shared faces are found by
+// packing the sorted vertex indices of each face into an integer key and
+// sorting all slots by key, which puts the two slots of a shared face next
+// to each other.
+
+// FaceEntry pairs the key of a face with its slot
+template <typename Key>
+struct FaceEntry {
+  Key key;
+  size_t slot;
+};
+
+template <typename Key>
+bool operator<(const FaceEntry<Key>& a, const FaceEntry<Key>& b) {
+  return a.key < b.key || (a.key == b.key && a.slot < b.slot);
+}
 
-  geom::Tet& tet2 = tets[tet2ID];
-  for (size_t i=0; i < tet2.m.size(); ++i) {
-    if (tet2.m[i] == meshID) {
-      tet2.t[i] = tet1ID;
-      break;
+
+// pack_face_key64 packs three sorted vertex indices below 2^21 into 64 bits
+static uint64_t pack_face_key64(size_t a, size_t b, size_t c) {
+  return uint64_t(a) << 42 | uint64_t(b) << 21 | uint64_t(c);
+}
+
+// pack_face_key128 packs three sorted vertex indices below 2^32 into 128 bits
+static unsigned __int128 pack_face_key128(size_t a, size_t b, size_t c) {
+  return (unsigned __int128)(a) << 64 | uint64_t(b) << 32 | uint64_t(c);
+}
+
+
+// match_faces determines for every face slot the slot of the same face in
+// the neighboring tet, or geom::Tet::unset for faces on the model boundary.
+// Returns false if a face is shared by more than two tets.
+template <typename Key, typename PackKey>
+static bool match_faces(const Rvector<TetVerts>& tetVerts, ThreadPool& pool,
+  PackKey packKey, Rvector<size_t>& partner) {
+
+  size_t numSlots = 4 * tetVerts.size();
+  Rvector<FaceEntry<Key>> faces(numSlots);
+  pool.parallel_for(tetVerts.size(), 4096, [&](size_t begin, size_t end) {
+    for (size_t tetID = begin; tetID < end; ++tetID) {
+      const auto& v = tetVerts[tetID];
+      for (size_t f = 0; f < 4; ++f) {
+        std::array<size_t, 3> tri{{v[geom::tetFaces[f][0]], v[geom::tetFaces[f][1]],
+                                   v[geom::tetFaces[f][2]]}};
+        std::sort(tri.begin(), tri.end());
+        faces[4 * tetID + f] = FaceEntry<Key>{packKey(tri[0], tri[1], tri[2]),
+                                              4 * tetID + f};
+      }
     }
-    assert(true);  // should never get here
-  }
+  });
+  parallel_sort(faces, pool);
+
+  partner.assign(numSlots, size_t(geom::Tet::unset));
+  std::atomic<bool> ok{true};
+  pool.parallel_for(numSlots, 1 << 16, [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i) {
+      bool prevSame = i > 0 && faces[i - 1].key == faces[i].key;
+      bool nextSame = i + 1 < numSlots && faces[i + 1].key == faces[i].key;
+      if (prevSame && nextSame) {
+        ok = false;
+      } else if (prevSame) {
+        partner[faces[i].slot] = faces[i - 1].slot;
+      } else if (nextSame) {
+        partner[faces[i].slot] = faces[i + 1].slot;
+      }
+    }
+  });
+  return ok;
 }
 
+
 // create_tets creates the final MeshElements and Tets based on the list
 // of vertices and tetrahedral connectivities.
 // The proper mesh orientation for each of a tetrahedron's 4 consititutive
 // triangles is determined according to tetgen's vertex numbering shown in
 // http://wias-berlin.de/software/tetgen/fformats.ele.html
-static std::tuple<geom::Mesh, geom::Tets> create_tets(const Rvector<geom::Vec3>& verts,
-  const Rvector<SizeTVec>& tetVerts) {
+// Each shared triangle is created by the tet listed first, which sees it
+// with normal out, and MeshElements are numbered in the order of their
+// creating slots.
+std::tuple<geom::Mesh, geom::Tets, Error> create_tets(
+  const Rvector<geom::Vec3>& verts, const Rvector<TetVerts>& tetVerts,
+  ThreadPool& pool) {
+
+  auto fail = [](const std::string& msg) {
+    return make_tuple(geom::Mesh{}, geom::Tets{}, Error{msg});
+  };
+
+  // pair up shared faces
+  Rvector<size_t> partner;
+  bool ok = verts.size() < (size_t(1) << 21)
+    ? match_faces<uint64_t>(tetVerts, pool, pack_face_key64, partner)
+    : match_faces<unsigned __int128>(tetVerts, pool, pack_face_key128, partner);
+  if (!ok) {
+    return fail("encountered triangle shared by more than two tets");
+  }
 
-  std::unordered_map<std::string, size_t> triangleMap; // map triangle keys to their index
-  std::unordered_map<size_t, SizeTVec> tetMap;  // map a triangle index to parent tets
+  // number the creating slots in order via a chunked prefix sum
+  size_t numTets = tetVerts.size();
+  const size_t grain = 1 << 14;
+  size_t numChunks = (numTets + grain - 1) / grain;
+  auto creates = [&partner](size_t slot) {
+    return partner[slot] == geom::Tet::unset || partner[slot] > slot;
+  };
+  Rvector<size_t> chunkStart(numChunks + 1, 0);
+  pool.parallel_for(numChunks, 1, [&](size_t begin, size_t end) {
+    for (size_t c = begin; c < end; ++c) {
+      size_t n = 0;
+      for (size_t slot = 4 * c * grain; slot < 4 * std::min(numTets, (c + 1) * grain); ++slot) {
+        n += creates(slot);
+      }
+      chunkStart[c + 1] = n;
+    }
+  });
+  for (size_t c = 0; c < numChunks; ++c) {
+    chunkStart[c + 1] += chunkStart[c];
+  }
 
-  // for each tet, extract the consititutive triangles, and either create new
-  // MeshElements for them or retrieve the index of existing ones. Tets are then
-  // assigned the proper indices and orientations of the triangles.
-  size_t meshID = 0;
-  size_t tetID = 0;
-  geom::Mesh mesh;
+  // create the MeshElements of each chunk and connect the tets
   geom::Tets tets;
-  for (const auto& v : tetVerts) {
-    geom::Tet tet(tetID);
-    size_t faceID = 0;
-    for (const auto& f : geom::tetFaces) {
-      Rvector<size_t> triangle{v[f[0]], v[f[1]], v[f[2]]};
-      std::string key = compute_mesh_key(triangle);
-      if (triangleMap.find(key) == triangleMap.end()) {
-        triangleMap[key] = meshID;
-        tetMap[meshID].push_back(tetID);
-        mesh.emplace_back(geom::MeshElement{verts[triangle[0]]
-                                           ,verts[triangle[1]]
-                                           ,verts[triangle[2]]});
-        tet.m[faceID] = meshID;
-        tet.o[faceID] = 1;
-        meshID++;
-      } else {
-        size_t id = triangleMap[key];
-        tet.m[faceID] = id;
-        tet.o[faceID] = -1;
-        tetMap[id].push_back(tetID);
+  tets.reserve(numTets);
+  for (size_t tetID = 0; tetID < numTets; ++tetID) {
+    tets.emplace_back(tetID);
+  }
+  Rvector<size_t> meshIDs(4 * numTets);
+  Rvector<geom::Mesh> chunkMeshes(numChunks);
+  std::atomic<bool> degenerate{false};
+  pool.parallel_for(numChunks, 1, [&](size_t begin, size_t end) {
+    for (size_t c = begin; c < end; ++c) {
+      size_t meshID = chunkStart[c];
+      chunkMeshes[c].reserve(chunkStart[c + 1] - chunkStart[c]);
+      for (size_t tetID = c * grain; tetID < std::min(numTets, (c + 1) * grain); ++tetID) {
+        const auto& v = tetVerts[tetID];
+        for (size_t f = 0; f < 4; ++f) {
+          size_t slot = 4 * tetID + f;
+          if (!creates(slot)) {
+            continue;
+          }
+          meshIDs[slot] = meshID++;
+          const auto& tf = geom::tetFaces[f];
+          try {
+            chunkMeshes[c].emplace_back(geom::MeshElement{verts[v[tf[0]]],
+              verts[v[tf[1]]], verts[v[tf[2]]]});
+          } catch (std::runtime_error& e) {
+            degenerate = true;
+            return;
+          }
+        }
       }
-      faceID++;
     }
-    tetID++;
-    tets.emplace_back(tet);
+  });
+  if (degenerate) {
+    return fail("encountered degenerate MeshElement");
   }
 
-  // connect shared tets across shared faces
-  for (const auto& m : tetMap) {
-    assert(m.second.size() == 2 || m.second.size() == 1);
-    if (m.second.size() == 2) {
-      mark_tet_neighbors(tets, m.second[0], m.second[1], m.first);
+  pool.parallel_for(numTets, 4096, [&](size_t begin, size_t end) {
+    for (size_t tetID = begin; tetID < end; ++tetID) {
+      geom::Tet& tet = tets[tetID];
+      for (size_t f = 0; f < 4; ++f) {
+        size_t slot = 4 * tetID + f;
+        size_t p = partner[slot];
+        if (creates(slot)) {
+          tet.m[f] = meshIDs[slot];
+          tet.o[f] = 1;
+        } else {
+          tet.m[f] = meshIDs[p];
+          tet.o[f] = -1;
+        }
+        if (p != geom::Tet::unset) {
+          tet.t[f] = p / 4;
+        }
+      }
     }
+  });
+
+  geom::Mesh mesh;
+  mesh.reserve(chunkStart[numChunks]);
+  for (const auto& cm : chunkMeshes) {
+    mesh.insert(mesh.end(), cm.begin(), cm.end());
   }
-  return make_tuple(mesh, tets);
+  return make_tuple(mesh, tets, noErr);
 }
 
 
 // parse_mcsf_tet_mesh parses an MCSF file containing a tet mesh and creates
 // and returns an internal representation of the mesh.
-std::tuple<geom::Mesh, geom::Tets, Error> parse_mcsf_tet_mesh(const std::string& fileName) {
-
-  std::ifstream file(fileName);
-  if (!file.is_open()) {
-    return make_tuple(geom::Mesh{}, geom::Tets{},
-      Error{"failed to open file " + fileName});
+// The file is memory mapped and scanned line by line for the header and the
+// extent of the vert=[ and simp=[ blocks. The blocks themselves, which make up
+// the bulk of the file, are parsed in parallel using all threads of pool.
+std::tuple<geom::Mesh, geom::Tets, Error> parse_mcsf_tet_mesh(
+  const std::string& fileName, ThreadPool& pool) {
+
+  auto fail = [](const std::string& msg) {
+    return make_tuple(geom::Mesh{}, geom::Tets{}, Error{msg});
+  };
+
+  MappedFile file;
+  Error e = file.open(fileName);
+  if (e.err) {
+    return fail("failed to open file " + fileName);
   }
 
-  std::string line;
-  if (!getline(file, line) || !mcsf_file_check(line)) {
-    return make_tuple(geom::Mesh{}, geom::Tets{},
-      Error{fileName + "is not an mcsf mesh file"});
+  const char* p = file.data();
+  const char* end = p + file.size();
+  const char* next;
+  const char* lineEnd = mcsf_next_line(p, end, next);
+  if (p == end || !mcsf_line_equals(p, lineEnd, "mcsf_begin=1;")) {
+    return fail(fileName + "is not an mcsf mesh file");
   }
+  p = next;
 
-  bool inVerts = false;
-  bool inSmplx = false;
   size_t numVerts = 0;
   size_t numSimplx = 0;
   Rvector<geom::Vec3> verts;
-  Rvector<SizeTVec> tetVerts;
-  // need a try block since string to integer/double conversion might throw
-  try {
-    while(getline(file, line)) {
-      boost::trim(line);
-      if (line.length() == 0 || mcsf_is_comment(line)) {
-        continue;
+  Rvector<TetVerts> tetVerts;
+  while (p < end) {
+    const char* lineBegin = p;
+    lineEnd = mcsf_next_line(p, end, next);
+    p = next;
+    mcsf_trim(lineBegin, lineEnd);
+    if (lineBegin == lineEnd || *lineBegin == '%') {
+      continue;
+    }
+
+    bool isVerts = mcsf_line_equals(lineBegin, lineEnd, "vert=[");
+    bool isSmplx = mcsf_line_equals(lineBegin, lineEnd, "simp=[");
+    if (isVerts || isSmplx) {
+      // data lines never contain a ']' so the block ends at the first one
+      const char* blockEnd = static_cast<const char*>(memchr(p, ']', end - p));
+      if (blockEnd == nullptr) {
+        return fail("could not parse mcsf file");
       }
-      Rvector<std::string> items;
-      boost::split(items, line, boost::is_any_of("\t "), boost::token_compress_on);
-      if (items[0] == "vertices") {
-        assert(items.size() == 3);
-        numVerts = std::stoll(items[2]);
-      } else if (items[0] == "simplices") {
-        assert(items.size() == 3);
-        numSimplx = std::stoll(items[2]);
-      } else if (items[0] == "vert=[") {
-        assert(inSmplx == false);
-        inVerts = true;
-      } else if (items[0] == "simp=[") {
-        assert(inVerts == false);
-        inSmplx = true;
-      } else if (items[0] == "];" && inSmplx) {
-        inSmplx = false;
-      } else if (items[0] == "];" && inVerts) {
-        inVerts = false;
-      } else if (inVerts) {
-        mcsf_parse_vert(items, verts);
-      } else if (inSmplx) {
-        mcsf_parse_smplx(items, tetVerts);
+      bool ok = isVerts ? mcsf_parse_block(p, blockEnd, pool, verts, mcsf_parse_vert)
+                        : mcsf_parse_block(p, blockEnd, pool, tetVerts, mcsf_parse_smplx);
+      if (!ok) {
+        return fail("could not parse mcsf file");
+      }
+      mcsf_next_line(blockEnd, end, p);
+    } else if (mcsf_starts_with(lineBegin, lineEnd, "vertices")) {
+      if (!mcsf_parse_count(lineBegin, lineEnd, numVerts)) {
+        return fail("could not parse mcsf file");
+      }
+    } else if (mcsf_starts_with(lineBegin, lineEnd, "simplices")) {
+      if (!mcsf_parse_count(lineBegin, lineEnd, numSimplx)) {
+        return fail("could not parse mcsf file");
       }
     }
-  } catch (std::invalid_argument& e) {
-    return make_tuple(geom::Mesh{}, geom::Tets{}, Error{"could not parse mcsf file"});
   }
-  assert(verts.size() == numVerts);
-  assert(tetVerts.size() == numSimplx);
+  if (verts.size() != numVerts || tetVerts.size() != numSimplx) {
+    return fail("could not parse mcsf file");
+  }
+  for (const auto& tv : tetVerts) {
+    for (auto v : tv) {
+      if (v >= verts.size()) {
+        return fail("could not parse mcsf file");
+      }
+    }
+  }
+
+  return create_tets(verts, tetVerts, pool);
+}
+
+
+// write_mcsf_tet_mesh writes the tet mesh with vertices verts and tets
+// tetVerts to the MCSF file fileName. All tets are placed in group and
+// material 0 and all faces are of type 0.
+Error write_mcsf_tet_mesh(const std::string& fileName,
+  const Rvector<geom::Vec3>& verts, const Rvector<TetVerts>& tetVerts) {
+  std::ofstream out(fileName);
+  if (out.fail()) {
+    return Error{"Failed to open file " + fileName};
+  }
+
+  out << "mcsf_begin=1;\n\n"
+      << "      dim = 3;\n"
+      << "    dimii = 3;\n"
+      << " vertices = " << verts.size() << ";\n"
+      << "simplices = " << tetVerts.size() << ";\n";
+
+  char line[128];
+  out << "vert=[\n";
+  for (size_t i = 0; i < verts.size(); ++i) {
+    const auto& v = verts[i];
+    snprintf(line, sizeof(line), "%10zu    0 %21.10e %20.10e %20.10e\n", i, v.x,
+      v.y, v.z);
+    out << line;
+  }
+  out << "];\n";
+  out << "simp=[\n";
+  for (size_t i = 0; i < tetVerts.size(); ++i) {
+    const auto& tv = tetVerts[i];
+    snprintf(line, sizeof(line),
+      "%10zu  0      0      0     0     0     0 %11zu %10zu %10zu %10zu\n",
+      i, tv[0], tv[1], tv[2], tv[3]);
+    out << line;
+  }
+  out << "];\n"
+      << "mcsf_end=1;\n";
+
+  out.close();
+  if (out.fail()) {
+    return Error{"Failed to write file " + fileName};
+  }
+  return noErr;
+}
+
 
+// MeshCacheHeader is located at the beginning of each binary mesh cache
+// file. It is followed by the array of MeshElements and the array of Tets at
+// the given offsets. Both arrays are stored in their in memory layout; the
+// recorded element sizes and byte order tag guard against reading a cache
+// written by an incompatible build.
+struct MeshCacheHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t byteOrder;
+  uint32_t meshElementSize;
+  uint32_t tetSize;
+  uint64_t srcSize;       // size of the MCSF source file
+  int64_t srcMTime;       // modification time of the MCSF source file
+  int64_t writeTime;      // time at which the cache was written
+  uint64_t srcChecksum;   // checksum of the MCSF source file
+  uint64_t numMeshElements;
+  uint64_t numTets;
+  uint64_t meshOffset;
+  uint64_t tetOffset;
+};
+
+const char meshCacheMagic[8] = {'M', 'C', 'N', 'G', 'M', 'S', 'H', '\0'};
+const uint32_t meshCacheVersion = 2;
+const uint32_t byteOrderTag = 0x01020304;
+const uint64_t meshCacheAlign = 64;
+
+// modification times are only trusted if the cache was written at least
+// this many seconds after the source was last modified, since a change
+// within the granularity of the file system clock leaves them unchanged
+const int64_t mtimeSlack = 2;
+
+
+// checksum computes a 64 bit hash of data. Eight bytes at a time go through
+// the block mixing step of MurmurHash3, which hashes about 4 GB/s, i.e. a
+// few tenths of a second for a mesh of several hundred MB.
+static uint64_t checksum(const char* data, size_t size) {
+  auto rotl = [](uint64_t x, int r) { return (x << r) | (x >> (64 - r)); };
+  uint64_t h = size;
+  size_t i = 0;
+  for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+    uint64_t w;
+    memcpy(&w, data + i, sizeof(w));
+    w = rotl(w * 0x87c37b91114253d5ull, 31) * 0x4cf5ad432745937full;
+    h = rotl(h ^ w, 27) * 5 + 0x52dce729;
+  }
+  for (; i < size; ++i) {
+    h = (h ^ static_cast<unsigned char>(data[i])) * 0x100000001b3ull;
+  }
+  return h;
+}
+
+
+// source_info determines size and modification time of the MCSF file srcFile
+static std::tuple<uint64_t, int64_t, Error> source_info(
+  const std::string& srcFile) {
+  struct stat st;
+  if (stat(srcFile.c_str(), &st) != 0) {
+    return std::make_tuple(0, 0, Error{"failed to stat file " + srcFile});
+  }
+  return std::make_tuple(st.st_size, st.st_mtime, noErr);
+}
+
+
+// source_checksum computes the checksum of the MCSF file srcFile
+static std::tuple<uint64_t, Error> source_checksum(const std::string& srcFile) {
+  MappedFile src;
+  Error e = src.open(srcFile);
+  if (e.err) {
+    return std::make_tuple(0, e);
+  }
+  return std::make_tuple(checksum(src.data(), src.size()), noErr);
+}
+
+
+// align_up rounds offset up to the next multiple of meshCacheAlign
+static uint64_t align_up(uint64_t offset) {
+  return (offset + meshCacheAlign - 1) / meshCacheAlign * meshCacheAlign;
+}
+
+
+// write_mesh_cache writes mesh and tets, which were created from the MCSF
+// file srcFile, to the binary mesh cache cacheFile.
+Error write_mesh_cache(const std::string& cacheFile, const std::string& srcFile,
+  const geom::Mesh& mesh, const geom::Tets& tets) {
+
+  MeshCacheHeader h{};
+  std::copy(std::begin(meshCacheMagic), std::end(meshCacheMagic), h.magic);
+  h.version = meshCacheVersion;
+  h.byteOrder = byteOrderTag;
+  h.meshElementSize = sizeof(geom::MeshElement);
+  h.tetSize = sizeof(geom::Tet);
+  h.writeTime = time(nullptr);
+  Error e;
+  std::tie(h.srcSize, h.srcMTime, e) = source_info(srcFile);
+  if (!e.err) {
+    std::tie(h.srcChecksum, e) = source_checksum(srcFile);
+  }
+  if (e.err) {
+    return e;
+  }
+  h.numMeshElements = mesh.size();
+  h.numTets = tets.size();
+  h.meshOffset = align_up(sizeof(h));
+  h.tetOffset = align_up(h.meshOffset + mesh.size() * sizeof(geom::MeshElement));
+
+  std::ofstream out(cacheFile, std::ios::binary);
+  if (out.fail()) {
+    return Error{"failed to open file " + cacheFile};
+  }
+  const char pad[meshCacheAlign] = {};
+  out.write(reinterpret_cast<const char*>(&h), sizeof(h));
+  out.write(pad, h.meshOffset - sizeof(h));
+  out.write(reinterpret_cast<const char*>(mesh.data()),
+    mesh.size() * sizeof(geom::MeshElement));
+  out.write(pad, h.tetOffset - h.meshOffset - mesh.size() * sizeof(geom::MeshElement));
+  out.write(reinterpret_cast<const char*>(tets.data()),
+    tets.size() * sizeof(geom::Tet));
+  out.close();
+  if (out.fail()) {
+    return Error{"failed to write file " + cacheFile};
+  }
+  return noErr;
+}
+
+
+// read_mesh_cache loads mesh and tets from the binary mesh cache cacheFile.
+// The cache is current if size and modification time of srcFile match the
+// recorded ones and the latter lies far enough before the cache was written
+// to rule out changes the clock didn't register. Otherwise srcFile is read
+// in full and its checksum has to match. A missing srcFile leaves nothing to
+// compare against, so the cache is used as is. The indices stored in the
+// tets are checked once after mapping so a damaged cache can't lead to out
+// of bounds accesses later on.
+std::tuple<geom::Mesh, geom::Tets, Error> read_mesh_cache(
+  const std::string& cacheFile, const std::string& srcFile) {
+
+  auto fail = [](const std::string& msg) {
+    return std::make_tuple(geom::Mesh{}, geom::Tets{}, Error{msg});
+  };
+
+  MappedFile cache;
+  Error e = cache.open(cacheFile);
+  if (e.err) {
+    return fail(e.desc);
+  }
+  MeshCacheHeader h;
+  if (cache.size() < sizeof(h)) {
+    return fail(cacheFile + " is not a mesh cache file");
+  }
+  std::copy(cache.data(), cache.data() + sizeof(h), reinterpret_cast<char*>(&h));
+  if (!std::equal(std::begin(meshCacheMagic), std::end(meshCacheMagic), h.magic)) {
+    return fail(cacheFile + " is not a mesh cache file");
+  }
+  if (h.version != meshCacheVersion || h.byteOrder != byteOrderTag ||
+      h.meshElementSize != sizeof(geom::MeshElement) ||
+      h.tetSize != sizeof(geom::Tet)) {
+    return fail(cacheFile + " was written by an incompatible version");
+  }
+  if (h.meshOffset + h.numMeshElements * sizeof(geom::MeshElement) > cache.size() ||
+      h.tetOffset + h.numTets * sizeof(geom::Tet) > cache.size()) {
+    return fail(cacheFile + " is truncated");
+  }
+
+  uint64_t srcSize;
+  int64_t srcMTime;
+  std::tie(srcSize, srcMTime, e) = source_info(srcFile);
+  if (!e.err) {
+    if (srcSize != h.srcSize) {
+      return fail(cacheFile + " is stale");
+    }
+    if (srcMTime != h.srcMTime || h.writeTime - h.srcMTime < mtimeSlack) {
+      uint64_t srcSum;
+      std::tie(srcSum, e) = source_checksum(srcFile);
+      if (e.err) {
+        return fail(e.desc);
+      }
+      if (srcSum != h.srcChecksum) {
+        return fail(cacheFile + " is stale");
+      }
+    }
+  }
+
+  auto meshBegin = reinterpret_cast<const geom::MeshElement*>(cache.data() + h.meshOffset);
+  auto tetBegin = reinterpret_cast<const geom::Tet*>(cache.data() + h.tetOffset);
+  for (uint64_t i = 0; i < h.numTets; ++i) {
+    const auto& tet = tetBegin[i];
+    bool valid = tet.ID == i;
+    for (size_t j = 0; j < tet.m.size(); ++j) {
+      valid &= tet.m[j] < h.numMeshElements;
+      valid &= tet.t[j] == geom::Tet::unset || tet.t[j] < h.numTets;
+    }
+    if (!valid) {
+      return fail(cacheFile + " has invalid tet " + std::to_string(i));
+    }
+  }
+  geom::Mesh mesh(meshBegin, meshBegin + h.numMeshElements);
+  geom::Tets tets(tetBegin, tetBegin + h.numTets);
+  return make_tuple(mesh, tets, noErr);
+}
+
+
+// load_tet_mesh loads the tet mesh in the MCSF file fileName from its binary
+// mesh cache if there is a current one and parses the MCSF file otherwise.
+std::tuple<geom::Mesh, geom::Tets, Error> load_tet_mesh(
+  const std::string& fileName, ThreadPool& pool) {
   geom::Mesh mesh;
   geom::Tets tets;
-  std::tie(mesh, tets) = create_tets(verts, tetVerts);
-  return make_tuple(mesh, tets, noErr);
+  Error e;
+  std::tie(mesh, tets, e) = read_mesh_cache(fileName + meshCacheSuffix, fileName);
+  if (!e.err) {
+    return make_tuple(mesh, tets, noErr);
+  }
+  return parse_mcsf_tet_mesh(fileName, pool);
 }
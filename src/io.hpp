@@ -7,19 +7,78 @@
 #ifndef IO_HPP
 #define IO_HPP
 
+#include <array>
 #include <string>
 
 #include "error.hpp"
 #include "state.hpp"
+#include "thread_pool.hpp"
+
+// TetVerts holds the four vertex indices of a tetrahedron
+using TetVerts = std::array<size_t, 4>;
 
 // write_cellblender writes the molecule info at iter to a file name in
 // cellblender format located at path.
-Error write_cellblender(State& state, std::string path, std::string name,
+Error write_cellblender(const State& state, std::string path, std::string name,
   int iter);
 
 
+// snapshot_cellblender serializes the positions of all molecules in state
+// into buf in cellblender format. Molecules are listed by tet in the original
+// tet order (see State::orig_tet_id).
+void snapshot_cellblender(const State& state, Rvector<char>& buf);
+
+
+// cellblender_file_name returns the name of the cellblender file for
+// iteration iter
+std::string cellblender_file_name(const std::string& path,
+  const std::string& name, int iter);
+
+
 // parse_mcsf_tet_mesh parses an MCSF file containing a tet mesh and creates
-// and returns an internal representation of the mesh.
-std::tuple<geom::Mesh, geom::Tets, Error> parse_mcsf_tet_mesh(const std::string& fileName);
+// and returns an internal representation of the mesh using all threads of
+// pool.
+std::tuple<geom::Mesh, geom::Tets, Error> parse_mcsf_tet_mesh(
+  const std::string& fileName, ThreadPool& pool);
+
+
+// create_tets creates the MeshElements and Tets of the tet mesh with vertices
+// verts and tets tetVerts. The vertices of each tet have to be listed in the
+// positively oriented tetgen order.
+std::tuple<geom::Mesh, geom::Tets, Error> create_tets(
+  const Rvector<geom::Vec3>& verts, const Rvector<TetVerts>& tetVerts,
+  ThreadPool& pool);
+
+
+// write_mcsf_tet_mesh writes the tet mesh with vertices verts and tets
+// tetVerts to the MCSF file fileName.
+Error write_mcsf_tet_mesh(const std::string& fileName,
+  const Rvector<geom::Vec3>& verts, const Rvector<TetVerts>& tetVerts);
+
+
+// write_mesh_cache writes mesh and tets, which were created from the MCSF
+// file srcFile, to the binary mesh cache cacheFile.
+Error write_mesh_cache(const std::string& cacheFile, const std::string& srcFile,
+  const geom::Mesh& mesh, const geom::Tets& tets);
+
+
+// read_mesh_cache loads mesh and tets from the binary mesh cache cacheFile.
+// An error is returned if the cache can't be read, was written by an
+// incompatible version, is stale with respect to srcFile, or holds tets
+// referring to nonexistent MeshElements or tets. Staleness is decided by
+// size and modification time of srcFile, which only has to be hashed if
+// its modification time changed or is too close to the cache's creation.
+// The cache is also used if srcFile doesn't exist.
+std::tuple<geom::Mesh, geom::Tets, Error> read_mesh_cache(
+  const std::string& cacheFile, const std::string& srcFile);
+
+
+// load_tet_mesh loads the tet mesh in the MCSF file fileName from its binary
+// mesh cache fileName + meshCacheSuffix if there is a current one and parses
+// the MCSF file otherwise, using all threads of pool.
+std::tuple<geom::Mesh, geom::Tets, Error> load_tet_mesh(
+  const std::string& fileName, ThreadPool& pool);
+
+const std::string meshCacheSuffix = ".cache";
 
 #endif
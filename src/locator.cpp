@@ -0,0 +1,228 @@
+// Copyright 2015 Markus Dittrich
+// Licensed under BSD license, see LICENSE file for details
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+
+#include "locator.hpp"
+
+
+// points whose barycentric coordinates are all larger than -locateEps are
+// considered to be inside a tet
+const double locateEps = 1e-12;
+
+// maximum number of tets visited when walking from a hint tet
+const size_t maxWalkSteps = 16;
+
+// maximum number of grid cells along each dimension
+const size_t maxGridDim = 512;
+
+// number of points handed to a thread at a time in batched queries
+const size_t locateGrain = 4096;
+
+
+// constructor
+geom::TetLocator::TetLocator(const Mesh& mesh, const Tets& tets,
+  const TetBaryTable& bary) : bary_{&bary}, walkNbs_(tets.size()) {
+  if (tets.empty()) {
+    return;
+  }
+
+  Rvector<std::array<Vec3, 2>> boxes(tets.size());
+  for (size_t i = 0; i < tets.size(); ++i) {
+    const auto& tet = tets[i];
+    TetMeshes meshes{{&mesh[tet.m[0]], &mesh[tet.m[1]], &mesh[tet.m[2]],
+      &mesh[tet.m[3]]}};
+    auto verts = tet_vertices(meshes);
+
+    // face 0 contains vertices 0 to 2 and is thus opposite to vertex 3; the
+    // face opposite to any other vertex is the one not containing it
+    walkNbs_[i][3] = tet.t[0];
+    for (size_t k = 0; k < 3; ++k) {
+      for (size_t j = 1; j < 4; ++j) {
+        const auto& f = *meshes[j];
+        if (!(f.a == verts[k]) && !(f.b == verts[k]) && !(f.c == verts[k])) {
+          walkNbs_[i][k] = tet.t[j];
+          break;
+        }
+      }
+    }
+
+    Vec3 lo = verts[0];
+    Vec3 hi = verts[0];
+    for (const auto& v : verts) {
+      lo = Vec3{std::min(lo.x, v.x), std::min(lo.y, v.y), std::min(lo.z, v.z)};
+      hi = Vec3{std::max(hi.x, v.x), std::max(hi.y, v.y), std::max(hi.z, v.z)};
+    }
+    boxes[i] = {{lo, hi}};
+  }
+
+  // choose the cell size such that there is about one cell per tet
+  Vec3 lo = boxes[0][0];
+  Vec3 hi = boxes[0][1];
+  for (const auto& b : boxes) {
+    lo = Vec3{std::min(lo.x, b[0].x), std::min(lo.y, b[0].y), std::min(lo.z, b[0].z)};
+    hi = Vec3{std::max(hi.x, b[1].x), std::max(hi.y, b[1].y), std::max(hi.z, b[1].z)};
+  }
+  Vec3 ext = hi - lo;
+  double cellSize = std::cbrt(ext.x * ext.y * ext.z / tets.size());
+  std::array<double, 3> e{{ext.x, ext.y, ext.z}};
+  std::array<double, 3> inv;
+  for (size_t d = 0; d < 3; ++d) {
+    double n = cellSize > 0.0 ? std::ceil(e[d] / cellSize) : 1.0;
+    dims_[d] = std::max<size_t>(1, std::min<size_t>(maxGridDim, size_t(n)));
+    inv[d] = e[d] > 0.0 ? dims_[d] / e[d] : 0.0;
+  }
+  lo_ = lo;
+  invCellSize_ = Vec3{inv[0], inv[1], inv[2]};
+  cellSize2_ = 0.0;
+  for (size_t d = 0; d < 3; ++d) {
+    cellSize2_ += e[d] * e[d] / (dims_[d] * dims_[d]);
+  }
+
+  // bin the tets by their bounding boxes
+  auto cell_range = [&](const std::array<Vec3, 2>& box, std::array<size_t, 3>& l,
+    std::array<size_t, 3>& h) {
+    std::array<double, 3> bl{{box[0].x - lo_.x, box[0].y - lo_.y, box[0].z - lo_.z}};
+    std::array<double, 3> bh{{box[1].x - lo_.x, box[1].y - lo_.y, box[1].z - lo_.z}};
+    for (size_t d = 0; d < 3; ++d) {
+      l[d] = std::min(dims_[d] - 1, size_t(std::max(0.0, bl[d] * inv[d])));
+      h[d] = std::min(dims_[d] - 1, size_t(std::max(0.0, bh[d] * inv[d])));
+    }
+  };
+  auto for_cells = [&](size_t tetID, const std::function<void(size_t)>& func) {
+    std::array<size_t, 3> l, h;
+    cell_range(boxes[tetID], l, h);
+    for (size_t z = l[2]; z <= h[2]; ++z) {
+      for (size_t y = l[1]; y <= h[1]; ++y) {
+        for (size_t x = l[0]; x <= h[0]; ++x) {
+          func((z * dims_[1] + y) * dims_[0] + x);
+        }
+      }
+    }
+  };
+
+  cellStart_.assign(dims_[0] * dims_[1] * dims_[2] + 1, 0);
+  for (size_t i = 0; i < tets.size(); ++i) {
+    for_cells(i, [&](size_t c) { ++cellStart_[c + 1]; });
+  }
+  for (size_t c = 1; c < cellStart_.size(); ++c) {
+    cellStart_[c] += cellStart_[c - 1];
+  }
+  cellTets_.resize(cellStart_.back());
+  SizeTVec fill(cellStart_.begin(), cellStart_.end() - 1);
+  for (size_t i = 0; i < tets.size(); ++i) {
+    for_cells(i, [&](size_t c) { cellTets_[fill[c]++] = i; });
+  }
+
+  // lookups start walking from the tet containing the center of their cell
+  // or, if there is none, from any tet overlapping the cell
+  cellHint_.assign(cellStart_.size() - 1, size_t(Tet::unset));
+  for (size_t z = 0; z < dims_[2]; ++z) {
+    for (size_t y = 0; y < dims_[1]; ++y) {
+      for (size_t x = 0; x < dims_[0]; ++x) {
+        size_t c = (z * dims_[1] + y) * dims_[0] + x;
+        if (cellStart_[c] == cellStart_[c + 1]) {
+          continue;
+        }
+        Vec3 center{lo_.x + (x + 0.5) * e[0] / dims_[0],
+          lo_.y + (y + 0.5) * e[1] / dims_[1], lo_.z + (z + 0.5) * e[2] / dims_[2]};
+        cellHint_[c] = cellTets_[cellStart_[c]];
+        for (size_t i = cellStart_[c]; i < cellStart_[c + 1]; ++i) {
+          if (inside_tet(bary[cellTets_[i]], center, -locateEps)) {
+            cellHint_[c] = cellTets_[i];
+            break;
+          }
+        }
+      }
+    }
+  }
+}
+
+
+// locate returns the ID of a tet containing p or Tet::unset if p lies outside
+// of the mesh. We first walk from the start tet of the grid cell containing p
+// which typically takes a step or two and only test all tets overlapping the
+// cell if the walk fails, e.g. due to concave parts of the mesh boundary.
+size_t geom::TetLocator::locate(const Vec3& p) const {
+  std::array<double, 3> q{{(p.x - lo_.x) * invCellSize_.x,
+    (p.y - lo_.y) * invCellSize_.y, (p.z - lo_.z) * invCellSize_.z}};
+  std::array<size_t, 3> cell;
+  for (size_t d = 0; d < 3; ++d) {
+    if (!(q[d] >= 0.0) || q[d] > dims_[d]) {
+      return Tet::unset;
+    }
+    cell[d] = std::min(dims_[d] - 1, size_t(q[d]));
+  }
+  size_t c = (cell[2] * dims_[1] + cell[1]) * dims_[0] + cell[0];
+  if (cellHint_[c] == Tet::unset) {
+    return Tet::unset;
+  }
+  size_t tetID = walk(p, cellHint_[c]);
+  if (tetID != Tet::unset) {
+    return tetID;
+  }
+  for (size_t i = cellStart_[c]; i < cellStart_[c + 1]; ++i) {
+    if (inside_tet((*bary_)[cellTets_[i]], p, -locateEps)) {
+      return cellTets_[i];
+    }
+  }
+  return Tet::unset;
+}
+
+
+// locate walks from tet hint toward p and falls back to a grid lookup if p is
+// not reached within a few steps
+size_t geom::TetLocator::locate(const Vec3& p, size_t hint) const {
+  if (hint != Tet::unset) {
+    size_t tetID = walk(p, hint);
+    if (tetID != Tet::unset) {
+      return tetID;
+    }
+  }
+  return locate(p);
+}
+
+
+// walk moves from tet tetID toward p by repeatedly crossing the face opposite
+// to the vertex with the most negative barycentric coordinate. Returns
+// Tet::unset if the walk leaves the mesh or takes too many steps.
+size_t geom::TetLocator::walk(const Vec3& p, size_t tetID) const {
+  for (size_t step = 0; step < maxWalkSteps; ++step) {
+    const auto& tb = (*bary_)[tetID];
+    Vec3 w = p - tb.v0;
+    std::array<double, 4> l;
+    l[1] = tb.r1 * w;
+    l[2] = tb.r2 * w;
+    l[3] = tb.r3 * w;
+    l[0] = 1.0 - l[1] - l[2] - l[3];
+    size_t k = std::min_element(l.begin(), l.end()) - l.begin();
+    if (l[k] > -locateEps) {
+      return tetID;
+    }
+    tetID = walkNbs_[tetID][k];
+    if (tetID == Tet::unset) {
+      break;
+    }
+  }
+  return Tet::unset;
+}
+
+
+// locate determines the tets containing all points using all threads of pool.
+// The tet of the previous point serves as hint if the points are less than a
+// grid cell apart.
+SizeTVec geom::TetLocator::locate(const Rvector<Vec3>& points,
+  ThreadPool& pool) const {
+  SizeTVec tetIDs(points.size());
+  pool.parallel_for(points.size(), locateGrain, [&](size_t begin, size_t end) {
+    size_t hint = Tet::unset;
+    for (size_t i = begin; i < end; ++i) {
+      bool near = i > begin && norm2(points[i] - points[i - 1]) < cellSize2_;
+      tetIDs[i] = locate(points[i], near ? hint : size_t(Tet::unset));
+      hint = tetIDs[i];
+    }
+  });
+  return tetIDs;
+}
@@ -0,0 +1,74 @@
+// Copyright 2015 Markus Dittrich
+// Licensed under BSD license, see LICENSE file for details
+
+#ifndef LOCATOR_HPP
+#define LOCATOR_HPP
+
+#include <array>
+
+#include "geometry.hpp"
+#include "thread_pool.hpp"
+#include "util.hpp"
+#include "vector.hpp"
+
+
+namespace geom {
+
+// TetLocator determines which tet contains a given point. It keeps a uniform
+// grid over the bounding box of the mesh in which each cell lists all tets
+// whose bounding box overlaps the cell, and supports walking from a nearby
+// hint tet across faces toward the point. Containment is decided via the
+// barycentric coordinates in the TetBaryTable the locator was created with,
+// which has to outlive the locator. Points on a face shared by two tets may
+// be assigned to either of them.
+class TetLocator {
+
+public:
+
+  TetLocator() = default;
+  TetLocator(const Mesh& mesh, const Tets& tets, const TetBaryTable& bary);
+
+  // locate returns the ID of a tet containing p or Tet::unset if p lies
+  // outside of the mesh
+  size_t locate(const Vec3& p) const;
+
+  // locate walks from tet hint (if set) toward p and falls back to a grid
+  // lookup if p is not reached within a few steps
+  size_t locate(const Vec3& p, size_t hint) const;
+
+  // locate determines the tets containing all points using all threads of
+  // pool. Consecutive points are used as hints for each other, i.e. queries
+  // are fastest if nearby points are close in the input.
+  SizeTVec locate(const Rvector<Vec3>& points, ThreadPool& pool) const;
+
+  // rebind makes the locator use bary instead of the table it was created
+  // with, e.g. after the content of the latter was swapped into bary
+  void rebind(const TetBaryTable& bary) noexcept {
+    bary_ = &bary;
+  }
+
+private:
+
+  size_t walk(const Vec3& p, size_t tetID) const;
+
+  const TetBaryTable* bary_ = nullptr;
+
+  // walkNbs_[i][k] is the tet across the face of tet i opposite to the vertex
+  // with barycentric coordinate k
+  Rvector<std::array<size_t, 4>> walkNbs_;
+
+  // grid layout; cell c holds tets cellTets_[cellStart_[c]] up to (but not
+  // including) cellTets_[cellStart_[c + 1]] and walks within the cell start
+  // at tet cellHint_[c]
+  Vec3 lo_;
+  Vec3 invCellSize_;
+  double cellSize2_ = 0.0;   // squared length of a cell diagonal
+  std::array<size_t, 3> dims_{{0, 0, 0}};
+  SizeTVec cellStart_;
+  SizeTVec cellTets_;
+  SizeTVec cellHint_;
+};
+
+}
+
+#endif
@@ -0,0 +1,59 @@
+// Copyright 2015 Markus Dittrich
+// Licensed under BSD license, see LICENSE file for details
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "mapped_file.hpp"
+
+
+// destructor releasing the mapping
+MappedFile::~MappedFile() {
+  close();
+}
+
+
+// open maps the file fileName into memory. Empty files are not mapped and
+// result in a size of zero.
+Error MappedFile::open(const std::string& fileName) {
+  close();
+  fd_ = ::open(fileName.c_str(), O_RDONLY);
+  if (fd_ < 0) {
+    return Error{"failed to open file " + fileName};
+  }
+
+  struct stat st;
+  if (fstat(fd_, &st) != 0) {
+    close();
+    return Error{"failed to stat file " + fileName};
+  }
+  size_ = st.st_size;
+  if (size_ == 0) {
+    return noErr;
+  }
+
+  void* addr = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd_, 0);
+  if (addr == MAP_FAILED) {
+    close();
+    return Error{"failed to map file " + fileName};
+  }
+  madvise(addr, size_, MADV_SEQUENTIAL);
+  data_ = static_cast<const char*>(addr);
+  return noErr;
+}
+
+
+// close releases the mapping and the underlying file descriptor
+void MappedFile::close() {
+  if (data_ != nullptr) {
+    munmap(const_cast<char*>(data_), size_);
+    data_ = nullptr;
+  }
+  if (fd_ >= 0) {
+    ::close(fd_);
+    fd_ = -1;
+  }
+  size_ = 0;
+}
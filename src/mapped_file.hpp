@@ -0,0 +1,48 @@
+// Copyright 2015 Markus Dittrich
+// Licensed under BSD license, see LICENSE file for details
+
+#ifndef MAPPED_FILE_HPP
+#define MAPPED_FILE_HPP
+
+#include <string>
+
+#include "error.hpp"
+
+
+// MappedFile provides read only access to the content of a file by mapping
+// it into memory. The mapping is released when the MappedFile goes out of
+// scope.
+class MappedFile {
+
+public:
+
+  MappedFile() = default;
+  ~MappedFile();
+
+  // don't allow copy & move operations
+  MappedFile(const MappedFile& m) = delete;
+  MappedFile& operator=(const MappedFile& m) = delete;
+  MappedFile(MappedFile&& m) = delete;
+  MappedFile& operator=(MappedFile&& m) = delete;
+
+  // open maps the file fileName into memory
+  Error open(const std::string& fileName);
+
+  const char* data() const noexcept {
+    return data_;
+  }
+
+  size_t size() const noexcept {
+    return size_;
+  }
+
+private:
+
+  void close();
+
+  int fd_ = -1;
+  const char* data_ = nullptr;
+  size_t size_ = 0;
+};
+
+#endif
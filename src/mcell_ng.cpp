@@ -1,84 +1,426 @@
 // Copyright 2015 Markus Dittrich
 // Licensed under BSD license, see LICENSE file for details
 
+#include <algorithm>
+#include <chrono>
 #include <cmath>
 #include <iostream>
+#include <limits>
 #include <memory>
+#include <thread>
 
+#include "cellblender_writer.hpp"
+#include "checkpoint.hpp"
+#include "counters.hpp"
+#include "dataflow.hpp"
 #include "diffuse.hpp"
+#include "domain.hpp"
 #include "geometry.hpp"
 #include "io.hpp"
 #include "molecules.hpp"
+#include "partition.hpp"
+#include "placement.hpp"
 #include "rng.hpp"
 #include "species.hpp"
 #include "state.hpp"
+#include "step.hpp"
+#include "thread_pool.hpp"
 
 
 using std::cerr;
 using std::cout;
 using std::endl;
 
-int main() {
+// usage prints a short description of the command line options
+static void usage(const char* prog) {
+  cerr << "usage: " << prog << " [--mesh <mcsf file>] [--build-mesh-cache]"
+       << " [--reorder] [--iterations <n>] [--checkpoint <file>]"
+       << " [--checkpoint-every <n>] [--restart <file>] [--react]"
+       << " [--release <n>] [--stats <file>] [--stats-every <n>] [--procs <n>]"
+       << " [--rebalance <ratio>] [--dataflow] [--absorb-boundary]"
+       << " [--membrane <p>] [--collision <mode>]\n"
+       << "  --mesh <mcsf file>      tet mesh to simulate in\n"
+       << "  --reorder               renumber tets for spatial locality\n"
+       << "  --build-mesh-cache      write the binary cache of the mesh and exit\n"
+       << "  --iterations <n>        number of iterations to run (default 10)\n"
+       << "  --checkpoint <file>     write a checkpoint at the end of the run\n"
+       << "  --checkpoint-every <n>  also write the checkpoint every n iterations\n"
+       << "  --restart <file>        continue the run stored in a checkpoint\n"
+       << "  --react                 also release B molecules reacting as A + B -> C\n"
+       << "  --release <n>           also release n A molecules across the whole mesh\n"
+       << "  --stats <file>          write per step counters as CSV (JSON if <file>\n"
+       << "                          ends in .json)\n"
+       << "  --stats-every <n>       sum the counters over n iterations (default 1)\n"
+       << "  --procs <n>             split the mesh into n subdomains, each stepped\n"
+       << "                          by its own process (not with --react or --stats)\n"
+       << "  --rebalance <ratio>     with --procs, use blocks of consecutive tets\n"
+       << "                          and move them between processes whenever the\n"
+       << "                          busiest one has ratio times the mean work\n"
+       << "                          (blocks are compact with --reorder)\n"
+       << "  --dataflow              advance blocks of tets as soon as their\n"
+       << "                          neighbors are ready instead of in global\n"
+       << "                          hand-off rounds (not with --procs)\n"
+       << "  --absorb-boundary       make the outer boundary of the mesh absorptive\n"
+       << "  --membrane <p>          make the faces between the lower and upper half\n"
+       << "                          of the mesh in x translucent with pass\n"
+       << "                          probability p\n"
+       << "  --collision <mode>      how molecules leaving their tet are found:\n"
+       << "                          barycentric (default), intersect, or\n"
+       << "                          exhaustive, which skips no face tests; all\n"
+       << "                          give identical trajectories"
+       << endl;
+}
+
+
+int main(int argc, char** argv) {
   cout << "Hello world" << endl;
 
+  std::string meshFile = "../mcell_ng_trunk/tests/cube.mcsf";
+  //std::string meshFile = "../mcell_ng_trunk/tests/sphere.mcsf";
+  bool buildMeshCache = false;
+  bool reorder = false;
+  uint64_t numIters = 10;
+  uint64_t checkpointEvery = 0;
+  std::string checkpointFile;
+  std::string restartFile;
+  bool withReactions = false;
+  size_t numReleased = 0;
+  std::string statsFile;
+  uint64_t statsEvery = 1;
+  size_t numProcs = 1;
+  double rebalanceRatio = 0.0;
+  bool dataflow = false;
+  bool absorbBoundary = false;
+  double membranePassProb = -1.0;
+  std::string collisionName;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--mesh" && i + 1 < argc) {
+      meshFile = argv[++i];
+    } else if (arg == "--build-mesh-cache") {
+      buildMeshCache = true;
+    } else if (arg == "--reorder") {
+      reorder = true;
+    } else if (arg == "--iterations" && i + 1 < argc) {
+      numIters = std::stoull(argv[++i]);
+    } else if (arg == "--checkpoint" && i + 1 < argc) {
+      checkpointFile = argv[++i];
+    } else if (arg == "--checkpoint-every" && i + 1 < argc) {
+      checkpointEvery = std::stoull(argv[++i]);
+    } else if (arg == "--restart" && i + 1 < argc) {
+      restartFile = argv[++i];
+    } else if (arg == "--react") {
+      withReactions = true;
+    } else if (arg == "--release" && i + 1 < argc) {
+      numReleased = std::stoull(argv[++i]);
+    } else if (arg == "--stats" && i + 1 < argc) {
+      statsFile = argv[++i];
+    } else if (arg == "--stats-every" && i + 1 < argc) {
+      statsEvery = std::max<uint64_t>(1, std::stoull(argv[++i]));
+    } else if (arg == "--procs" && i + 1 < argc) {
+      numProcs = std::max<size_t>(1, std::stoull(argv[++i]));
+    } else if (arg == "--rebalance" && i + 1 < argc) {
+      rebalanceRatio = std::stod(argv[++i]);
+    } else if (arg == "--dataflow") {
+      dataflow = true;
+    } else if (arg == "--absorb-boundary") {
+      absorbBoundary = true;
+    } else if (arg == "--membrane" && i + 1 < argc) {
+      membranePassProb = std::stod(argv[++i]);
+    } else if (arg == "--collision" && i + 1 < argc) {
+      collisionName = argv[++i];
+    } else {
+      usage(argv[0]);
+      exit(1);
+    }
+  }
+  if (numProcs > 1 && (dataflow || withReactions || !statsFile.empty())) {
+    usage(argv[0]);
+    exit(1);
+  }
+  CollisionMode collisionMode = CollisionMode::barycentric;
+  if (!collisionName.empty()) {
+    Error e;
+    std::tie(collisionMode, e) = parse_collision_mode(collisionName);
+    if (e.err) {
+      cerr << e.desc << endl;
+      exit(1);
+    }
+  }
+
+  size_t numThreads = std::max(1u, std::thread::hardware_concurrency());
+  std::unique_ptr<ThreadPool> pool(new ThreadPool(numThreads));
   const std::string outDir = "/Users/markus/programming/cpp/mcell_ng/build/viz_data";
   State state(1e-6);
 
   geom::Mesh mesh;
   geom::Tets tets;
   Error e;
-  std::string meshFile = "../mcell_ng_trunk/tests/cube.mcsf";
-  //std::string meshFile = "../mcell_ng_trunk/tests/sphere.mcsf";
-  std::tie(mesh, tets, e) = parse_mcsf_tet_mesh(meshFile);
-  if (e.err) {
-    cerr << e.desc << endl;
-    exit(1);
+  if (buildMeshCache) {
+    std::tie(mesh, tets, e) = parse_mcsf_tet_mesh(meshFile, *pool);
+    if (!e.err) {
+      e = write_mesh_cache(meshFile + meshCacheSuffix, meshFile, mesh, tets);
+    }
+    if (e.err) {
+      cerr << e.desc << endl;
+      exit(1);
+    }
+    exit(0);
   }
 
-  state.add_geometry(mesh, tets);
+  uint64_t startIter = 0;
+  if (!restartFile.empty()) {
+    std::tie(startIter, e) = read_checkpoint(restartFile, state);
+    if (e.err) {
+      cerr << e.desc << endl;
+      exit(1);
+    }
+    size_t numMoved = rehome_mols(state, *pool);
+    if (numMoved > 0) {
+      cout << "rehomed " << numMoved << " molecules after restart" << endl;
+    }
+  } else {
+    std::tie(mesh, tets, e) = load_tet_mesh(meshFile, *pool);
+    if (e.err) {
+      cerr << e.desc << endl;
+      exit(1);
+    }
+
+    state.add_geometry(mesh, tets, reorder);
+
+    // mesh properties are part of checkpoints and thus only set up for new
+    // runs
+    if (absorbBoundary) {
+      e = state.set_mesh_props(geom::boundary_faces(state.tets()),
+        geom::MeshProp::absorptive);
+      if (e.err) {
+        cerr << "set_mesh_props: " << e.desc << endl;
+        exit(1);
+      }
+    }
+    if (membranePassProb >= 0.0) {
+      double xMin = std::numeric_limits<double>::max();
+      double xMax = std::numeric_limits<double>::lowest();
+      for (const auto& me : state.mesh()) {
+        xMin = std::min({xMin, me.a.x, me.b.x, me.c.x});
+        xMax = std::max({xMax, me.a.x, me.b.x, me.c.x});
+      }
+      auto faces = geom::split_faces(state.mesh(), state.tets(),
+        0.5 * (xMin + xMax));
+      e = state.set_mesh_props(faces, geom::MeshProp::translucent,
+        membranePassProb);
+      if (e.err) {
+        cerr << "set_mesh_props: " << e.desc << endl;
+        exit(1);
+      }
+      cout << "membrane:    " << faces.size() << " translucent faces" << endl;
+    }
 
-  auto aSpecID = state.create_species(MolSpecies("A", 600));
-  auto& tetMols = state.tetMols(0);
-  for (int i=0; i < 10000; ++i) {
-    //VolMol mol{aSpecID, geom::Vec3{-0.000001,0.0,0.0}, 0.0};
-    //tetMols.activeMols.add(std::move(mol));
-    tetMols.activeMols.add(std::make_unique<VolMol>(VolMol{aSpecID, geom::Vec3{-0.000001,0.0,0.0}, 0.0}));
+    auto aSpecID = state.create_species(MolSpecies("A", 600));
+    Rvector<geom::Vec3> aPos(10000, geom::Vec3{-0.000001,0.0,0.0});
+    if (place_mols(state, *pool, aSpecID, aPos, 0.0) != aPos.size()) {
+      cerr << "release site of A is outside of the mesh" << endl;
+      exit(1);
+    }
+    if (numReleased > 0) {
+      auto start = std::chrono::steady_clock::now();
+      release_mols(state, *pool, aSpecID, numReleased, 0.0, 0);
+      cout << "released:    " << numReleased << " in "
+           << std::chrono::duration<double>(
+                std::chrono::steady_clock::now() - start).count()
+           << " s" << endl;
+    }
+
+    // B molecules start at the center of the last tet and react with A
+    if (withReactions) {
+      auto bSpecID = state.create_species(MolSpecies("B", 600));
+      auto cSpecID = state.create_species(MolSpecies("C", 600));
+      // partners are only searched for in neighboring tets, which limits
+      // the interaction radius to the size of the smallest tet
+      double radius = std::min(0.005, state.min_inradius());
+      std::tie(std::ignore, e) = state.create_reaction(BimolReaction(aSpecID,
+        bSpecID, SizeTVec{cSpecID}, 1e5, radius));
+      if (e.err) {
+        cerr << "create_reaction: " << e.desc << endl;
+        exit(1);
+      }
+      size_t bTetID = state.tets().size() - 1;
+      geom::Vec3 center;
+      for (auto m : state.tets()[bTetID].m) {
+        const auto& me = state.mesh()[m];
+        center += (1.0 / 12) * (me.a + me.b + me.c);
+      }
+      place_mols(state, *pool, bSpecID, Rvector<geom::Vec3>(10000, center), 0.0);
+    }
   }
-/*
-  auto bID = state.species().create("B", 900);
-  for (int i=0; i < 12000; ++i) {
-    state.volMols().create(bID, Vec3{0.05,0.05,0.05});
+
+  // the collision mode doesn't change any results and can thus also be
+  // switched when restarting
+  if (!collisionName.empty()) {
+    state.set_collision_mode(collisionMode);
   }
-*/
 
-  e = write_cellblender(state, outDir, "test", 0);
-  if (e.err) {
-    cerr << "write_cellblender: " << e.desc << endl;
-    exit(1);
+  std::unique_ptr<CellBlenderWriter> vizWriter(
+    new CellBlenderWriter(outDir, "test"));
+  if (restartFile.empty()) {
+    e = vizWriter->write(state, 0);
+    if (e.err) {
+      cerr << "write_cellblender: " << e.desc << endl;
+      exit(1);
+    }
   }
 
+  // counters are only collected if they are written somewhere or the
+  // reaction pass is timed
+  std::unique_ptr<StatsWriter> statsWriter;
+  if (!statsFile.empty()) {
+    statsWriter.reset(new StatsWriter(statsFile));
+  }
+  StepCounters counters;
+
+  // write_output writes the visualization data and checkpoints due after
+  // iteration i
+  auto write_output = [&](const State& s, uint64_t i) {
+    if (i % 10 == 0) {
+      Error e = vizWriter->write(s, i);
+      if (e.err) {
+        cerr << "write_cellblender :" << e.desc << endl;
+      }
+    }
+
+    if (!checkpointFile.empty() && checkpointEvery != 0 && i % checkpointEvery == 0) {
+      Error e = write_checkpoint(checkpointFile, s, i);
+      if (e.err) {
+        cerr << "write_checkpoint: " << e.desc << endl;
+      }
+    }
+  };
+
   // do a few diffusion steps
-  for (int i=1; i < 10; ++i) {
-    cout << "iteration:   " << i << endl;
+  size_t numReactions = 0;
+  double stepTime = 0.0;
+  double reactTime = 0.0;
+
+  // with several processes the molecules are only collected when output is
+  // due
+  if (numProcs > 1) {
+    // rebalanced blocks start out with equal numbers of molecules
+    Partition part;
+    if (rebalanceRatio > 0.0) {
+      Rvector<uint64_t> weights(state.tets().size(), 1);
+      for (auto tetID : state.active_tets()) {
+        weights[tetID] += state.tetMols(tetID).activeMols.num_mols();
+      }
+      part = partition_blocks(state.tets(), numProcs, weights);
+    } else {
+      part = partition_tets(state.tets(), numProcs);
+    }
+    cout << "partition:   " << part.numParts << " subdomains with "
+         << part.cutFaces << " cut faces" << endl;
+    DomainConfig config;
+    config.threadsPerProc = std::max<size_t>(1, numThreads / part.numParts);
+    config.rebalanceRatio = rebalanceRatio;
+    auto gather = [&](uint64_t i) {
+      return i % 10 == 0 || (!checkpointFile.empty() && checkpointEvery != 0 &&
+                             i % checkpointEvery == 0);
+    };
+    auto visit = [&](const State& s, uint64_t i) {
+      cout << "iteration:   " << i << endl;
+      if (!vizWriter) {
+        vizWriter.reset(new CellBlenderWriter(outDir, "test"));
+      }
+      write_output(s, i);
+    };
 
-    for (size_t tetID = 0; tetID < state.tets().size(); ++tetID) {
-      process_tet(state, tetID);
+    // the workers are forked off this process, which thus mustn't run any
+    // other threads at that point. The writer is restarted by visit once
+    // all workers are running.
+    pool.reset();
+    e = vizWriter->finish();
+    if (e.err) {
+      cerr << "write_cellblender :" << e.desc << endl;
+    }
+    vizWriter.reset();
+    Rvector<DomainStats> domainStats;
+    std::tie(domainStats, e) = run_domains(state, part, startIter + 1,
+      numIters, config, gather, visit);
+    if (e.err) {
+      cerr << "run_domains: " << e.desc << endl;
+      exit(1);
+    }
+    uint64_t totalWork = 0;
+    for (const auto& s : domainStats) {
+      totalWork += s.work;
     }
+    for (size_t p = 0; p < domainStats.size(); ++p) {
+      const auto& s = domainStats[p];
+      double steps = std::max<uint64_t>(1, s.steps);
+      cout << "process " << p << ":   " << s.numTets << " tets, "
+           << (s.stepTime > 0.0 ? s.molsMoved / s.stepTime : 0.0)
+           << " mol moves/s, " << s.haloMols / steps << " halo mols/step ("
+           << s.haloBytes / steps << " bytes/step), "
+           << (totalWork > 0 ? 100.0 * s.work / totalWork : 0.0)
+           << "% of work, " << s.rebalances << " rebalances, "
+           << s.migratedMols << " mols migrated" << endl;
+    }
+  } else {
+    // dataflow stepping wants several blocks per thread to keep all threads
+    // busy while some blocks wait for their neighbors
+    std::unique_ptr<Dataflow> flow;
+    if (dataflow) {
+      flow.reset(new Dataflow(state.tets(), 16 * numThreads));
+      cout << "dataflow:    " << flow->num_blocks() << " blocks" << endl;
+    }
+    for (uint64_t i = startIter + 1; i < numIters; ++i) {
+      cout << "iteration:   " << i << endl;
+
+      auto start = std::chrono::steady_clock::now();
+      StepCounters* c = statsWriter || !state.reactions().empty()
+        ? &counters : nullptr;
+      double reactStart = counters.reactTime;
+      numReactions += flow ? flow->step(state, *pool, i, c)
+                           : step(state, *pool, i, c);
+      stepTime += std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count();
+      reactTime += counters.reactTime - reactStart;
+
+      if (statsWriter && (i % statsEvery == 0 || i + 1 == numIters)) {
+        e = statsWriter->write(i, counters);
+        if (e.err) {
+          cerr << "write_stats: " << e.desc << endl;
+        }
+        counters = StepCounters();
+      }
 #if 0
-    for (auto& spec : state.species()) {
-      for (auto& m : state.volMols()[spec.name()]) {
-        if (!diffuse(state, spec, m, dt)) {
-          cout << "error diffusing molecule " << spec.name() << endl;
+      for (auto& spec : state.species()) {
+        for (auto& m : state.volMols()[spec.name()]) {
+          if (!diffuse(state, spec, m, dt)) {
+            cout << "error diffusing molecule " << spec.name() << endl;
+          }
         }
       }
-    }
 #endif
 
-    if (i % 10 == 0) {
-      e = write_cellblender(state, outDir, "test", i);
-      if (e.err) {
-        cerr << "write_cellblender :" << e.desc << endl;
-      }
+      write_output(state, i);
     }
   }
+
+  if (!checkpointFile.empty() && numIters > startIter + 1) {
+    e = write_checkpoint(checkpointFile, state, numIters - 1);
+    if (e.err) {
+      cerr << "write_checkpoint: " << e.desc << endl;
+    }
+  }
+
+  if (!state.reactions().empty()) {
+    cout << "reactions:   " << numReactions << " in " << reactTime
+         << " s of reaction passes out of " << stepTime << " s of steps ("
+         << (reactTime > 0.0 ? numReactions / reactTime : 0.0)
+         << " reacting pairs/s)" << endl;
+  }
+
+  e = vizWriter ? vizWriter->finish() : noErr;
+  if (e.err) {
+    cerr << "write_cellblender :" << e.desc << endl;
+  }
 }
@@ -0,0 +1,54 @@
+// Copyright 2015 Markus Dittrich
+// Licensed under BSD license, see LICENSE file for details
+
+#include <array>
+#include <utility>
+
+#include "mesh_gen.hpp"
+
+
+// generate_cube_mesh creates a structured tet mesh of the cube [0, edge]^3.
+// Each subcube is split into six tets along its diagonal from the lowest to
+// the highest corner (Kuhn subdivision): the tet for the axis permutation
+// (p, q, r) runs from the lowest corner via one step along p and a further one
+// along q to the highest corner. Since all subcubes use the same diagonal
+// direction, faces of adjacent subcubes match up. Vertices are listed in the
+// positively oriented order expected by create_tets.
+CubeMesh generate_cube_mesh(size_t n, double edge) {
+  CubeMesh cm;
+  size_t nv = n + 1;
+  double h = edge / n;
+  cm.verts.reserve(nv * nv * nv);
+  for (size_t z = 0; z < nv; ++z) {
+    for (size_t y = 0; y < nv; ++y) {
+      for (size_t x = 0; x < nv; ++x) {
+        cm.verts.push_back(geom::Vec3{x * h, y * h, z * h});
+      }
+    }
+  }
+
+  const std::array<std::array<size_t, 3>, 6> perms{{{{0, 1, 2}}, {{0, 2, 1}},
+    {{1, 0, 2}}, {{1, 2, 0}}, {{2, 0, 1}}, {{2, 1, 0}}}};
+  const std::array<size_t, 3> strides{{1, nv, nv * nv}};
+  cm.tetVerts.reserve(6 * n * n * n);
+  for (size_t z = 0; z < n; ++z) {
+    for (size_t y = 0; y < n; ++y) {
+      for (size_t x = 0; x < n; ++x) {
+        size_t lo = (z * nv + y) * nv + x;
+        for (const auto& p : perms) {
+          TetVerts tv{{lo, lo + strides[p[0]], lo + strides[p[0]] + strides[p[1]],
+            lo + strides[0] + strides[1] + strides[2]}};
+          const auto& v = cm.verts;
+          geom::Vec3 e1 = v[tv[1]] - v[tv[0]];
+          geom::Vec3 e2 = v[tv[2]] - v[tv[0]];
+          geom::Vec3 e3 = v[tv[3]] - v[tv[0]];
+          if (e1 * cross(e2, e3) < 0.0) {
+            std::swap(tv[1], tv[2]);
+          }
+          cm.tetVerts.push_back(tv);
+        }
+      }
+    }
+  }
+  return cm;
+}
@@ -0,0 +1,24 @@
+// Copyright 2015 Markus Dittrich
+// Licensed under BSD license, see LICENSE file for details
+
+#ifndef MESH_GEN_HPP
+#define MESH_GEN_HPP
+
+#include "io.hpp"
+#include "util.hpp"
+#include "vector.hpp"
+
+
+// CubeMesh holds the vertices and tets of a generated tet mesh in the form
+// expected by create_tets and write_mcsf_tet_mesh
+struct CubeMesh {
+  Rvector<geom::Vec3> verts;
+  Rvector<TetVerts> tetVerts;
+};
+
+// generate_cube_mesh creates a structured tet mesh of the cube [0, edge]^3
+// which is divided into n^3 subcubes of six tets each, i.e. the mesh consists
+// of 6 * n^3 tets
+CubeMesh generate_cube_mesh(size_t n, double edge);
+
+#endif
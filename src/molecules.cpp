@@ -2,49 +2,112 @@
 // Licensed under BSD license, see LICENSE file for details
 
 
-#include <algorithm>
-
 #include "molecules.hpp"
 
 
-// Mol constructor
-Mol::Mol(size_t specID, double t) : specID_{specID}, t_{t} {}
+// reserve preallocates space for n molecules
+void VolMols::reserve(size_t n) {
+  pos.reserve(n);
+  dispRem.reserve(n);
+  t.reserve(n);
+  flags.reserve(n);
+  faceDist.reserve(n);
+}
+
+
+// add appends a new molecule
+void VolMols::add(const MolVec3& p, double birth, const MolVec3& rem,
+  uint8_t f) {
+  pos.push_back(p);
+  dispRem.push_back(rem);
+  t.push_back(birth);
+  flags.push_back(f);
+  faceDist.push_back(0.0f);
+}
+
+
+// append copies molecule i of mols to the end of this container
+void VolMols::append(const VolMols& mols, size_t i) {
+  add(mols.pos[i], mols.t[i], mols.dispRem[i], mols.flags[i]);
+  faceDist.back() = mols.faceDist[i];
+}
+
+
+// append_all copies all molecules in mols to the end of this container
+void VolMols::append_all(const VolMols& mols) {
+  pos.insert(pos.end(), mols.pos.begin(), mols.pos.end());
+  dispRem.insert(dispRem.end(), mols.dispRem.begin(), mols.dispRem.end());
+  t.insert(t.end(), mols.t.begin(), mols.t.end());
+  flags.insert(flags.end(), mols.flags.begin(), mols.flags.end());
+  faceDist.insert(faceDist.end(), mols.faceDist.begin(), mols.faceDist.end());
+}
 
 
-// Mol destructor - provide implementation since we use a pure virtual destructor
-Mol::~Mol() {};
+// compact removes all molecules marked as dead while preserving the order
+// of the remaining ones
+void VolMols::compact() {
+  size_t n = 0;
+  for (size_t i = 0; i < size(); ++i) {
+    if (flags[i] & molFlags::dead) {
+      continue;
+    }
+    if (n != i) {
+      pos[n] = pos[i];
+      dispRem[n] = dispRem[i];
+      t[n] = t[i];
+      flags[n] = flags[i];
+      faceDist[n] = faceDist[i];
+    }
+    ++n;
+  }
+  pos.resize(n);
+  dispRem.resize(n);
+  t.resize(n);
+  flags.resize(n);
+  faceDist.resize(n);
+}
 
 
-// VolMol constructor
-VolMol::VolMol(size_t specID, const geom::Vec3& pos, double t)
-  : Mol(specID, t), pos_{pos} {}
+// clear removes all molecules but keeps the allocated storage around for
+// reuse
+void VolMols::clear() noexcept {
+  pos.clear();
+  dispRem.clear();
+  t.clear();
+  flags.clear();
+  faceDist.clear();
+}
 
 
-// moveTo moves the volume molecule to a new position
-void VolMol::moveTo(const geom::Vec3& to) {
-  pos_ = to;
+// add a new molecule of species specID
+void SpeciesMols::add(size_t specID, const MolVec3& pos, double t) {
+  (*this)[specID].add(pos, t);
+}
+
+
+// num_mols returns the total number of molecules across all species
+size_t SpeciesMols::num_mols() const noexcept {
+  size_t n = 0;
+  for (const auto& m : mols_) {
+    n += m.size();
+  }
+  return n;
 }
 
 
-// add an existing VolMol and takes possession
-void VolMolMap::add(VolMolPtr mol) {
-  auto specID = mol->specID();
-  if (volMolMap_.find(specID) == volMolMap_.end()) {
-    volMolMap_[specID] = VolMolContainer{};
+// clear removes all molecules of all species
+void SpeciesMols::clear() noexcept {
+  for (auto& m : mols_) {
+    m.clear();
   }
-  volMolMap_[specID].emplace_back(std::move(mol));
 }
 
 
-// del erases the provided volume molecule from the simulation
-bool VolMolMap::del(VolMolPtr mol) {
-  VolMolContainer& vm = volMolMap_[mol->specID()];
-  auto it = std::find_if(vm.begin(), vm.end(), [&mol](const auto& p) {
-    return p == mol;
-  });
-  if (it != vm.end()) {
-    vm.erase(it);
-    return true;
+// operator[] provides access to the molecules of species specID and creates
+// an empty container if none exists yet
+VolMols& SpeciesMols::operator[](size_t specID) {
+  if (specID >= mols_.size()) {
+    mols_.resize(specID + 1);
   }
-  return false;
+  return mols_[specID];
 }
@@ -4,108 +4,119 @@
 #ifndef MOLECULES_HPP
 #define MOLECULES_HPP
 
-#include <memory>
-#include <unordered_map>
+#include <cstdint>
 
 #include "species.hpp"
 #include "vector.hpp"
 #include "util.hpp"
 
-// Mol is the abstract base class for describing 2D and 3D molecules
-class Mol {
+// MolVec3 is the vector type of molecule positions and remaining
+// displacements. Builds with MCELL_SINGLE_PRECISION store them in single
+// precision, which halves the memory traffic of the molecule state; all
+// geometry, including the diffusion of a molecule within its tet, is still
+// computed in double precision.
+#ifdef MCELL_SINGLE_PRECISION
+using MolVec3 = geom::Vec3f;
+#else
+using MolVec3 = geom::Vec3;
+#endif
 
-public:
-  Mol(size_t specID, double t);
-  virtual ~Mol() = 0;
+// molFlags lists the per molecule state bits kept in VolMols::flags
+namespace molFlags {
+const uint8_t inFlight = 1 << 0;  // molecule is mid way through its diffusion step
+const uint8_t dead = 1 << 1;      // molecule left its tet or was destroyed
+}
+
+// VolMols holds all volume molecules of a single species within a tet.
+// Molecule state is kept in structure-of-arrays layout, i.e. the i-th molecule
+// is described by pos[i], dispRem[i], t[i], flags[i], and faceDist[i]. This
+// keeps the molecules of a tet in contiguous memory and avoids a heap
+// allocation per molecule.
+// faceDist is a lower bound of the distance of the molecule from the faces of
+// its tet, which lets displacements shorter than it skip collision detection.
+// It is only set by the diffusion code once a molecule comes to rest and is 0
+// for all molecules added to a container, e.g. after moving to another tet.
+class VolMols {
+ public:
+  size_t size() const noexcept { return pos.size(); }
 
+  bool empty() const noexcept { return pos.empty(); }
 
-  double t() const noexcept {
-    return t_;
-  }
+  void reserve(size_t n);
 
-  size_t specID() const noexcept {
-    return specID_;
-  }
+  // add appends a new molecule
+  void add(const MolVec3& p, double birth, const MolVec3& rem = {},
+    uint8_t f = 0);
 
+  // append copies molecule i of mols to the end of this container
+  void append(const VolMols& mols, size_t i);
 
-private:
-  size_t specID_;  // what species are we
-  double t_;       // birthday
-};
+  // append_all copies all molecules in mols to the end of this container
+  void append_all(const VolMols& mols);
 
-// VolMol describes volume molecules
-class VolMol : public Mol {
- public:
-  VolMol(size_t specID, const geom::Vec3& pos, double t);
+  // compact removes all molecules marked as dead while preserving the order
+  // of the remaining ones
+  void compact();
 
-  const geom::Vec3& pos() const noexcept { return pos_; }
+  void clear() noexcept;
 
-  void moveTo(const geom::Vec3& to);
-
-  bool inFlight = false;
-  geom::Vec3 dispRem;  // diffusive motion remaining in current iteration
-
- private:
-  geom::Vec3 pos_;
+  Rvector<MolVec3> pos;         // molecule positions
+  Rvector<MolVec3> dispRem;     // diffusive motion remaining in current iteration
+  Rvector<double> t;            // birthdays
+  Rvector<uint8_t> flags;       // molFlags bits
+  Rvector<float> faceDist;      // lower bound of the distance from all faces
 };
 
-using VolMolPtr = std::unique_ptr<VolMol>;
 
-// MolContainer is a simple overload of Rvector for efficient removal of
-// elements. Instead of removing elements from within the vector MolContainer
-// swaps the removed elements with the last element in the vector and then
-// removes the last element.
-template <typename T>
-class MolContainer : public Rvector<T> {
+// SpeciesMols keeps one VolMols container per molecule species indexed by
+// the species ID handed out by State::create_species.
+class SpeciesMols {
  public:
-  using Rvector<T>::Rvector;
-  using iter = typename Rvector<T>::iterator;
-
-  iter erase(iter pos) {
-    auto last = Rvector<T>::end() - 1;
-    if (pos != last) {
-      std::swap(*pos, *last);
-    }
-    return Rvector<T>::erase(last);
-  }
-};
+  using iterator = Rvector<VolMols>::iterator;
+  using const_iterator = Rvector<VolMols>::const_iterator;
 
-//using VolMolContainer = MolContainer<VolMol>;
-using VolMolContainer = Rvector<VolMolPtr>;
+  // add a new molecule of species specID
+  void add(size_t specID, const MolVec3& pos, double t);
 
-// VolMolMap holds all molecules in the simulation organized by species id
-class VolMolMap {
- public:
-  using mapped_type = std::unordered_map<size_t, VolMolContainer>::mapped_type;
-  using iterator = std::unordered_map<size_t, VolMolContainer>::iterator;
+  // number of species slots; species without molecules may have empty slots
+  size_t size() const noexcept { return mols_.size(); }
+
+  // total number of molecules across all species
+  size_t num_mols() const noexcept;
 
-  // add an existing VolMol and take possession
-  void add(VolMolPtr volMol);
+  void clear() noexcept;
 
-  // delete a volume molecule
-  bool del(VolMolPtr mol);
+  // provide iterators to underlying container
+  iterator begin() noexcept { return mols_.begin(); }
 
-  // provide iterators to underlying map
-  iterator begin() noexcept { return volMolMap_.begin(); }
+  iterator end() noexcept { return mols_.end(); }
 
-  iterator end() noexcept { return volMolMap_.end(); }
+  const_iterator begin() const noexcept { return mols_.begin(); }
 
-  mapped_type& operator[](size_t specID) { return volMolMap_[specID]; }
+  const_iterator end() const noexcept { return mols_.end(); }
+
+  // operator[] provides access to the molecules of species specID and creates
+  // an empty container if none exists yet
+  VolMols& operator[](size_t specID);
+
+  // const access to the molecules of an existing species slot
+  const VolMols& operator[](size_t specID) const { return mols_[specID]; }
 
  private:
-  std::unordered_map<size_t, VolMolContainer> volMolMap_;
+  Rvector<VolMols> mols_;
 };
 
+
 // MolState keeps track of all molecules within a tet
 struct TetMolState {
   // active molecules located in this tet
-  VolMolMap activeMols;
+  SpeciesMols activeMols;
 
   // molecules enterting this tet (from neighboring tets)
-  VolMolContainer inMols;
+  SpeciesMols inMols;
 
   // molecules leaving this tet for one of the four neighbors
-  Rvector<VolMolContainer> outMols{4};
+  Rvector<SpeciesMols> outMols{4};
 };
 
 using TetMolStates = Rvector<TetMolState>;
@@ -0,0 +1,198 @@
+// Copyright 2015 Markus Dittrich
+// Licensed under BSD license, see LICENSE file for details
+
+#include <algorithm>
+#include <array>
+#include <numeric>
+
+#include "partition.hpp"
+
+
+// maximum relative deviation of subdomain sizes from the mean allowed when
+// refining a partition
+const double maxImbalance = 0.03;
+
+// maximum number of refinement sweeps over all tets
+const size_t maxRefinePasses = 10;
+
+
+// Bisector keeps the scratch space for the breadth first searches of
+// recursive bisection. Tets of the region being split are marked with the
+// region's stamp so searches can stay within it without clearing any state.
+struct Bisector {
+
+  explicit Bisector(const geom::Tets& t)
+    : tets{t}, region(t.size(), 0), seen(t.size(), 0) {}
+
+  // bfs_order lists the tets in ids in breadth first order from start,
+  // restarting from the next unseen tet of ids for disconnected regions
+  void bfs_order(const SizeTVec& ids, size_t start, SizeTVec& order) {
+    ++seenStamp;
+    order.clear();
+    size_t next = 0;
+    size_t head = 0;
+    while (order.size() < ids.size()) {
+      if (head == order.size()) {
+        while (seen[start] == seenStamp) {
+          start = ids[next++];
+        }
+        seen[start] = seenStamp;
+        order.push_back(start);
+      }
+      const auto& tet = tets[order[head++]];
+      for (auto nbID : tet.t) {
+        if (nbID != geom::Tet::unset && region[nbID] == regionStamp &&
+            seen[nbID] != seenStamp) {
+          seen[nbID] = seenStamp;
+          order.push_back(nbID);
+        }
+      }
+    }
+  }
+
+  // bisect assigns the tets in ids to subdomains [first, first + k). The
+  // search starts from the last tet reached from an arbitrary one, which
+  // tends to be on the periphery of the region and yields compact halves.
+  void bisect(const SizeTVec& ids, size_t first, size_t k, SizeTVec& part) {
+    if (k == 1 || ids.size() <= 1) {
+      for (auto id : ids) {
+        part[id] = first;
+      }
+      return;
+    }
+    ++regionStamp;
+    for (auto id : ids) {
+      region[id] = regionStamp;
+    }
+    SizeTVec order;
+    bfs_order(ids, ids[0], order);
+    bfs_order(ids, order.back(), order);
+
+    size_t k1 = k / 2;
+    size_t split = ids.size() * k1 / k;
+    SizeTVec left(order.begin(), order.begin() + split);
+    SizeTVec right(order.begin() + split, order.end());
+    std::sort(left.begin(), left.end());
+    std::sort(right.begin(), right.end());
+    bisect(left, first, k1, part);
+    bisect(right, first + k1, k - k1, part);
+  }
+
+  const geom::Tets& tets;
+  SizeTVec region;
+  SizeTVec seen;
+  size_t regionStamp = 0;
+  size_t seenStamp = 0;
+};
+
+
+// refine moves tets on subdomain boundaries to the neighboring subdomain
+// they share most faces with as long as this reduces the number of cut faces
+// and keeps all subdomain sizes within maxImbalance of the mean. Tets are
+// visited in ID order which keeps the result deterministic.
+static void refine(const geom::Tets& tets, size_t numParts, SizeTVec& part) {
+  double mean = double(tets.size()) / numParts;
+  size_t maxSize = size_t(mean * (1.0 + maxImbalance)) + 1;
+  size_t minSize = size_t(mean * (1.0 - maxImbalance));
+  SizeTVec sizes(numParts, 0);
+  for (auto p : part) {
+    ++sizes[p];
+  }
+
+  for (size_t pass = 0; pass < maxRefinePasses; ++pass) {
+    size_t numMoved = 0;
+    for (size_t i = 0; i < tets.size(); ++i) {
+      size_t p = part[i];
+      std::array<size_t, 4> nbParts;
+      size_t numNbs = 0;
+      size_t internal = 0;
+      for (auto nbID : tets[i].t) {
+        if (nbID == geom::Tet::unset) {
+          continue;
+        }
+        if (part[nbID] == p) {
+          ++internal;
+        } else {
+          nbParts[numNbs++] = part[nbID];
+        }
+      }
+
+      size_t best = p;
+      size_t bestCount = internal;
+      for (size_t j = 0; j < numNbs; ++j) {
+        size_t count = std::count(nbParts.begin(), nbParts.begin() + numNbs,
+          nbParts[j]);
+        if (count > bestCount && sizes[nbParts[j]] < maxSize) {
+          best = nbParts[j];
+          bestCount = count;
+        }
+      }
+      if (best != p && sizes[p] > minSize) {
+        part[i] = best;
+        --sizes[p];
+        ++sizes[best];
+        ++numMoved;
+      }
+    }
+    if (numMoved == 0) {
+      break;
+    }
+  }
+}
+
+
+// partition_tets splits tets into numParts subdomains, see header
+Partition partition_tets(const geom::Tets& tets, size_t numParts) {
+  Partition p;
+  p.numParts = std::max<size_t>(1, std::min(numParts, tets.size()));
+  p.part.assign(tets.size(), 0);
+  if (p.numParts > 1) {
+    SizeTVec ids(tets.size());
+    std::iota(ids.begin(), ids.end(), 0);
+    Bisector(tets).bisect(ids, 0, p.numParts, p.part);
+    refine(tets, p.numParts, p.part);
+  }
+  p.cutFaces = count_cut_faces(tets, p.part);
+  return p;
+}
+
+
+// partition_blocks splits tets into numParts blocks of consecutive tet IDs.
+// Block p ends at the first tet at which the prefix sum of the weights
+// reaches p + 1 parts of the total, but never before it holds a tet and
+// never so late that the tets left can't give each remaining block one.
+Partition partition_blocks(const geom::Tets& tets, size_t numParts,
+  const Rvector<uint64_t>& weights) {
+  Partition p;
+  p.numParts = std::max<size_t>(1, std::min(numParts, tets.size()));
+  p.part.assign(tets.size(), 0);
+  uint64_t total = std::accumulate(weights.begin(), weights.end(), uint64_t(0));
+  uint64_t sum = 0;
+  size_t block = 0;
+  for (size_t i = 0; i < tets.size(); ++i) {
+    p.part[i] = block;
+    sum += weights[i];
+    size_t numLeft = tets.size() - i - 1;
+    if (block + 1 < p.numParts && (numLeft == p.numParts - block - 1 ||
+        double(sum) >= double(total) * (block + 1) / p.numParts)) {
+      ++block;
+    }
+  }
+  p.cutFaces = count_cut_faces(tets, p.part);
+  return p;
+}
+
+
+// count_cut_faces returns the number of faces shared by tets assigned to
+// different subdomains by part
+size_t count_cut_faces(const geom::Tets& tets, const SizeTVec& part) {
+  size_t numCut = 0;
+  for (size_t i = 0; i < tets.size(); ++i) {
+    for (auto nbID : tets[i].t) {
+      if (nbID != geom::Tet::unset && nbID > i && part[nbID] != part[i]) {
+        ++numCut;
+      }
+    }
+  }
+  return numCut;
+}
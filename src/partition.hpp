@@ -0,0 +1,37 @@
+// Copyright 2015 Markus Dittrich
+// Licensed under BSD license, see LICENSE file for details
+
+#ifndef PARTITION_HPP
+#define PARTITION_HPP
+
+#include "geometry.hpp"
+#include "util.hpp"
+
+
+// Partition assigns each tet to one of numParts subdomains
+struct Partition {
+  SizeTVec part;          // subdomain of each tet
+  size_t numParts = 0;
+  size_t cutFaces = 0;    // faces shared by tets of different subdomains
+};
+
+// partition_tets splits tets into numParts subdomains of about equal size
+// along the face adjacency of the tets while keeping the number of cut faces
+// small. The subdomains are grown by recursive bisection of a breadth first
+// ordering of the tets and then improved by moving tets on subdomain
+// boundaries to the neighboring subdomain they share most faces with.
+Partition partition_tets(const geom::Tets& tets, size_t numParts);
+
+// partition_blocks splits tets into numParts blocks of consecutive tet IDs
+// with about equal total weight, where weights lists the weight of each tet.
+// numParts is limited to the number of tets and every block holds at least
+// one tet. Blocks are only compact if tets are numbered with spatial locality, e.g.
+// by geom::reorder_tets.
+Partition partition_blocks(const geom::Tets& tets, size_t numParts,
+  const Rvector<uint64_t>& weights);
+
+// count_cut_faces returns the number of faces shared by tets assigned to
+// different subdomains by part
+size_t count_cut_faces(const geom::Tets& tets, const SizeTVec& part);
+
+#endif
@@ -0,0 +1,307 @@
+// Copyright 2015 Markus Dittrich
+// Licensed under BSD license, see LICENSE file for details
+
+#include <algorithm>
+#include <atomic>
+#include <iterator>
+#include <numeric>
+
+#include "placement.hpp"
+#include "rng.hpp"
+
+
+// number of tets handed to a thread at a time
+const size_t tetGrain = 64;
+
+// number of molecules per random stream when choosing tets for a release
+const size_t releaseGrain = 1 << 16;
+
+// stream IDs of the release streams start here to keep them apart from the
+// per tet diffusion and reaction streams. The species ID occupies the bits
+// above releaseSpecShift and releaseTetStreams separates the streams picking
+// tets from the per tet streams picking positions.
+const uint64_t releaseStreamBase = uint64_t(3) << 62;
+const uint64_t releaseSpecShift = 41;
+const uint64_t releaseTetStreams = uint64_t(1) << 40;
+
+
+// AliasTable samples indices 0 .. n-1 with probability proportional to a
+// list of weights in constant time via Walker's alias method as described by
+// Vose, "A linear algorithm for generating random numbers with a given
+// distribution", IEEE Trans. Softw. Eng. 17, 972 (1991).
+class AliasTable {
+
+public:
+
+  explicit AliasTable(const Rvector<double>& weights);
+
+  // sample maps a uniform deviate u in (0, 1] to an index
+  size_t sample(double u) const noexcept {
+    double x = u * prob_.size();
+    size_t i = std::min(size_t(x), prob_.size() - 1);
+    return x - i < prob_[i] ? i : alias_[i];
+  }
+
+private:
+
+  Rvector<double> prob_;
+  SizeTVec alias_;
+};
+
+
+// constructor
+AliasTable::AliasTable(const Rvector<double>& weights)
+  : prob_(weights.size()), alias_(weights.size()) {
+  double sum = std::accumulate(weights.begin(), weights.end(), 0.0);
+  SizeTVec small;
+  SizeTVec large;
+  for (size_t i = 0; i < weights.size(); ++i) {
+    prob_[i] = weights[i] * weights.size() / sum;
+    alias_[i] = i;
+    (prob_[i] < 1.0 ? small : large).push_back(i);
+  }
+  while (!small.empty() && !large.empty()) {
+    size_t s = small.back();
+    size_t l = large.back();
+    small.pop_back();
+    alias_[s] = l;
+    prob_[l] -= 1.0 - prob_[s];
+    if (prob_[l] < 1.0) {
+      large.pop_back();
+      small.push_back(l);
+    }
+  }
+
+  // whatever is left over is at probability 1 up to round off
+  for (auto i : small) {
+    prob_[i] = 1.0;
+  }
+  for (auto i : large) {
+    prob_[i] = 1.0;
+  }
+}
+
+
+// sample_tet returns a uniformly distributed point inside the tet with
+// vertices v using the folding scheme of Rocchini and Cignoni, "Generating
+// random points in a tetrahedron", J. Graph. Tools 5, 9 (2000)
+static geom::Vec3 sample_tet(const std::array<geom::Vec3, 4>& v,
+  RngUniform& rng) {
+  double s = rng.gen();
+  double t = rng.gen();
+  double u = rng.gen();
+  if (s + t > 1.0) {
+    s = 1.0 - s;
+    t = 1.0 - t;
+  }
+  if (t + u > 1.0) {
+    double tmp = u;
+    u = 1.0 - s - t;
+    t = 1.0 - tmp;
+  } else if (s + t + u > 1.0) {
+    double tmp = u;
+    u = s + t + u - 1.0;
+    s = 1.0 - t - tmp;
+  }
+  return v[0] + s * (v[1] - v[0]) + t * (v[2] - v[0]) + u * (v[3] - v[0]);
+}
+
+
+// tet_meshes returns the faces of tet tetID
+static geom::TetMeshes tet_meshes(const State& state, size_t tetID) {
+  const geom::Mesh& mesh = state.mesh();
+  const geom::Tet& tet = state.tets()[tetID];
+  return geom::TetMeshes{&mesh[tet.m[0]], &mesh[tet.m[1]], &mesh[tet.m[2]],
+                         &mesh[tet.m[3]]};
+}
+
+
+// activate_tets adds the sorted list of tets tetIDs to the active tets
+static void activate_tets(State& state, const SizeTVec& tetIDs) {
+  const auto& active = state.active_tets();
+  SizeTVec merged;
+  merged.reserve(active.size() + tetIDs.size());
+  std::set_union(active.begin(), active.end(), tetIDs.begin(), tetIDs.end(),
+    std::back_inserter(merged));
+  state.set_active_tets(std::move(merged));
+}
+
+
+// place_mols adds molecules of species specID with birthday t at the given
+// positions to the tets containing them. The positions are located in
+// parallel, grouped by tet via a counting sort, and then appended to each tet
+// in parallel.
+size_t place_mols(State& state, ThreadPool& pool, size_t specID,
+  const Rvector<geom::Vec3>& positions, double t) {
+  SizeTVec tetIDs = state.locator().locate(positions, pool);
+
+  size_t numTets = state.tets().size();
+  SizeTVec start(numTets + 1, 0);
+  for (auto tetID : tetIDs) {
+    if (tetID != geom::Tet::unset) {
+      ++start[tetID + 1];
+    }
+  }
+  for (size_t i = 1; i < start.size(); ++i) {
+    start[i] += start[i - 1];
+  }
+  SizeTVec order(start.back());
+  SizeTVec fill(start.begin(), start.end() - 1);
+  for (size_t i = 0; i < tetIDs.size(); ++i) {
+    if (tetIDs[i] != geom::Tet::unset) {
+      order[fill[tetIDs[i]]++] = i;
+    }
+  }
+
+  SizeTVec occupied;
+  for (size_t i = 0; i < numTets; ++i) {
+    if (start[i + 1] > start[i]) {
+      occupied.push_back(i);
+    }
+  }
+  pool.parallel_for(occupied.size(), tetGrain, [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i) {
+      size_t tetID = occupied[i];
+      auto meshes = tet_meshes(state, tetID);
+      const auto& bary = state.baryTable()[tetID];
+      auto& mols = state.tetMols(tetID).activeMols[specID];
+      mols.reserve(mols.size() + start[tetID + 1] - start[tetID]);
+      for (size_t k = start[tetID]; k < start[tetID + 1]; ++k) {
+        mols.add(geom::mol_pos(meshes, bary, positions[order[k]]), t);
+      }
+    }
+  });
+  activate_tets(state, occupied);
+  return start.back();
+}
+
+
+// release_mols adds n molecules of species specID at uniformly random
+// positions within tets tetIDs (or the whole mesh). The tet of each molecule
+// is drawn from an alias table over the tet volumes, in chunks of
+// releaseGrain molecules with one random stream each, and only counted.
+// Afterwards all receiving tets are filled in parallel, each drawing its
+// positions from its own stream straight into its storage. The result thus
+// does not depend on the number of threads.
+size_t release_mols(State& state, ThreadPool& pool, size_t specID, size_t n,
+  double t, uint64_t iter, const SizeTVec& tetIDs) {
+  SizeTVec region = tetIDs;
+  if (region.empty()) {
+    region.resize(state.tets().size());
+    std::iota(region.begin(), region.end(), 0);
+  } else {
+    std::sort(region.begin(), region.end());
+    region.erase(std::unique(region.begin(), region.end()), region.end());
+  }
+  if (n == 0 || region.empty()) {
+    return 0;
+  }
+
+  Rvector<double> volumes(region.size());
+  for (size_t i = 0; i < region.size(); ++i) {
+    volumes[i] = state.tet_volumes()[region[i]];
+  }
+  AliasTable alias(volumes);
+
+  uint64_t streamBase = releaseStreamBase + (uint64_t(specID) << releaseSpecShift);
+  Rvector<std::atomic<size_t>> counts(region.size());
+  size_t numChunks = (n + releaseGrain - 1) / releaseGrain;
+  pool.parallel_for(numChunks, 1, [&](size_t begin, size_t end) {
+    for (size_t c = begin; c < end; ++c) {
+      RngUniform rng(state.seed(), iter, streamBase + c);
+      size_t m = std::min(releaseGrain, n - c * releaseGrain);
+      for (size_t k = 0; k < m; ++k) {
+        counts[alias.sample(rng.gen())].fetch_add(1, std::memory_order_relaxed);
+      }
+    }
+  });
+
+  SizeTVec occupied;
+  for (size_t i = 0; i < region.size(); ++i) {
+    if (counts[i] > 0) {
+      occupied.push_back(i);
+    }
+  }
+  pool.parallel_for(occupied.size(), tetGrain, [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i) {
+      size_t tetID = region[occupied[i]];
+      auto meshes = tet_meshes(state, tetID);
+      const auto& bary = state.baryTable()[tetID];
+      auto verts = geom::tet_vertices(meshes);
+      RngUniform rng(state.seed(), iter, streamBase + releaseTetStreams + tetID);
+      auto& mols = state.tetMols(tetID).activeMols[specID];
+      size_t m = counts[occupied[i]];
+      mols.reserve(mols.size() + m);
+      for (size_t k = 0; k < m; ++k) {
+        mols.add(geom::mol_pos(meshes, bary, sample_tet(verts, rng)), t);
+      }
+    }
+  });
+
+  for (auto& i : occupied) {
+    i = region[i];
+  }
+  activate_tets(state, occupied);
+  return n;
+}
+
+
+// rehome_mols moves all active molecules whose position is not inside their
+// tet to the tet containing it. Misplaced molecules are found and removed from
+// all active tets in parallel and then added to their new tets in tet order.
+size_t rehome_mols(State& state, ThreadPool& pool) {
+
+  // Move describes a molecule changing tets
+  struct Move {
+    size_t tetID;
+    size_t specID;
+    MolVec3 pos;
+    MolVec3 dispRem;
+    double t;
+    uint8_t flags;
+  };
+
+  const SizeTVec& active = state.active_tets();
+  Rvector<Rvector<Move>> moves(active.size());
+  pool.parallel_for(active.size(), tetGrain, [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i) {
+      size_t tetID = active[i];
+      auto& species = state.tetMols(tetID).activeMols;
+      for (size_t s = 0; s < species.size(); ++s) {
+        auto& mols = species[s];
+        bool hasMoved = false;
+        for (size_t k = 0; k < mols.size(); ++k) {
+          size_t newID = state.locator().locate(geom::Vec3(mols.pos[k]), tetID);
+          if (newID == tetID) {
+            continue;
+          }
+          moves[i].push_back(Move{newID, s, mols.pos[k], mols.dispRem[k],
+            mols.t[k], mols.flags[k]});
+          mols.flags[k] |= molFlags::dead;
+          hasMoved = true;
+        }
+        if (hasMoved) {
+          mols.compact();
+        }
+      }
+    }
+  });
+
+  SizeTVec newTets;
+  size_t numMoved = 0;
+  for (const auto& tetMoves : moves) {
+    for (const auto& m : tetMoves) {
+      ++numMoved;
+      if (m.tetID == geom::Tet::unset) {
+        continue;
+      }
+      state.tetMols(m.tetID).activeMols[m.specID].add(m.pos, m.t, m.dispRem,
+        m.flags);
+      newTets.push_back(m.tetID);
+    }
+  }
+  std::sort(newTets.begin(), newTets.end());
+  newTets.erase(std::unique(newTets.begin(), newTets.end()), newTets.end());
+  activate_tets(state, newTets);
+  return numMoved;
+}
@@ -0,0 +1,34 @@
+// Copyright 2015 Markus Dittrich
+// Licensed under BSD license, see LICENSE file for details
+
+#ifndef PLACEMENT_HPP
+#define PLACEMENT_HPP
+
+#include "state.hpp"
+#include "thread_pool.hpp"
+#include "util.hpp"
+#include "vector.hpp"
+
+
+// place_mols adds molecules of species specID with birthday t at the given
+// positions to the tets containing them. Positions outside of the mesh are
+// skipped. Returns the number of molecules placed.
+size_t place_mols(State& state, ThreadPool& pool, size_t specID,
+  const Rvector<geom::Vec3>& positions, double t);
+
+// release_mols adds n molecules of species specID with birthday t at
+// uniformly random positions within the tets tetIDs, or within the whole mesh
+// if tetIDs is empty. Each tet thus receives molecules in proportion to its
+// volume. The positions are drawn from random streams determined by the
+// seed of state, iter, and specID, i.e. releases of the same species during
+// the same iteration have to use disjoint tets. Returns the number of
+// molecules released.
+size_t release_mols(State& state, ThreadPool& pool, size_t specID, size_t n,
+  double t, uint64_t iter, const SizeTVec& tetIDs = SizeTVec());
+
+// rehome_mols moves all active molecules whose position is not inside their
+// tet to the tet containing it; molecules outside of the mesh are removed.
+// Returns the number of molecules moved or removed.
+size_t rehome_mols(State& state, ThreadPool& pool);
+
+#endif
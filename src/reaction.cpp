@@ -0,0 +1,362 @@
+// Copyright 2015 Markus Dittrich
+// Licensed under BSD license, see LICENSE file for details
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include "reaction.hpp"
+#include "rng.hpp"
+
+
+// number of tets handed to a thread at a time
+const size_t tetGrain = 16;
+
+// stream IDs of the per tet reaction streams start here to keep them apart
+// from the per tet diffusion streams
+const uint64_t reactionStreamBase = uint64_t(1) << 63;
+
+// partners of tets with at most this many reactive molecules (including those
+// in neighboring tets) are searched by brute force, otherwise via bins
+const size_t maxBruteForceMols = 32;
+
+// maximum number of bins per dimension used for partner search in a tet
+const size_t maxBinsPerDim = 32;
+
+
+// ReactionTable lists the reactions between each pair of species
+class ReactionTable {
+
+public:
+
+  ReactionTable(const State& state);
+
+  // get returns the IDs of all reactions between species s1 and s2
+  const SizeTVec& get(size_t s1, size_t s2) const {
+    return table_[s1 * numSpecies_ + s2];
+  }
+
+  bool reactive(size_t specID) const {
+    return reactive_[specID] != 0;
+  }
+
+  bool empty() const noexcept {
+    return maxRadius_ == 0.0;
+  }
+
+  double max_radius() const noexcept {
+    return maxRadius_;
+  }
+
+private:
+  size_t numSpecies_;
+  Rvector<SizeTVec> table_;
+  Rvector<uint8_t> reactive_;  // species takes part in any reaction
+  double maxRadius_ = 0.0;
+};
+
+
+// constructor
+ReactionTable::ReactionTable(const State& state)
+  : numSpecies_{state.species().size()},
+    table_(numSpecies_ * numSpecies_),
+    reactive_(numSpecies_) {
+  const auto& rxs = state.reactions();
+  for (size_t i = 0; i < rxs.size(); ++i) {
+    size_t s1 = rxs[i].reactant1();
+    size_t s2 = rxs[i].reactant2();
+    table_[s1 * numSpecies_ + s2].push_back(i);
+    if (s1 != s2) {
+      table_[s2 * numSpecies_ + s1].push_back(i);
+    }
+    reactive_[s1] = 1;
+    reactive_[s2] = 1;
+    maxRadius_ = std::max(maxRadius_, rxs[i].radius());
+  }
+}
+
+
+// MolRef references a reactive molecule of a tet or one of its neighbors
+struct MolRef {
+  geom::Vec3 pos;
+  size_t tetID;
+  size_t specID;
+  size_t idx;
+};
+
+
+// Candidate is a pair of molecules within interaction range of each other.
+// Molecule a is located in the tet being searched, molecule b in the same
+// tet (with b > a) or in a neighboring one.
+struct Candidate {
+  size_t a;
+  size_t b;
+  double dist2;
+  double rate;   // sum of the rates of all reactions within range
+};
+
+
+// ReactionEvent records a reaction between two molecules
+struct ReactionEvent {
+  size_t tet1;
+  size_t spec1;
+  size_t idx1;
+  size_t tet2;
+  size_t spec2;
+  size_t idx2;
+  size_t rxID;
+};
+
+
+// SearchBuffers keeps the scratch space for partner searches of a thread
+struct SearchBuffers {
+  SizeTVec nbs;
+  Rvector<MolRef> refs;
+  Rvector<Candidate> cands;
+  SizeTVec binStart;
+  SizeTVec binned;
+};
+
+
+// add_refs appends references to all reactive molecules of tet tetID lying
+// within the box [lo, hi] to refs
+static void add_refs(const State& state, const ReactionTable& rt, size_t tetID,
+  const geom::Vec3& lo, const geom::Vec3& hi, Rvector<MolRef>& refs) {
+  const auto& active = state.tetMols(tetID).activeMols;
+  for (size_t s = 0; s < active.size(); ++s) {
+    if (!rt.reactive(s)) {
+      continue;
+    }
+    const auto& pos = active[s].pos;
+    for (size_t i = 0; i < pos.size(); ++i) {
+      const auto& p = pos[i];
+      if (p.x < lo.x || p.y < lo.y || p.z < lo.z ||
+          p.x > hi.x || p.y > hi.y || p.z > hi.z) {
+        continue;
+      }
+      refs.push_back(MolRef{geom::Vec3(p), tetID, s, i});
+    }
+  }
+}
+
+
+// find_reactions determines the reactions of iteration iter between the
+// molecules of tet tetID and between those and the molecules of tets with a
+// larger ID sharing a vertex with it. Pairs spanning two tets are thus only
+// considered by one of them. The resulting events are appended to events in the order of
+// the candidate pairs which is independent of how candidates were found.
+static void find_reactions(const State& state, const ReactionTable& rt,
+  size_t tetID, uint64_t iter, SearchBuffers& buf,
+  Rvector<ReactionEvent>& events) {
+
+  const double inf = std::numeric_limits<double>::infinity();
+  auto& refs = buf.refs;
+  refs.clear();
+  add_refs(state, rt, tetID, geom::Vec3{-inf, -inf, -inf},
+    geom::Vec3{inf, inf, inf}, refs);
+  size_t numOwn = refs.size();
+  if (numOwn == 0) {
+    return;
+  }
+
+  // molecules of neighbors only matter within the interaction radius of the
+  // bounding box of our own molecules
+  double r = rt.max_radius();
+  geom::Vec3 lo = refs[0].pos;
+  geom::Vec3 hi = refs[0].pos;
+  for (size_t i = 1; i < numOwn; ++i) {
+    const auto& p = refs[i].pos;
+    lo = geom::Vec3{std::min(lo.x, p.x), std::min(lo.y, p.y), std::min(lo.z, p.z)};
+    hi = geom::Vec3{std::max(hi.x, p.x), std::max(hi.y, p.y), std::max(hi.z, p.z)};
+  }
+  lo = lo - geom::Vec3{r, r, r};
+  hi = hi + geom::Vec3{r, r, r};
+  const auto& vm = state.vertex_map();
+  auto& nbs = buf.nbs;
+  nbs.clear();
+  for (auto v : vm.verts[tetID]) {
+    auto end = vm.vertTets.begin() + vm.vertStart[v + 1];
+    nbs.insert(nbs.end(), std::upper_bound(vm.vertTets.begin() + vm.vertStart[v],
+      end, tetID), end);
+  }
+  std::sort(nbs.begin(), nbs.end());
+  nbs.erase(std::unique(nbs.begin(), nbs.end()), nbs.end());
+  for (auto nbID : nbs) {
+    add_refs(state, rt, nbID, lo, hi, refs);
+  }
+
+  auto& cands = buf.cands;
+  cands.clear();
+  const auto& rxs = state.reactions();
+  auto check = [&](size_t a, size_t b) {
+    double d2 = geom::norm2(refs[a].pos - refs[b].pos);
+    if (d2 >= r * r) {
+      return;
+    }
+    double rate = 0.0;
+    for (auto rxID : rt.get(refs[a].specID, refs[b].specID)) {
+      if (d2 < rxs[rxID].radius() * rxs[rxID].radius()) {
+        rate += rxs[rxID].rate();
+      }
+    }
+    if (rate > 0.0) {
+      cands.push_back(Candidate{a, b, d2, rate});
+    }
+  };
+
+  if (refs.size() <= maxBruteForceMols) {
+    for (size_t a = 0; a < numOwn; ++a) {
+      for (size_t b = a + 1; b < refs.size(); ++b) {
+        check(a, b);
+      }
+    }
+  } else {
+    // sort all molecules into bins of at least the interaction radius so
+    // partners can only be located in the same or an adjacent bin
+    geom::Vec3 ext = hi - lo;
+    auto num_bins = [&](double e) {
+      return std::max<size_t>(1, std::min<size_t>(maxBinsPerDim, size_t(e / r)));
+    };
+    size_t nx = num_bins(ext.x);
+    size_t ny = num_bins(ext.y);
+    size_t nz = num_bins(ext.z);
+    auto bin_coord = [](double p, double l, double e, size_t n) {
+      return std::min(n - 1, size_t((p - l) / e * n));
+    };
+    auto bin_of = [&](const geom::Vec3& p, size_t& x, size_t& y, size_t& z) {
+      x = bin_coord(p.x, lo.x, ext.x, nx);
+      y = bin_coord(p.y, lo.y, ext.y, ny);
+      z = bin_coord(p.z, lo.z, ext.z, nz);
+      return (z * ny + y) * nx + x;
+    };
+
+    auto& binStart = buf.binStart;
+    auto& binned = buf.binned;
+    binStart.assign(nx * ny * nz + 1, 0);
+    size_t x, y, z;
+    for (const auto& ref : refs) {
+      ++binStart[bin_of(ref.pos, x, y, z) + 1];
+    }
+    for (size_t i = 1; i < binStart.size(); ++i) {
+      binStart[i] += binStart[i - 1];
+    }
+    binned.resize(refs.size());
+    for (size_t i = 0; i < refs.size(); ++i) {
+      binned[binStart[bin_of(refs[i].pos, x, y, z)]++] = i;
+    }
+    for (size_t i = binStart.size() - 1; i > 0; --i) {
+      binStart[i] = binStart[i - 1];
+    }
+    binStart[0] = 0;
+
+    for (size_t a = 0; a < numOwn; ++a) {
+      bin_of(refs[a].pos, x, y, z);
+      for (size_t bz = z > 0 ? z - 1 : 0; bz <= std::min(z + 1, nz - 1); ++bz) {
+        for (size_t by = y > 0 ? y - 1 : 0; by <= std::min(y + 1, ny - 1); ++by) {
+          for (size_t bx = x > 0 ? x - 1 : 0; bx <= std::min(x + 1, nx - 1); ++bx) {
+            size_t bin = (bz * ny + by) * nx + bx;
+            for (size_t k = binStart[bin]; k < binStart[bin + 1]; ++k) {
+              if (binned[k] > a) {
+                check(a, binned[k]);
+              }
+            }
+          }
+        }
+      }
+    }
+    std::sort(cands.begin(), cands.end(), [](const Candidate& c1, const Candidate& c2) {
+      return c1.a < c2.a || (c1.a == c2.a && c1.b < c2.b);
+    });
+  }
+
+  // decide which candidate pairs react and via which reaction
+  RngUniform rng(state.seed(), iter, reactionStreamBase + tetID);
+  for (const auto& c : cands) {
+    double u = rng.gen();
+    double p = 1.0 - std::exp(-c.rate * state.dt());
+    if (u >= p) {
+      continue;
+    }
+    const auto& ra = refs[c.a];
+    const auto& rb = refs[c.b];
+    size_t rxID = 0;
+    double cum = 0.0;
+    for (auto id : rt.get(ra.specID, rb.specID)) {
+      if (c.dist2 < rxs[id].radius() * rxs[id].radius()) {
+        rxID = id;
+        cum += rxs[id].rate() / c.rate * p;
+        if (u < cum) {
+          break;
+        }
+      }
+    }
+    events.push_back(ReactionEvent{ra.tetID, ra.specID, ra.idx,
+      rb.tetID, rb.specID, rb.idx, rxID});
+  }
+}
+
+
+// react carries out the bimolecular reactions of iteration iter between the
+// active molecules of the tets in tetIDs. Candidate reactions are determined
+// for all tets concurrently and then applied in tet order, skipping events
+// involving a molecule which already reacted. The result is thus independent
+// of the number of threads.
+size_t react(State& state, ThreadPool& pool, const SizeTVec& tetIDs,
+  uint64_t iter) {
+  ReactionTable rt(state);
+  if (rt.empty()) {
+    return 0;
+  }
+
+  Rvector<Rvector<ReactionEvent>> events(tetIDs.size());
+  pool.parallel_for(tetIDs.size(), tetGrain, [&](size_t begin, size_t end) {
+    static thread_local SearchBuffers buf;
+    for (size_t i = begin; i < end; ++i) {
+      find_reactions(state, rt, tetIDs[i], iter, buf, events[i]);
+    }
+  });
+
+  // apply reactions and collect products
+  struct Product {
+    size_t tetID;
+    size_t specID;
+    MolVec3 pos;
+  };
+  Rvector<Product> products;
+  SizeTVec touched;
+  size_t numReactions = 0;
+  for (const auto& tetEvents : events) {
+    for (const auto& ev : tetEvents) {
+      auto& mols1 = state.tetMols(ev.tet1).activeMols[ev.spec1];
+      auto& mols2 = state.tetMols(ev.tet2).activeMols[ev.spec2];
+      if ((mols1.flags[ev.idx1] & molFlags::dead) ||
+          (mols2.flags[ev.idx2] & molFlags::dead)) {
+        continue;
+      }
+      mols1.flags[ev.idx1] |= molFlags::dead;
+      mols2.flags[ev.idx2] |= molFlags::dead;
+      for (auto specID : state.reactions()[ev.rxID].products()) {
+        products.push_back(Product{ev.tet1, specID, mols1.pos[ev.idx1]});
+      }
+      touched.push_back(ev.tet1);
+      touched.push_back(ev.tet2);
+      ++numReactions;
+    }
+  }
+
+  // remove reactants, then add products
+  std::sort(touched.begin(), touched.end());
+  touched.erase(std::unique(touched.begin(), touched.end()), touched.end());
+  pool.parallel_for(touched.size(), tetGrain, [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i) {
+      for (auto& mols : state.tetMols(touched[i]).activeMols) {
+        mols.compact();
+      }
+    }
+  });
+  double t = iter * state.dt();
+  for (const auto& p : products) {
+    state.tetMols(p.tetID).activeMols.add(p.specID, p.pos, t);
+  }
+  return numReactions;
+}
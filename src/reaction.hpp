@@ -0,0 +1,23 @@
+// Copyright 2015 Markus Dittrich
+// Licensed under BSD license, see LICENSE file for details
+
+#ifndef REACTION_HPP
+#define REACTION_HPP
+
+#include <cstdint>
+
+#include "state.hpp"
+#include "thread_pool.hpp"
+#include "util.hpp"
+
+
+// react carries out the bimolecular reactions of iteration iter between the
+// active molecules of the tets in tetIDs, which has to include all tets
+// holding molecules. Reaction partners are searched within each tet and all
+// tets sharing a vertex with it. Each molecule takes part in at most one reaction
+// per iteration; products are placed at the position of the first reactant.
+// Returns the number of reactions that took place.
+size_t react(State& state, ThreadPool& pool, const SizeTVec& tetIDs,
+  uint64_t iter);
+
+#endif
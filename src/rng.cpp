@@ -1,9 +1,304 @@
 // Copyright 2015 Markus Dittrich
 // Licensed under BSD license, see LICENSE file for details
 
+#include <cmath>
+#include <cstring>
+#include <limits>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define RNG_HAVE_AVX2_KERNEL 1
+#endif
+
 #include "rng.hpp"
 
 
-// constructor generating a uniform gaussian distribution
-RngNorm::RngNorm(uint64_t seed) : seedVal_{seed}, mt_gen_{seed},
-  rng_norm_{0.0, 1.0} {}
+// stream ID of the serial stream handed out by RngNorm(seed)
+const uint64_t serialStream = std::numeric_limits<uint64_t>::max();
+
+
+// constructor for the serial stream of a simulation seeded with seed
+RngNorm::RngNorm(uint64_t seed) : RngNorm(seed, 0, serialStream) {}
+
+
+// constructor for the independent stream with ID stream during iteration iter
+// of a simulation seeded with seed. The seed and the upper bits of iter make
+// up the Philox key, the stream ID and the lower bits of iter the counter.
+// The remaining counter word enumerates the blocks within a stream.
+RngNorm::RngNorm(uint64_t seed, uint64_t iter, uint64_t stream)
+  : key_{{uint32_t(seed), uint32_t(seed >> 32) ^ uint32_t(iter >> 32)}},
+    ctr_{{0, uint32_t(iter), uint32_t(stream), uint32_t(stream >> 32)}} {}
+
+
+// The Box-Muller transform below is written in terms of plain additions,
+// multiplications, divisions and square roots only, with the same operation
+// order in the scalar and the AVX2 kernel. Since these are all correctly
+// rounded both kernels produce bit identical results.
+
+// coefficients of 2 * atanh(s) / s = 2 * sum_k s^2k / (2k + 1), truncated
+// after s^18. This is accurate to double precision for |s| < 0.172.
+const double logCoeffs[] = {2.0/19, 2.0/17, 2.0/15, 2.0/13, 2.0/11, 2.0/9,
+                            2.0/7,  2.0/5,  2.0/3,  2.0};
+const double ln2 = 0.6931471805599453094;
+
+// coefficients of the Taylor series of sin(x) / x and cos(x), accurate to
+// double precision for |x| < pi/4.
+const double sinCoeffs[] = {-1.0/1307674368000, 1.0/6227020800,
+                            -1.0/39916800, 1.0/362880, -1.0/5040, 1.0/120,
+                            -1.0/6, 1.0};
+const double cosCoeffs[] = {1.0/20922789888000, -1.0/87178291200,
+                            1.0/479001600, -1.0/3628800, 1.0/40320,
+                            -1.0/720, 1.0/24, -0.5, 1.0};
+
+const double twoPi = 6.283185307179586477;
+const double sqrt2 = 1.4142135623730950488;
+const uint64_t expOne = 0x3ff0000000000000ull;      // bit pattern of 1.0
+const uint64_t mantMask = 0x000fffffffffffffull;
+const double twoPow52 = 4503599627370496.0;         // 2^52
+const uint64_t twoPow52Bits = 0x4330000000000000ull;
+
+
+// bits_to_double reinterprets b as a double
+static inline double bits_to_double(uint64_t b) {
+  double d;
+  memcpy(&d, &b, sizeof(d));
+  return d;
+}
+
+
+// u01 converts the upper 52 bits of hi:lo into a uniform double in (0, 1]
+static inline double u01(uint32_t hi, uint32_t lo) {
+  uint64_t bits = (uint64_t(hi) << 32 | lo) >> 12;
+  return 2.0 - bits_to_double(bits | expOne);
+}
+
+
+// box_muller turns two uniforms u1, u2 in (0, 1] into two normal deviates
+static inline void box_muller(double u1, double u2, double& z0, double& z1) {
+  // log(u1) = e * ln2 + log(m) with m in [sqrt(2)/2, sqrt(2))
+  uint64_t bits;
+  memcpy(&bits, &u1, sizeof(bits));
+  double e = bits_to_double((bits >> 52) | twoPow52Bits) - twoPow52 - 1023.0;
+  double m = bits_to_double((bits & mantMask) | expOne);
+  if (m > sqrt2) {
+    m = m * 0.5;
+    e = e + 1.0;
+  }
+  double s = (m - 1.0) / (m + 1.0);
+  double s2 = s * s;
+  double p = logCoeffs[0];
+  for (size_t i = 1; i < 10; ++i) {
+    p = p * s2 + logCoeffs[i];
+  }
+  double lg = e * ln2 + s * p;
+  double rad = sqrt(-2.0 * lg);
+
+  // 2 pi u2 = theta + q pi/2 with theta in [-pi/4, pi/4]
+  double q = nearbyint(4.0 * u2);
+  double theta = (u2 - 0.25 * q) * twoPi;
+  double t2 = theta * theta;
+  double sn = sinCoeffs[0];
+  for (size_t i = 1; i < 8; ++i) {
+    sn = sn * t2 + sinCoeffs[i];
+  }
+  sn = sn * theta;
+  double cs = cosCoeffs[0];
+  for (size_t i = 1; i < 9; ++i) {
+    cs = cs * t2 + cosCoeffs[i];
+  }
+
+  double c = cs;
+  double sv = sn;
+  if (q == 1.0) {
+    c = -sn;
+    sv = cs;
+  } else if (q == 2.0) {
+    c = -cs;
+    sv = -sn;
+  } else if (q == 3.0) {
+    c = sn;
+    sv = -cs;
+  }
+  z0 = rad * c;
+  z1 = rad * sv;
+}
+
+
+// normal_blocks_scalar writes the two normal deviates of each of the
+// numBlocks Philox blocks starting at ctr to out
+static void normal_blocks_scalar(const Philox4x32::Key& key,
+  Philox4x32::Counter ctr, size_t numBlocks, double* out) {
+  for (size_t i = 0; i < numBlocks; ++i) {
+    auto r = Philox4x32::apply(ctr, key);
+    ++ctr[0];
+    box_muller(u01(r[0], r[1]), u01(r[2], r[3]), out[2*i], out[2*i+1]);
+  }
+}
+
+
+#ifdef RNG_HAVE_AVX2_KERNEL
+
+// AVX2 version of normal_blocks_scalar processing four blocks at a time. Each
+// 32 bit Philox word lives in the low half of a 64 bit lane so the 32 x 32 ->
+// 64 bit multiplies map onto _mm256_mul_epu32.
+__attribute__((target("avx2")))
+static void normal_blocks_avx2(const Philox4x32::Key& key,
+  Philox4x32::Counter ctr, size_t numBlocks, double* out) {
+
+  const __m256i lo32 = _mm256_set1_epi64x(0xffffffffll);
+  const __m256i m0 = _mm256_set1_epi64x(0xD2511F53);
+  const __m256i m1 = _mm256_set1_epi64x(0xCD9E8D57);
+  const __m256i one = _mm256_set1_epi64x(expOne);
+  const __m256i mant = _mm256_set1_epi64x(mantMask);
+  const __m256i magic = _mm256_set1_epi64x(twoPow52Bits);
+  const __m256d two = _mm256_set1_pd(2.0);
+
+  size_t i = 0;
+  for (; i + 4 <= numBlocks; i += 4) {
+    __m256i c0 = _mm256_set_epi64x(uint32_t(ctr[0] + 3), uint32_t(ctr[0] + 2),
+                                   uint32_t(ctr[0] + 1), ctr[0]);
+    __m256i c1 = _mm256_set1_epi64x(ctr[1]);
+    __m256i c2 = _mm256_set1_epi64x(ctr[2]);
+    __m256i c3 = _mm256_set1_epi64x(ctr[3]);
+    Philox4x32::Key k = key;
+    for (int r = 0; r < 10; ++r) {
+      __m256i p0 = _mm256_mul_epu32(m0, c0);
+      __m256i p1 = _mm256_mul_epu32(m1, c2);
+      __m256i k0 = _mm256_set1_epi64x(k[0]);
+      __m256i k1 = _mm256_set1_epi64x(k[1]);
+      c0 = _mm256_xor_si256(_mm256_xor_si256(_mm256_srli_epi64(p1, 32), c1), k0);
+      c1 = _mm256_and_si256(p1, lo32);
+      c2 = _mm256_xor_si256(_mm256_xor_si256(_mm256_srli_epi64(p0, 32), c3), k1);
+      c3 = _mm256_and_si256(p0, lo32);
+      k[0] += 0x9E3779B9;
+      k[1] += 0xBB67AE85;
+    }
+    ctr[0] += 4;
+
+    // uniforms in (0, 1]
+    __m256i b1 = _mm256_srli_epi64(_mm256_or_si256(_mm256_slli_epi64(c0, 32), c1), 12);
+    __m256i b2 = _mm256_srli_epi64(_mm256_or_si256(_mm256_slli_epi64(c2, 32), c3), 12);
+    __m256d u1 = _mm256_sub_pd(two, _mm256_castsi256_pd(_mm256_or_si256(b1, one)));
+    __m256d u2 = _mm256_sub_pd(two, _mm256_castsi256_pd(_mm256_or_si256(b2, one)));
+
+    // log(u1)
+    __m256i bits = _mm256_castpd_si256(u1);
+    __m256d e = _mm256_sub_pd(_mm256_sub_pd(
+      _mm256_castsi256_pd(_mm256_or_si256(_mm256_srli_epi64(bits, 52), magic)),
+      _mm256_set1_pd(twoPow52)), _mm256_set1_pd(1023.0));
+    __m256d m = _mm256_castsi256_pd(_mm256_or_si256(_mm256_and_si256(bits, mant), one));
+    __m256d big = _mm256_cmp_pd(m, _mm256_set1_pd(sqrt2), _CMP_GT_OQ);
+    m = _mm256_blendv_pd(m, _mm256_mul_pd(m, _mm256_set1_pd(0.5)), big);
+    e = _mm256_blendv_pd(e, _mm256_add_pd(e, _mm256_set1_pd(1.0)), big);
+    __m256d s = _mm256_div_pd(_mm256_sub_pd(m, _mm256_set1_pd(1.0)),
+                              _mm256_add_pd(m, _mm256_set1_pd(1.0)));
+    __m256d s2 = _mm256_mul_pd(s, s);
+    __m256d p = _mm256_set1_pd(logCoeffs[0]);
+    for (size_t j = 1; j < 10; ++j) {
+      p = _mm256_add_pd(_mm256_mul_pd(p, s2), _mm256_set1_pd(logCoeffs[j]));
+    }
+    __m256d lg = _mm256_add_pd(_mm256_mul_pd(e, _mm256_set1_pd(ln2)),
+                               _mm256_mul_pd(s, p));
+    __m256d rad = _mm256_sqrt_pd(_mm256_mul_pd(_mm256_set1_pd(-2.0), lg));
+
+    // sin(2 pi u2) and cos(2 pi u2)
+    __m256d q = _mm256_round_pd(_mm256_mul_pd(_mm256_set1_pd(4.0), u2),
+                                _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    __m256d theta = _mm256_mul_pd(
+      _mm256_sub_pd(u2, _mm256_mul_pd(_mm256_set1_pd(0.25), q)),
+      _mm256_set1_pd(twoPi));
+    __m256d t2 = _mm256_mul_pd(theta, theta);
+    __m256d sn = _mm256_set1_pd(sinCoeffs[0]);
+    for (size_t j = 1; j < 8; ++j) {
+      sn = _mm256_add_pd(_mm256_mul_pd(sn, t2), _mm256_set1_pd(sinCoeffs[j]));
+    }
+    sn = _mm256_mul_pd(sn, theta);
+    __m256d cs = _mm256_set1_pd(cosCoeffs[0]);
+    for (size_t j = 1; j < 9; ++j) {
+      cs = _mm256_add_pd(_mm256_mul_pd(cs, t2), _mm256_set1_pd(cosCoeffs[j]));
+    }
+    __m256d nsn = _mm256_sub_pd(_mm256_setzero_pd(), sn);
+    __m256d ncs = _mm256_sub_pd(_mm256_setzero_pd(), cs);
+    __m256d q1 = _mm256_cmp_pd(q, _mm256_set1_pd(1.0), _CMP_EQ_OQ);
+    __m256d q2 = _mm256_cmp_pd(q, _mm256_set1_pd(2.0), _CMP_EQ_OQ);
+    __m256d q3 = _mm256_cmp_pd(q, _mm256_set1_pd(3.0), _CMP_EQ_OQ);
+    __m256d c = _mm256_blendv_pd(_mm256_blendv_pd(_mm256_blendv_pd(cs, nsn, q1),
+                                                  ncs, q2), sn, q3);
+    __m256d sv = _mm256_blendv_pd(_mm256_blendv_pd(_mm256_blendv_pd(sn, cs, q1),
+                                                   nsn, q2), ncs, q3);
+    __m256d z0 = _mm256_mul_pd(rad, c);
+    __m256d z1 = _mm256_mul_pd(rad, sv);
+
+    // interleave into z0_0, z1_0, z0_1, z1_1, ...
+    __m256d lo = _mm256_unpacklo_pd(z0, z1);
+    __m256d hi = _mm256_unpackhi_pd(z0, z1);
+    _mm256_storeu_pd(out + 2*i, _mm256_permute2f128_pd(lo, hi, 0x20));
+    _mm256_storeu_pd(out + 2*i + 4, _mm256_permute2f128_pd(lo, hi, 0x31));
+  }
+  normal_blocks_scalar(key, ctr, numBlocks - i, out + 2*i);
+}
+
+
+// have_avx2 checks once whether the CPU we're running on supports AVX2
+static bool have_avx2() {
+  static const bool avx2 = __builtin_cpu_supports("avx2");
+  return avx2;
+}
+
+#endif
+
+
+// normal_blocks dispatches to the fastest kernel supported by the CPU
+static void normal_blocks(const Philox4x32::Key& key,
+  const Philox4x32::Counter& ctr, size_t numBlocks, double* out) {
+#ifdef RNG_HAVE_AVX2_KERNEL
+  if (have_avx2()) {
+    normal_blocks_avx2(key, ctr, numBlocks, out);
+    return;
+  }
+#endif
+  normal_blocks_scalar(key, ctr, numBlocks, out);
+}
+
+
+// next_pair generates two normal deviates from the next Philox block
+void RngNorm::next_pair(double& z0, double& z1) {
+  auto r = Philox4x32::apply(ctr_, key_);
+  ++ctr_[0];
+  box_muller(u01(r[0], r[1]), u01(r[2], r[3]), z0, z1);
+}
+
+
+// gen fills out with the next n normal deviates of the stream
+void RngNorm::gen(double* out, size_t n) {
+  if (n == 0) {
+    return;
+  }
+  if (haveSpare_) {
+    *out++ = spare_;
+    haveSpare_ = false;
+    --n;
+  }
+  size_t numBlocks = n / 2;
+  normal_blocks(key_, ctr_, numBlocks, out);
+  ctr_[0] += numBlocks;
+  if (n % 2 == 1) {
+    out[n - 1] = gen();
+  }
+}
+
+
+// constructor for the independent uniform stream with ID stream during
+// iteration iter of a simulation seeded with seed
+RngUniform::RngUniform(uint64_t seed, uint64_t iter, uint64_t stream)
+  : key_{{uint32_t(seed), uint32_t(seed >> 32) ^ uint32_t(iter >> 32)}},
+    ctr_{{0, uint32_t(iter), uint32_t(stream), uint32_t(stream >> 32)}} {}
+
+
+// next_pair generates two uniform deviates from the next Philox block
+void RngUniform::next_pair(double& u0, double& u1) {
+  auto r = Philox4x32::apply(ctr_, key_);
+  ++ctr_[0];
+  u0 = u01(r[0], r[1]);
+  u1 = u01(r[2], r[3]);
+}
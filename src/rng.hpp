@@ -4,28 +4,136 @@
 #ifndef RNG_HPP
 #define RNG_HPP
 
+#include <array>
+#include <cstddef>
 #include <cstdint>
-#include <random>
 
 
-// Normal distributed random numbers using Mersenne-Twister (mt19937) as
-// underlying random number source
+// Philox4x32 is the counter-based Philox4x32-10 generator of Salmon et al.,
+// "Parallel Random Numbers: As Easy as 1, 2, 3" (SC11). It maps a 128 bit
+// counter and a 64 bit key to 128 random bits without any internal state,
+// i.e. every (key, counter) pair can be evaluated independently.
+class Philox4x32 {
+
+public:
+  using Counter = std::array<uint32_t, 4>;
+  using Key = std::array<uint32_t, 2>;
+
+  static Counter apply(Counter ctr, Key key) noexcept {
+    for (int i = 0; i < 10; ++i) {
+      ctr = round(ctr, key);
+      key[0] += 0x9E3779B9;
+      key[1] += 0xBB67AE85;
+    }
+    return ctr;
+  }
+
+private:
+  static Counter round(const Counter& c, const Key& k) noexcept {
+    uint64_t p0 = uint64_t(0xD2511F53) * c[0];
+    uint64_t p1 = uint64_t(0xCD9E8D57) * c[2];
+    return Counter{{uint32_t(p1 >> 32) ^ c[1] ^ k[0], uint32_t(p1),
+                    uint32_t(p0 >> 32) ^ c[3] ^ k[1], uint32_t(p0)}};
+  }
+};
+
+
+// Normal distributed random numbers using the counter-based Philox4x32-10
+// as underlying random number source. Each RngNorm is an independent stream
+// identified by (seed, iter, stream); the generator state consists of just
+// this key and a block counter so streams are cheap to create and fully
+// reproducible regardless of which thread draws from them and in which
+// order. Uniforms are turned into normal deviates via Box-Muller.
+// Successive calls to gen() and gen(out, n) consume the same stream, i.e.
+// drawing n numbers in one batch yields the same values as n single draws.
 class RngNorm {
 
 public:
   RngNorm(uint64_t seed);
 
+  // constructor for the independent stream with ID stream during iteration
+  // iter of a simulation seeded with seed
+  RngNorm(uint64_t seed, uint64_t iter, uint64_t stream);
+
   double gen() {
-    return rng_norm_(mt_gen_);
+    if (haveSpare_) {
+      haveSpare_ = false;
+      return spare_;
+    }
+    double z0, z1;
+    next_pair(z0, z1);
+    spare_ = z1;
+    haveSpare_ = true;
+    return z0;
+  }
+
+  // gen fills out with the next n normal deviates of the stream. Whole
+  // Philox blocks are processed by a SIMD kernel if the CPU supports AVX2
+  // and by a scalar kernel otherwise; both produce identical results.
+  void gen(double* out, size_t n);
+
+  // Snapshot captures the complete generator state so a stream can be saved
+  // (e.g. in a checkpoint) and later resumed exactly where it left off
+  struct Snapshot {
+    Philox4x32::Key key;
+    Philox4x32::Counter ctr;
+    double spare;
+    uint32_t haveSpare;
+  };
+
+  Snapshot snapshot() const noexcept {
+    return Snapshot{key_, ctr_, spare_, haveSpare_};
+  }
+
+  void restore(const Snapshot& s) noexcept {
+    key_ = s.key;
+    ctr_ = s.ctr;
+    spare_ = s.spare;
+    haveSpare_ = s.haveSpare != 0;
   }
 
 private:
 
-  uint64_t seedVal_;
-  std::mt19937 mt_gen_;
-  std::normal_distribution<double> rng_norm_;
+  // next_pair generates two normal deviates from the next Philox block
+  void next_pair(double& z0, double& z1);
+
+  Philox4x32::Key key_;
+  Philox4x32::Counter ctr_;
+  double spare_ = 0.0;
+  bool haveSpare_ = false;
 };
 
 
+// Uniformly distributed random numbers in (0, 1] using Philox4x32-10 as
+// underlying random number source. Streams are identified by (seed, iter,
+// stream) exactly as for RngNorm; callers drawing both normal and uniform
+// deviates for the same entity have to use distinct stream IDs.
+class RngUniform {
+
+public:
+  RngUniform(uint64_t seed, uint64_t iter, uint64_t stream);
+
+  double gen() {
+    if (haveSpare_) {
+      haveSpare_ = false;
+      return spare_;
+    }
+    double u0;
+    next_pair(u0, spare_);
+    haveSpare_ = true;
+    return u0;
+  }
+
+private:
+
+  // next_pair generates two uniform deviates from the next Philox block
+  void next_pair(double& u0, double& u1);
+
+  Philox4x32::Key key_;
+  Philox4x32::Counter ctr_;
+  double spare_ = 0.0;
+  bool haveSpare_ = false;
+};
+
 
 #endif
@@ -5,6 +5,7 @@
 #define SPECIES_HPP
 
 #include <string>
+#include <utility>
 
 #include "util.hpp"
 
@@ -32,4 +33,52 @@ private:
 using SpeciesContainer = Rvector<MolSpecies>;
 
 
+// BimolReaction describes a bimolecular volume reaction
+//
+//   reactant1 + reactant2 -> products
+//
+// between species identified by their species IDs. Reactions follow the Doi
+// model: a pair of reactant molecules closer than the interaction radius
+// reacts with the microscopic rate (in 1/s), i.e. with probability
+// 1 - exp(-rate * dt) per iteration.
+class BimolReaction {
+
+public:
+
+  BimolReaction(size_t reactant1, size_t reactant2, SizeTVec products,
+    double rate, double radius)
+    : reactant1_{reactant1}, reactant2_{reactant2},
+      products_{std::move(products)}, rate_{rate}, radius_{radius} {}
+
+  size_t reactant1() const {
+    return reactant1_;
+  }
+
+  size_t reactant2() const {
+    return reactant2_;
+  }
+
+  const SizeTVec& products() const {
+    return products_;
+  }
+
+  double rate() const {
+    return rate_;
+  }
+
+  double radius() const {
+    return radius_;
+  }
+
+private:
+  size_t reactant1_;
+  size_t reactant2_;
+  SizeTVec products_;   // species IDs of the reaction products
+  double rate_;         // microscopic reaction rate
+  double radius_;       // interaction radius
+};
+
+using ReactionContainer = Rvector<BimolReaction>;
+
+
 #endif
@@ -3,20 +3,199 @@
 
 #include <algorithm>
 #include <cassert>
+#include <limits>
+#include <string>
+#include <utility>
 
 #include "state.hpp"
 
+// parse_collision_mode returns the CollisionMode called name
+std::tuple<CollisionMode, Error> parse_collision_mode(const std::string& name) {
+  if (name == "intersect") {
+    return std::make_tuple(CollisionMode::intersect, noErr);
+  } else if (name == "barycentric") {
+    return std::make_tuple(CollisionMode::barycentric, noErr);
+  } else if (name == "exhaustive") {
+    return std::make_tuple(CollisionMode::exhaustive, noErr);
+  }
+  return std::make_tuple(CollisionMode::barycentric,
+    Error{"unknown collision mode " + name});
+}
+
+
 // constructor
-State::State(double dt, uint64_t seed) : dt_{dt}, rng_{seed} {}
+State::State(double dt, uint64_t seed) : dt_{dt}, seed_{seed}, rng_{seed} {}
+
+
+// swap exchanges all members of this state and s
+void State::swap(State& s) {
+  using std::swap;
+  swap(dt_, s.dt_);
+  swap(seed_, s.seed_);
+  swap(rng_, s.rng_);
+  swap(mesh_, s.mesh_);
+  swap(tets_, s.tets_);
+  swap(origTetIDs_, s.origTetIDs_);
+  swap(tetIDs_, s.tetIDs_);
+  swap(tetProps_, s.tetProps_);
+  swap(hitTable_, s.hitTable_);
+  swap(baryTable_, s.baryTable_);
+  swap(planeTable_, s.planeTable_);
+  swap(tetVolumes_, s.tetVolumes_);
+  swap(minInradius_, s.minInradius_);
+  swap(locator_, s.locator_);
+  swap(vertexMap_, s.vertexMap_);
+  swap(collisionMode_, s.collisionMode_);
+  swap(tetMolStates_, s.tetMolStates_);
+  swap(activeTets_, s.activeTets_);
+  swap(species_, s.species_);
+  swap(reactions_, s.reactions_);
+
+  // the locators refer to the bary tables themselves rather than their content
+  locator_.rebind(baryTable_);
+  s.locator_.rebind(s.baryTable_);
+}
 
 
 // add_geometry adds the model geometry to the state. The model geometry is
 // defined by a list of tets (which define the topology) and a mesh which
 // keeps track of all the triangles making up the tets.
-void State::add_geometry(const geom::Mesh& mesh, const geom::Tets& tets) {
+void State::add_geometry(const geom::Mesh& mesh, const geom::Tets& tets,
+  bool reorder) {
   mesh_ = mesh;
   tets_ = tets;
+  set_orig_tet_ids(reorder ? geom::reorder_tets(mesh_, tets_) : SizeTVec());
+
+  // faces on the outer boundary of the model have no neighboring tet to hand
+  // molecules to and are thus reflective unless they were made absorptive,
+  // e.g. by set_mesh_props before a checkpoint was taken
+  for (const auto& tet : tets_) {
+    for (size_t i = 0; i < tet.t.size(); ++i) {
+      auto& m = mesh_[tet.m[i]];
+      if (tet.t[i] == geom::Tet::unset && m.prop != geom::MeshProp::absorptive) {
+        m.prop = geom::MeshProp::reflective;
+        m.passProb = 0.0;
+      }
+    }
+  }
+
+  update_tet_props();
+
+  // precompute face data for collision detection
+  hitTable_ = geom::create_hit_table(mesh_, tets_);
+  baryTable_ = geom::create_bary_table(mesh_, tets_);
+  planeTable_ = geom::create_plane_table(baryTable_);
+  locator_ = geom::TetLocator(mesh_, tets_, baryTable_);
+  vertexMap_ = geom::create_vertex_map(mesh_, tets_);
+
+  // the inradius of a tet is three times its volume over its surface area
+  tetVolumes_.clear();
+  tetVolumes_.reserve(tets_.size());
+  minInradius_ = std::numeric_limits<double>::infinity();
+  for (const auto& tet : tets_) {
+    tetVolumes_.push_back(geom::tet_volume({{&mesh_[tet.m[0]], &mesh_[tet.m[1]],
+      &mesh_[tet.m[2]], &mesh_[tet.m[3]]}}));
+    double area = 0.0;
+    for (auto m : tet.m) {
+      area += 0.5 * geom::norm(mesh_[m].n);
+    }
+    minInradius_ = std::min(minInradius_, 3.0 * tetVolumes_.back() / area);
+  }
 
   // initialize the per tet MolState
   tetMolStates_ = TetMolStates{tets_.size()};
+  activeTets_.clear();
+}
+
+
+// create_reaction adds rx unless its radius exceeds the smallest inradius of
+// all tets
+std::tuple<size_t, Error> State::create_reaction(BimolReaction rx) {
+  if (rx.radius() > minInradius_) {
+    return std::make_tuple(0, Error{"reaction radius " +
+      std::to_string(rx.radius()) + " exceeds the smallest tet inradius " +
+      std::to_string(minInradius_)});
+  }
+  reactions_.emplace_back(std::move(rx));
+  return std::make_tuple(reactions_.size() - 1, noErr);
+}
+
+
+// activate_tet adds tetID to the list of active tets
+void State::activate_tet(size_t tetID) {
+  auto it = std::lower_bound(activeTets_.begin(), activeTets_.end(), tetID);
+  if (it == activeTets_.end() || *it != tetID) {
+    activeTets_.insert(it, tetID);
+  }
+}
+
+
+// rebuild_active_tets recomputes the active tets by scanning all tets
+void State::rebuild_active_tets() {
+  activeTets_.clear();
+  for (size_t i = 0; i < tetMolStates_.size(); ++i) {
+    if (tetMolStates_[i].activeMols.num_mols() > 0) {
+      activeTets_.push_back(i);
+    }
+  }
+}
+
+
+// update_tet_props recomputes the face property sets of all tets
+void State::update_tet_props() {
+  tetProps_.assign(tets_.size(), 0);
+  for (size_t i = 0; i < tets_.size(); ++i) {
+    for (auto m : tets_[i].m) {
+      tetProps_[i] |= geom::prop_bit(mesh_[m].prop);
+    }
+  }
+}
+
+
+// set_orig_tet_ids sets the map from tet IDs to original tet IDs, which is
+// either empty or a permutation of all tets, and its inverse
+Error State::set_orig_tet_ids(SizeTVec origTetIDs) {
+  SizeTVec tetIDs(origTetIDs.size(), size_t(geom::Tet::unset));
+  if (!origTetIDs.empty() && origTetIDs.size() != tets_.size()) {
+    return Error{"original tet IDs don't cover all tets"};
+  }
+  for (size_t tetID = 0; tetID < origTetIDs.size(); ++tetID) {
+    size_t origID = origTetIDs[tetID];
+    if (origID >= tetIDs.size() || tetIDs[origID] != geom::Tet::unset) {
+      return Error{"original tet IDs are not a permutation"};
+    }
+    tetIDs[origID] = tetID;
+  }
+  origTetIDs_ = std::move(origTetIDs);
+  tetIDs_ = std::move(tetIDs);
+  return noErr;
+}
+
+
+// set_mesh_props assigns prop to all MeshElements meshIDs
+Error State::set_mesh_props(const SizeTVec& meshIDs, geom::MeshProp prop,
+  double passProb) {
+  if (prop == geom::MeshProp::translucent && !(passProb >= 0.0 && passProb <= 1.0)) {
+    return Error{"pass probability of translucent elements has to be in [0, 1]"};
+  }
+  for (auto m : meshIDs) {
+    if (m >= mesh_.size()) {
+      return Error{"MeshElement " + std::to_string(m) + " does not exist"};
+    }
+  }
+  if (prop == geom::MeshProp::transparent || prop == geom::MeshProp::translucent) {
+    SizeTVec boundary = geom::boundary_faces(tets_);
+    for (auto m : meshIDs) {
+      if (std::binary_search(boundary.begin(), boundary.end(), m)) {
+        return Error{"boundary elements can only be reflective or absorptive"};
+      }
+    }
+  }
+
+  for (auto m : meshIDs) {
+    mesh_[m].prop = prop;
+    mesh_[m].passProb = prop == geom::MeshProp::translucent ? passProb : 0.0;
+  }
+  update_tet_props();
+  return noErr;
 }
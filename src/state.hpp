@@ -4,13 +4,39 @@
 #ifndef STATE_HPP
 #define STATE_HPP
 
+#include <limits>
+#include <string>
+#include <tuple>
+
+#include "error.hpp"
 #include "geometry.hpp"
+#include "locator.hpp"
 #include "molecules.hpp"
 #include "rng.hpp"
 #include "species.hpp"
 #include "util.hpp"
 
 
+// CollisionMode selects how process_tet finds molecules leaving their tet.
+// In intersect mode every displacement is tested against all four faces. In
+// barycentric mode the barycentric coordinates of the end point are checked
+// first and only displacements ending outside (or very close to the boundary
+// of) the tet are tested for face intersections. Both modes skip the tests
+// for displacements shorter than the distance of a molecule from the faces
+// of its tet (see VolMols::faceDist), which exhaustive mode doesn't; it is
+// the reference the shortcuts of the other modes are checked against, since
+// all modes result in identical trajectories.
+enum class CollisionMode {
+      intersect
+    , barycentric
+    , exhaustive
+};
+
+// parse_collision_mode returns the CollisionMode called name, i.e. one of
+// intersect, barycentric, or exhaustive
+std::tuple<CollisionMode, Error> parse_collision_mode(const std::string& name);
+
+
 class State {
 
 public:
@@ -23,13 +49,22 @@ public:
   State(State&& s) = delete;
   State& operator=(State&& s) = delete;
 
+  // swap exchanges the complete content of this state and s
+  void swap(State& s);
+
   // member functions
   double rng_norm() const {
     return rng_.gen();
   }
 
-  // mesh related functionality
-  void add_geometry(const geom::Mesh& mesh, const geom::Tets& tets);
+  uint64_t seed() const noexcept {
+    return seed_;
+  }
+
+  // mesh related functionality. If reorder is set tets and MeshElements
+  // are renumbered for spatial locality (see geom::reorder_tets).
+  void add_geometry(const geom::Mesh& mesh, const geom::Tets& tets,
+    bool reorder = false);
 
   double dt() const noexcept {
     return dt_;
@@ -43,10 +78,92 @@ public:
     return tets_;
   }
 
+  // tet_props returns the set of MeshProps (see geom::prop_bit) of the four
+  // faces of tet tetID
+  uint8_t tet_props(size_t tetID) const {
+    return tetProps_[tetID];
+  }
+
+  // set_mesh_props assigns prop to all MeshElements meshIDs. passProb is the
+  // probability of molecules passing translucent elements. Elements on the
+  // boundary of the model can only be reflective or absorptive. Nothing is
+  // changed if any of meshIDs doesn't exist.
+  Error set_mesh_props(const SizeTVec& meshIDs, geom::MeshProp prop,
+    double passProb = 0.0);
+
+  // orig_tet_id maps a tet ID to the ID the tet had in the geometry passed
+  // to add_geometry and tet_id maps it back. Output listing tets goes by the
+  // original IDs so it doesn't depend on whether tets were reordered.
+  size_t orig_tet_id(size_t tetID) const {
+    return origTetIDs_.empty() ? tetID : origTetIDs_[tetID];
+  }
+
+  size_t tet_id(size_t origID) const {
+    return tetIDs_.empty() ? origID : tetIDs_[origID];
+  }
+
+  const geom::TetHitTable& hitTable() const noexcept {
+    return hitTable_;
+  }
+
+  const geom::TetBaryTable& baryTable() const noexcept {
+    return baryTable_;
+  }
+
+  const geom::TetPlaneTable& planeTable() const noexcept {
+    return planeTable_;
+  }
+
+  // tet_volumes lists the volume of each tet
+  const Rvector<double>& tet_volumes() const noexcept {
+    return tetVolumes_;
+  }
+
+  // min_inradius is the radius of the largest sphere fitting into every tet
+  double min_inradius() const noexcept {
+    return minInradius_;
+  }
+
+  const geom::TetLocator& locator() const noexcept {
+    return locator_;
+  }
+
+  const geom::TetVertexMap& vertex_map() const noexcept {
+    return vertexMap_;
+  }
+
+  CollisionMode collision_mode() const noexcept {
+    return collisionMode_;
+  }
+
+  void set_collision_mode(CollisionMode mode) noexcept {
+    collisionMode_ = mode;
+  }
+
   TetMolState& tetMols(size_t i) {
     return tetMolStates_[i];
   }
 
+  const TetMolState& tetMols(size_t i) const {
+    return tetMolStates_[i];
+  }
+
+  // active_tets lists, in increasing order, all tets which may hold active
+  // molecules. Only these tets are processed by step. Code placing molecules
+  // into a tet outside of step has to call activate_tet for it.
+  const SizeTVec& active_tets() const noexcept {
+    return activeTets_;
+  }
+
+  void set_active_tets(SizeTVec tetIDs) {
+    activeTets_ = std::move(tetIDs);
+  }
+
+  void activate_tet(size_t tetID);
+
+  // rebuild_active_tets recomputes the active tets by scanning all tets
+  void rebuild_active_tets();
+
   size_t create_species(MolSpecies spec) {
     species_.emplace_back(std::move(spec));
     return species_.size() - 1;
@@ -56,17 +173,51 @@ public:
     return species_;
   }
 
+  // create_reaction adds rx and returns its ID. Reaction partners are only
+  // searched for in the tet of a molecule and the tets sharing a vertex with
+  // it, so rx is rejected if its radius exceeds the inradius of any tet,
+  // i.e. if its interaction range could reach past the tets around even a
+  // molecule at the center of that tet. Has to be called after add_geometry.
+  std::tuple<size_t, Error> create_reaction(BimolReaction rx);
+
+  const ReactionContainer& reactions() const noexcept {
+    return reactions_;
+  }
+
 private:
 
-  mutable RngNorm rng_;
+  void update_tet_props();
+  Error set_orig_tet_ids(SizeTVec origTetIDs);
+
+  // checkpointing needs access to the complete simulation state
+  friend Error write_checkpoint(const std::string& fileName, const State& state,
+    uint64_t iter);
+  friend std::tuple<uint64_t, Error> read_checkpoint(const std::string& fileName,
+    State& state);
 
   double dt_;
 
+  uint64_t seed_;
+  mutable RngNorm rng_;
+
   geom::Mesh mesh_;
   geom::Tets tets_;
+  SizeTVec origTetIDs_;  // empty unless tets were reordered
+  SizeTVec tetIDs_;      // inverse of origTetIDs_
+  Rvector<uint8_t> tetProps_;
+  geom::TetHitTable hitTable_;
+  geom::TetBaryTable baryTable_;
+  geom::TetPlaneTable planeTable_;
+  Rvector<double> tetVolumes_;
+  double minInradius_ = std::numeric_limits<double>::infinity();
+  geom::TetLocator locator_;
+  geom::TetVertexMap vertexMap_;
+  CollisionMode collisionMode_ = CollisionMode::barycentric;
   TetMolStates tetMolStates_;
+  SizeTVec activeTets_;
 
   SpeciesContainer species_;
+  ReactionContainer reactions_;
 };
 
 #endif
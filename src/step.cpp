@@ -0,0 +1,164 @@
+// Copyright 2015 Markus Dittrich
+// Licensed under BSD license, see LICENSE file for details
+
+#include <algorithm>
+#include <iterator>
+#include <mutex>
+
+#include "diffuse.hpp"
+#include "domain.hpp"
+#include "reaction.hpp"
+#include "step.hpp"
+
+
+// number of tets handed to a thread at a time
+const size_t tetGrain = 64;
+
+
+// gather_tets runs func on all tets in tetIDs using all threads of pool and
+// returns the sorted list of tets for which func returned true
+template <typename Func>
+static SizeTVec gather_tets(ThreadPool& pool, const SizeTVec& tetIDs, Func func) {
+  SizeTVec result;
+  std::mutex mutex;
+  pool.parallel_for(tetIDs.size(), tetGrain, [&](size_t begin, size_t end) {
+    SizeTVec local;
+    for (size_t i = begin; i < end; ++i) {
+      if (func(tetIDs[i])) {
+        local.push_back(tetIDs[i]);
+      }
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    result.insert(result.end(), local.begin(), local.end());
+  });
+  parallel_sort(result, pool);
+  return result;
+}
+
+
+// receiving_tets returns the sorted list of tets which have molecules queued
+// for them in the outgoing queues of senders
+static SizeTVec receiving_tets(const State& state, ThreadPool& pool,
+  const SizeTVec& senders) {
+  SizeTVec result;
+  std::mutex mutex;
+  pool.parallel_for(senders.size(), tetGrain, [&](size_t begin, size_t end) {
+    SizeTVec local;
+    for (size_t i = begin; i < end; ++i) {
+      const auto& tet = state.tets()[senders[i]];
+      const auto& out = state.tetMols(senders[i]).outMols;
+      for (size_t j = 0; j < tet.t.size(); ++j) {
+        if (out[j].num_mols() > 0) {
+          local.push_back(tet.t[j]);
+        }
+      }
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    result.insert(result.end(), local.begin(), local.end());
+  });
+  parallel_sort(result, pool);
+  result.erase(std::unique(result.begin(), result.end()), result.end());
+  return result;
+}
+
+
+// step advances the simulation by a single iteration using all threads of
+// pool. Only active tets and tets receiving molecules are visited so the cost
+// of a step scales with the number of occupied tets rather than the size of
+// the mesh.
+size_t step(State& state, ThreadPool& pool, uint64_t iter,
+  StepCounters* counters, Subdomain* domain) {
+  PhaseTimer stepTimer(counters != nullptr ? &counters->stepTime : nullptr);
+
+  // each thread counts into its own slot, or nowhere if counting is disabled
+  Rvector<StepCounters> threadCounters(counters != nullptr ? pool.size() : 0);
+  auto thread_counters = [&threadCounters]() -> StepCounters* {
+    return threadCounters.empty() ? nullptr
+                                  : &threadCounters[ThreadPool::thread_id()];
+  };
+
+  // with a subdomain, the molecules moved and intersection tests of each tet
+  // are recorded as its work for rebalancing. This needs counters for every
+  // tet which are then added to those of the thread.
+  auto measured = [&](size_t tetID, auto func) {
+    StepCounters* c = thread_counters();
+    if (domain == nullptr) {
+      return func(c);
+    }
+    StepCounters tc;
+    auto result = func(&tc);
+    domain->add_work(tetID, tc.molsMoved + tc.intersectTests);
+    if (c != nullptr) {
+      *c += tc;
+    }
+    return result;
+  };
+
+  const SizeTVec& active = state.active_tets();
+  SizeTVec visited = active;
+
+  SizeTVec senders = gather_tets(pool, active, [&](size_t tetID) {
+    return measured(tetID, [&](StepCounters* c) {
+      return process_tet(state, tetID, iter, c);
+    }) > 0;
+  });
+
+  // with subdomains all processes go through the same rounds until no
+  // molecule is in flight anywhere
+  auto in_flight = [&]() {
+    return domain != nullptr ? domain->in_flight(senders.size())
+                             : !senders.empty();
+  };
+
+  size_t round = 0;
+  while (in_flight()) {
+    ++round;
+    if (domain != nullptr) {
+      SizeTVec ghosts = domain->exchange(state, senders);
+      SizeTVec merged;
+      merged.reserve(senders.size() + ghosts.size());
+      std::merge(senders.begin(), senders.end(), ghosts.begin(), ghosts.end(),
+        std::back_inserter(merged));
+      senders = std::move(merged);
+    }
+    SizeTVec receivers = receiving_tets(state, pool, senders);
+    pool.parallel_for(receivers.size(), tetGrain, [&](size_t begin, size_t end) {
+      StepCounters* c = thread_counters();
+      for (size_t i = begin; i < end; ++i) {
+        collect_incoming_mols(state, receivers[i], c);
+      }
+    });
+
+    // senders which don't receive any molecules themselves would otherwise
+    // keep their stale outgoing queues around
+    pool.parallel_for(senders.size(), tetGrain, [&](size_t begin, size_t end) {
+      for (size_t i = begin; i < end; ++i) {
+        clear_outgoing_mols(state, senders[i]);
+      }
+    });
+
+    senders = gather_tets(pool, receivers, [&](size_t tetID) {
+      return measured(tetID, [&](StepCounters* c) {
+        return process_incoming_mols(state, tetID, iter, round, c);
+      }) > 0;
+    });
+    visited.insert(visited.end(), receivers.begin(), receivers.end());
+  }
+  if (counters != nullptr) {
+    counters->handoffRounds += round;
+  }
+  for (const auto& c : threadCounters) {
+    *counters += c;
+  }
+
+  // from here on the active tets are all tets holding molecules which is
+  // what the reaction pass and the next step need
+  std::sort(visited.begin(), visited.end());
+  visited.erase(std::unique(visited.begin(), visited.end()), visited.end());
+  state.set_active_tets(gather_tets(pool, visited, [&](size_t tetID) {
+    return state.tetMols(tetID).activeMols.num_mols() > 0;
+  }));
+
+  PhaseTimer reactTimer(counters != nullptr ? &counters->reactTime : nullptr);
+  return react(state, pool, state.active_tets(), iter);
+}
@@ -0,0 +1,34 @@
+// Copyright 2015 Markus Dittrich
+// Licensed under BSD license, see LICENSE file for details
+
+#ifndef STEP_HPP
+#define STEP_HPP
+
+#include <cstdint>
+
+#include "counters.hpp"
+#include "state.hpp"
+#include "thread_pool.hpp"
+
+class Subdomain;
+
+// step advances the simulation by a single iteration using all threads of
+// pool. An iteration consists of a first pass in which every tet diffuses its
+// active molecules followed by rounds in which molecules that crossed a face
+// are handed to their new tet and continue along their remaining
+// displacement. Rounds repeat until no molecule is in flight. Within each pass
+// a tet only modifies its own TetMolState and draws random numbers from its
+// own stream so results are identical for any number of threads.
+// Only the tets listed in State::active_tets take part in the first pass and
+// only tets with incoming molecules in the following rounds. The list of
+// active tets is updated once all molecules have settled, followed by a
+// reaction pass (see react). Returns the number of reactions that took place.
+// If counters is given, the events and phase times of the step are added to
+// it; otherwise no counting or timing takes place.
+// If domain is given, only the tets of the subdomain are stepped and
+// molecules crossing into other subdomains are exchanged with their processes
+// during each round (see run_domains).
+size_t step(State& state, ThreadPool& pool, uint64_t iter,
+  StepCounters* counters = nullptr, Subdomain* domain = nullptr);
+
+#endif
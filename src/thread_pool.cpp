@@ -0,0 +1,98 @@
+// Copyright 2015 Markus Dittrich
+// Licensed under BSD license, see LICENSE file for details
+
+#include <algorithm>
+
+#include "thread_pool.hpp"
+
+
+thread_local size_t ThreadPool::threadID_ = 0;
+
+
+// constructor starting numThreads - 1 workers; the calling thread is the
+// remaining one
+ThreadPool::ThreadPool(size_t numThreads) {
+  for (size_t i = 1; i < numThreads; ++i) {
+    workers_.emplace_back(&ThreadPool::worker_loop, this, i);
+  }
+}
+
+
+// destructor shutting down all workers
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    quit_ = true;
+  }
+  wake_.notify_all();
+  for (auto& w : workers_) {
+    w.join();
+  }
+}
+
+
+// parallel_for splits [0, n) into chunks of at most grain elements and hands
+// them out to all threads. The call returns once all chunks have been
+// processed.
+void ThreadPool::parallel_for(size_t n, size_t grain, const WorkFunc& work) {
+  if (n == 0) {
+    return;
+  }
+  grain = std::max<size_t>(grain, 1);
+  if (workers_.empty() || n <= grain) {
+    work(0, n);
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    work_ = &work;
+    n_ = n;
+    grain_ = grain;
+    next_ = 0;
+    busy_ = workers_.size();
+    ++generation_;
+  }
+  wake_.notify_all();
+  run_chunks();
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  done_.wait(lock, [this]() { return busy_ == 0; });
+  work_ = nullptr;
+}
+
+
+// run_chunks grabs chunks of the current job until none are left
+void ThreadPool::run_chunks() {
+  while (true) {
+    size_t begin = next_.fetch_add(grain_);
+    if (begin >= n_) {
+      break;
+    }
+    (*work_)(begin, std::min(begin + grain_, n_));
+  }
+}
+
+
+// worker_loop waits for jobs and processes them until the pool shuts down.
+// id is the thread ID reported by thread_id on the worker.
+void ThreadPool::worker_loop(size_t id) {
+  threadID_ = id;
+  uint64_t seen = 0;
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      wake_.wait(lock, [this, seen]() { return quit_ || generation_ != seen; });
+      if (quit_) {
+        return;
+      }
+      seen = generation_;
+    }
+    run_chunks();
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      --busy_;
+    }
+    done_.notify_one();
+  }
+}
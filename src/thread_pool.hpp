@@ -0,0 +1,121 @@
+// Copyright 2015 Markus Dittrich
+// Licensed under BSD license, see LICENSE file for details
+
+#ifndef THREAD_POOL_HPP
+#define THREAD_POOL_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+#include "util.hpp"
+
+
+// ThreadPool keeps a fixed set of worker threads around for executing
+// data parallel loops. The calling thread participates in the work so a pool
+// of size 1 runs everything serially without any synchronization overhead.
+class ThreadPool {
+
+public:
+
+  // work functions are called with a half open index range [begin, end)
+  using WorkFunc = std::function<void(size_t begin, size_t end)>;
+
+  explicit ThreadPool(size_t numThreads);
+  ~ThreadPool();
+
+  // don't allow copy & move operations
+  ThreadPool(const ThreadPool& p) = delete;
+  ThreadPool& operator=(const ThreadPool& p) = delete;
+  ThreadPool(ThreadPool&& p) = delete;
+  ThreadPool& operator=(ThreadPool&& p) = delete;
+
+  size_t size() const noexcept {
+    return workers_.size() + 1;
+  }
+
+  // thread_id returns the index in [1, size()) of the calling thread if it is
+  // a worker of a pool and 0 otherwise. This lets work functions keep per
+  // thread data in an array of size() entries.
+  static size_t thread_id() noexcept {
+    return threadID_;
+  }
+
+  // parallel_for splits [0, n) into chunks of at most grain elements and
+  // hands them out to all threads. The call returns once all chunks have been
+  // processed.
+  void parallel_for(size_t n, size_t grain, const WorkFunc& work);
+
+private:
+
+  void worker_loop(size_t id);
+  void run_chunks();
+
+  static thread_local size_t threadID_;
+
+  Rvector<std::thread> workers_;
+
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  std::condition_variable done_;
+  uint64_t generation_ = 0;   // incremented for each new parallel_for
+  size_t busy_ = 0;           // number of workers still working on a job
+  bool quit_ = false;
+
+  // current job
+  const WorkFunc* work_ = nullptr;
+  size_t n_ = 0;
+  size_t grain_ = 1;
+  std::atomic<size_t> next_{0};
+};
+
+
+// parallel_sort sorts v according to comp using all threads of pool. The
+// vector is split into one chunk per thread which are sorted concurrently and
+// then merged pairwise. For a strict weak ordering without equivalent elements
+// the result is the same as that of std::sort.
+template <typename T, typename Compare = std::less<T>>
+void parallel_sort(Rvector<T>& v, ThreadPool& pool, Compare comp = Compare()) {
+  size_t numChunks = pool.size();
+  if (numChunks < 2 || v.size() < 2 * numChunks) {
+    std::sort(v.begin(), v.end(), comp);
+    return;
+  }
+
+  Rvector<size_t> bounds;
+  for (size_t c = 0; c <= numChunks; ++c) {
+    bounds.push_back(c * v.size() / numChunks);
+  }
+  pool.parallel_for(numChunks, 1, [&](size_t begin, size_t end) {
+    for (size_t c = begin; c < end; ++c) {
+      std::sort(v.begin() + bounds[c], v.begin() + bounds[c + 1], comp);
+    }
+  });
+
+  Rvector<T> buf(v.size());
+  Rvector<T>* src = &v;
+  Rvector<T>* dst = &buf;
+  for (size_t width = 1; width < numChunks; width *= 2) {
+    size_t numMerges = (numChunks + 2 * width - 1) / (2 * width);
+    pool.parallel_for(numMerges, 1, [&](size_t begin, size_t end) {
+      for (size_t m = begin; m < end; ++m) {
+        size_t lo = bounds[2 * m * width];
+        size_t mid = bounds[std::min(2 * m * width + width, numChunks)];
+        size_t hi = bounds[std::min(2 * m * width + 2 * width, numChunks)];
+        std::merge(src->begin() + lo, src->begin() + mid,
+                   src->begin() + mid, src->begin() + hi,
+                   dst->begin() + lo, comp);
+      }
+    });
+    std::swap(src, dst);
+  }
+  if (src != &v) {
+    v.swap(*src);
+  }
+}
+
+#endif
@@ -17,19 +17,55 @@ inline bool same(double x, double y) {
 }
 
 
-// range checked vector implementation
-template<typename T>
+// CheckedIndex is an index policy for Rvector which checks all indices and
+// throws std::out_of_range for invalid ones
+struct CheckedIndex {
+  template<typename V>
+  static auto& get(V& v, size_t i) {
+    return v.at(i);
+  }
+};
+
+
+// UncheckedIndex is an index policy for Rvector which accesses elements
+// without any checks
+struct UncheckedIndex {
+  template<typename V>
+  static auto& get(V& v, size_t i) {
+    return v.data()[i];
+  }
+};
+
+
+// Indices are checked in debug builds, in builds with MCELL_BOUNDS_CHECK
+// defined (see the MCELL_BOUNDS_CHECK CMake option), and under address
+// sanitizer. Release builds index without checks.
+#if defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define MCELL_ASAN 1
+#endif
+#endif
+#if defined(MCELL_BOUNDS_CHECK) || defined(__SANITIZE_ADDRESS__) || defined(MCELL_ASAN)
+using DefaultIndexPolicy = CheckedIndex;
+#else
+using DefaultIndexPolicy = UncheckedIndex;
+#endif
+
+
+// vector implementation whose operator[] is range checked according to
+// IndexPolicy
+template<typename T, typename IndexPolicy = DefaultIndexPolicy>
 class Rvector : public std::vector<T> {
 
 public:
   using std::vector<T>::vector;
 
-  T& operator[](int i) {
-    return std::vector<T>::at(i);
+  T& operator[](size_t i) {
+    return IndexPolicy::get(static_cast<std::vector<T>&>(*this), i);
   }
 
-  const T& operator[](int i) const {
-    return std::vector<T>::at(i);
+  const T& operator[](size_t i) const {
+    return IndexPolicy::get(static_cast<const std::vector<T>&>(*this), i);
   }
 };
 
@@ -39,8 +75,8 @@ using SizeTVec = Rvector<size_t>;
 
 
 // operator<< for Rvector for debugging purposes
-template<typename T>
-std::ostream& operator<<(std::ostream& os, const Rvector<T>& rvec) {
+template<typename T, typename IndexPolicy>
+std::ostream& operator<<(std::ostream& os, const Rvector<T, IndexPolicy>& rvec) {
   os << "[";
   for (const auto& v : rvec) {
     os << v << ",";
@@ -11,13 +11,32 @@
 
 namespace geom {
 
-// Vec3 represents a 3D vector
-struct Vec3 {
-  double x = 0.0;
-  double y = 0.0;
-  double z = 0.0;
+// BasicVec3 represents a 3D vector with components of type T. Conversions
+// between different component types have to be explicit since narrowing a
+// double vector to float looses precision.
+template<typename T>
+struct BasicVec3 {
+
+  using value_type = T;
+
+  constexpr BasicVec3() = default;
+  constexpr BasicVec3(T x_, T y_, T z_) : x{x_}, y{y_}, z{z_} {}
+
+  template<typename U>
+  constexpr explicit BasicVec3(const BasicVec3<U>& v)
+    : x{T(v.x)}, y{T(v.y)}, z{T(v.z)} {}
+
+  T x = 0;
+  T y = 0;
+  T z = 0;
 };
 
+// Vec3 is the double precision vector used for all geometry
+using Vec3 = BasicVec3<double>;
+
+// Vec3f is the single precision vector used for compact molecule storage
+using Vec3f = BasicVec3<float>;
+
 
 // same compares two floating point values for equality
 // NOTE: This wrapper is currently not very sophisticated. Needs more work.
@@ -27,25 +46,29 @@ inline bool same(double x, double y) {
 
 
 // squared vector norm
-inline double norm2(const Vec3& v) noexcept {
+template<typename T>
+inline T norm2(const BasicVec3<T>& v) noexcept {
     return v.x*v.x + v.y*v.y + v.z*v.z;
 }
 
 
 // vector norm
-inline double norm(const Vec3& v) {
-  return sqrt(norm2(v));
+template<typename T>
+inline T norm(const BasicVec3<T>& v) {
+  return std::sqrt(norm2(v));
 }
 
 
 // operator+ provides vector addition
-inline Vec3 operator+(const Vec3& a, const Vec3& b) noexcept {
-  return Vec3{a.x + b.x, a.y + b.y, a.z + b.z};
+template<typename T>
+inline BasicVec3<T> operator+(const BasicVec3<T>& a, const BasicVec3<T>& b) noexcept {
+  return BasicVec3<T>{a.x + b.x, a.y + b.y, a.z + b.z};
 }
 
 
 // operator+= provides in place vector addition
-inline Vec3& operator+=(Vec3& a, const Vec3& b) noexcept {
+template<typename T>
+inline BasicVec3<T>& operator+=(BasicVec3<T>& a, const BasicVec3<T>& b) noexcept {
   a.x += b.x;
   a.y += b.y;
   a.z += b.z;
@@ -54,13 +77,15 @@ inline Vec3& operator+=(Vec3& a, const Vec3& b) noexcept {
 
 
 // operator- provides vector subtraction
-inline Vec3 operator-(const Vec3& a, const Vec3& b) noexcept {
-  return Vec3{a.x - b.x, a.y - b.y, a.z - b.z};
+template<typename T>
+inline BasicVec3<T> operator-(const BasicVec3<T>& a, const BasicVec3<T>& b) noexcept {
+  return BasicVec3<T>{a.x - b.x, a.y - b.y, a.z - b.z};
 }
 
 
 // operator-= provides in place vector subtraction
-inline Vec3& operator-=(Vec3& a, const Vec3& b) noexcept {
+template<typename T>
+inline BasicVec3<T>& operator-=(BasicVec3<T>& a, const BasicVec3<T>& b) noexcept {
   a.x -= b.x;
   a.y -= b.y;
   a.z -= b.z;
@@ -69,38 +94,46 @@ inline Vec3& operator-=(Vec3& a, const Vec3& b) noexcept {
 
 
 // operator<< for Vec3 is intended mostly to help with debugging
-inline std::ostream& operator<<(std::ostream& os, const Vec3& v) {
+template<typename T>
+inline std::ostream& operator<<(std::ostream& os, const BasicVec3<T>& v) {
   return os << "{" << v.x << "," << v.y << "," << v.z << "}";
 }
 
 
 // operator* implements a dot product between two Vec3s
-// and a scalar multiplication between a Vec3 and a double
-inline double operator*(const Vec3& a, const Vec3& b) noexcept {
+// and a scalar multiplication between a Vec3 and a scalar. The scalar's type
+// isn't deduced so double factors keep working for float vectors.
+template<typename T>
+inline T operator*(const BasicVec3<T>& a, const BasicVec3<T>& b) noexcept {
   return (a.x*b.x + a.y*b.y + a.z*b.z);
 }
 
-inline Vec3 operator*(double r, const Vec3& a) noexcept {
-  return Vec3{r * a.x, r * a.y, r * a.z};
+template<typename T>
+inline BasicVec3<T> operator*(typename BasicVec3<T>::value_type r,
+  const BasicVec3<T>& a) noexcept {
+  return BasicVec3<T>{r * a.x, r * a.y, r * a.z};
 }
 
 
 // operator== provides vector comparison
-inline bool operator==(const Vec3& a, const Vec3& b) {
+template<typename T>
+inline bool operator==(const BasicVec3<T>& a, const BasicVec3<T>& b) {
   return same(a.x, b.x) && same(a.y, b.y) && same(a.z, b.z);
 }
 
 
 // cross provides a cross product between two Vec3s
-inline Vec3 cross(const Vec3& a, const Vec3& b) noexcept {
-  return Vec3{(a.y * b.z) - (a.z * b.y)
-             ,(a.z * b.x) - (a.x * b.z)
-             ,(a.x * b.y) - (a.y * b.x)};
+template<typename T>
+inline BasicVec3<T> cross(const BasicVec3<T>& a, const BasicVec3<T>& b) noexcept {
+  return BasicVec3<T>{(a.y * b.z) - (a.z * b.y)
+                     ,(a.z * b.x) - (a.x * b.z)
+                     ,(a.x * b.y) - (a.y * b.x)};
 }
 
 
 // normalize returns a normalized version of the supplied vector
-inline Vec3 normalize(const Vec3& a) {
+template<typename T>
+inline BasicVec3<T> normalize(const BasicVec3<T>& a) {
   return (1 / norm(a)) * a;
 }
 